@@ -7,3 +7,29 @@
 
 // CONFIG_DEBUG_MM: Enable particularly expensive MM-related bugchecks.
 //#define CONFIG_DEBUG_MM
+
+// CONFIG_DEBUG_LOCKS: Track which CPU holds each spinlock, and which spinlocks
+// each CPU holds, to catch recursive locking and switching with locks held.
+// Every lock and unlock pays for this, so leave it out of production builds.
+#define CONFIG_DEBUG_LOCKS
+
+// CONFIG_SPINLOCK_MCS: Use queued (MCS) spinlocks instead of ticket locks.
+// Waiters queue up and each spins on a line of its own, so contended locks
+// don't bounce a single cache line between every waiting CPU.
+//#define CONFIG_SPINLOCK_MCS
+
+// CONFIG_LOCK_STAT: Count spinlock acquisitions, and time how long each lock
+// is waited for and held, by the callsite which took it. The worst offenders
+// are listed in /dev/lockstat and by SysRq-L.
+//#define CONFIG_LOCK_STAT
+
+// CONFIG_FRAME_POINTER: Build the kernel with frame pointers, costing a
+// register, so that the profiler can record the stack above each kernel
+// sample. Without them only the function which was interrupted is recorded.
+//#define CONFIG_FRAME_POINTER
+
+// CONFIG_TRACE: Build in tracepoints for context switches, wakeups, syscalls,
+// IRQs, page allocations and packets sent, which record into a ring per CPU
+// while switched on through /dev/trace. util/trace2json converts a dump of
+// /dev/trace for chrome://tracing or Perfetto.
+#define CONFIG_TRACE
@@ -10,9 +10,19 @@
 
 #define APIC_CMD_FLAG_ASSERT  (1 << 14)
 
+//The rate the local timers tick at, unless something (the profiler) asks for
+//more
+#define APIC_TIMER_HZ 1
+
+//Whether the local APICs are taking interrupts, rather than the legacy PIC
+extern bool apic_in_use;
+
 uint32_t apic_get_id();
 void apic_issue_command(uint8_t target_id, uint16_t type, uint32_t flags, uint8_t vector);
 
+//Make every CPU's timer fire hz times a second, from its next tick on
+void apic_set_timer_hz(uint32_t hz);
+
 void __init apic_enable();
 void __init apic_init(phys_addr_t base);
 
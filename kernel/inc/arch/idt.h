@@ -23,7 +23,13 @@ extern bool (*is_spurious)(uint32_t vector);
 void idt_init();
 
 void register_isr(uint8_t vector, uint8_t cpl, void (*handler)(interrupt_t *interrupt, void *data), void *data);
+//Returns a vector no other device is using, or 0 if they have all gone
+uint8_t alloc_irq_vector();
+
 void idt_set_isr(uint32_t gate, uint32_t isr);
 void interrupt_dispatch(interrupt_t * reg);
 
+//Number of times vector has fired, over all CPUs (wrapping at 2^32)
+uint32_t irq_count(uint8_t vector);
+
 #endif
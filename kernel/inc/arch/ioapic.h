@@ -9,4 +9,9 @@ void register_ioint(uint16_t flags, uint8_t bus_id, uint8_t bus_irq, uint8_t ioa
 
 uint8_t find_pci_ioint(uint8_t dev_num);
 
+//Affinity masks have bit n set if the interrupt may go to CPU number n. Both
+//return -ENODEV for vectors which no IOAPIC delivers.
+int32_t ioapic_get_affinity(uint8_t vec, uint32_t *mask, uint32_t *cpu);
+int32_t ioapic_set_affinity(uint8_t vec, uint32_t mask);
+
 #endif
@@ -3,10 +3,19 @@
 
 #define NUM_ENTRIES 1024
 #define KERNEL_NUM_TABLES 256
+//RAM is mapped at VIRTUAL_BASE + phys using at most this many of the kernel
+//tables (768MB), the rest are left for map_pages().
+#define DIRECT_MAP_TABLES 192
 
 #define MMUFLAG_PRESENT     (1 << 0)
 #define MMUFLAG_WRITABLE    (1 << 1)
 #define MMUFLAG_USER        (1 << 2)
+//Only valid in a page directory entry
+#define MMUFLAG_LARGE       (1 << 7)
+#define MMUFLAG_GLOBAL      (1 << 8)
+
+#define CR4_PSE (1 << 4)
+#define CR4_PGE (1 << 7)
 
 #include "common/types.h"
 
@@ -34,7 +43,7 @@ static inline phys_addr_t page_to_phys(page_t *page) {
 }
 
 static inline void * phys_to_virt(phys_addr_t phys) {
-    return page_to_virt(phys_to_page(phys));
+    return (void *) (VIRTUAL_BASE + phys);
 }
 
 struct pdir_ent {
@@ -130,8 +139,13 @@ static inline phys_addr_t dir_lookup_addr(pdir_t *dir, void *addr) {
     return tab_lookup_addr(tab, addr);
 }
 
+extern uint32_t direct_map_end;
+
 static inline phys_addr_t virt_to_phys(void *addr) {
     if(!addr) return 0;
+    if(((uint32_t) addr) >= VIRTUAL_BASE && ((uint32_t) addr) < direct_map_end) {
+        return ((uint32_t) addr) - VIRTUAL_BASE;
+    }
     return tab_lookup_addr(&kptab[addr_to_diridx(addr) - addr_to_diridx((void *) VIRTUAL_BASE)], addr);
 }
 
@@ -147,6 +161,23 @@ static inline void loadcr3(uint32_t phys) {
     asm volatile("mov %0, %%cr3" :: "a" (phys));
 }
 
+static inline uint32_t readcr4() {
+    uint32_t val;
+    asm volatile("mov %%cr4, %0" : "=r" (val));
+    return val;
+}
+
+static inline void loadcr4(uint32_t val) {
+    asm volatile("mov %0, %%cr4" :: "r" (val) : "memory");
+}
+
+//Flushes all non-global TLB entries
+static inline void flush_tlb() {
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0\n"
+                 "mov %0, %%cr3" : "=r" (cr3) :: "memory");
+}
+
 #define virt_is_valid(task, addr) ({                                          \
     ptab_t *tab;                                                              \
     if(task && ((uint32_t) addr) < VIRTUAL_BASE) {                            \
@@ -171,7 +202,11 @@ page_t * user_get_page(thread_t *task, void *virt);
 void user_map_page(thread_t *task, void *virt, phys_addr_t page);
 void user_map_pages(thread_t *task, void *virt, phys_addr_t page, uint32_t num);
 page_t * user_alloc_page(thread_t *task, void *virt, uint32_t flags);
+//The number of pages mapped into task's user address space
+uint32_t user_count_pages(thread_t *task);
+
+extern uint32_t mmu_cr4_features;
 
-void * __init mmu_init(phys_addr_t kernel_end, phys_addr_t malloc_start);
+void __init mmu_init(phys_addr_t mem_end);
 
 #endif
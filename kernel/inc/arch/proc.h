@@ -43,8 +43,10 @@ static inline volatile void * get_percpu_ptr();
 typedef struct thread thread_t;
 
 DECLARE_PER_CPU(thread_t *, current_task);
+#ifdef CONFIG_DEBUG_LOCKS
 DECLARE_PER_CPU(uint32_t, locks_held);
 DECLARE_PER_CPU(list_head_t, lock_list);
+#endif
 
 #include "common/compiler.h"
 #include "common/asm.h"
@@ -63,11 +65,15 @@ static inline volatile void * get_percpu_ptr() {
 
 extern volatile bool percpu_up;
 
+#ifdef CONFIG_DEBUG_LOCKS
 #define check_no_locks_held() do {                                         \
     if(get_percpu(locks_held)) {                                           \
         panicf("%X locks held, %X", get_percpu(locks_held), list_first(&get_percpu(lock_list), spinlock_t, list));             \
     }                                                                      \
 } while(0)
+#else
+#define check_no_locks_held() do {} while(0)
+#endif
 
 void arch_setup_proc(processor_t *proc);
 
@@ -6,6 +6,36 @@
 #include "common/asm.h"
 #include "bug/check.h"
 
+#ifdef CONFIG_DEBUG_LOCKS
+    #define SPINLOCK_ARCH_HOLDER_INIT .holder = 0xFFFF,
+#else
+    #define SPINLOCK_ARCH_HOLDER_INIT
+#endif
+
+#ifdef CONFIG_SPINLOCK_MCS
+
+//A waiter's place in the queue, which lives on its stack while it waits
+typedef struct mcs_node {
+    struct mcs_node * volatile next;
+    //Set once this waiter reaches the front of the queue
+    volatile bool head;
+} mcs_node_t;
+
+//Only the waiter at the front of the queue spins on locked, everyone else
+//spins on their own node
+typedef struct spinlock_arch {
+    volatile uint32_t locked;
+    mcs_node_t * volatile tail;
+#ifdef CONFIG_DEBUG_LOCKS
+    uint32_t holder;
+#endif
+} PACKED spinlock_arch_t;
+
+#define SPINLOCK_ARCH_LOCKED   {.locked = 1, .tail = NULL, SPINLOCK_ARCH_HOLDER_INIT}
+#define SPINLOCK_ARCH_UNLOCKED {.locked = 0, .tail = NULL, SPINLOCK_ARCH_HOLDER_INIT}
+
+#else
+
 typedef uint16_t ticket_t;
 
 //Must be strictly in this order, or else head will overflow into tail
@@ -20,11 +50,15 @@ typedef struct spinlock_arch  {
         ticket_pair_t tickets;
         uint32_t raw;
     };
+#ifdef CONFIG_DEBUG_LOCKS
     uint32_t holder;
+#endif
 } PACKED spinlock_arch_t;
 
-#define SPINLOCK_ARCH_LOCKED   {.tickets.head = 0, .tickets.tail = 1, .holder = 0xFFFF}
-#define SPINLOCK_ARCH_UNLOCKED {.tickets.head = 0, .tickets.tail = 0, .holder = 0xFFFF}
+#define SPINLOCK_ARCH_LOCKED   {.tickets.head = 0, .tickets.tail = 1, SPINLOCK_ARCH_HOLDER_INIT}
+#define SPINLOCK_ARCH_UNLOCKED {.tickets.head = 0, .tickets.tail = 0, SPINLOCK_ARCH_HOLDER_INIT}
+
+#endif
 
 #define spin_lock(x) \
     {                                \
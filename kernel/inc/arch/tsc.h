@@ -8,6 +8,8 @@
 extern clock_t tsc_clock;
 
 uint64_t rdtsc();
+//Time since tsc_init() at the given rdtsc() value, or 0 if unknown
+uint64_t tsc_to_micros(uint64_t tsc);
 
 void __init tsc_init();
 void tsc_busywait_100ms();
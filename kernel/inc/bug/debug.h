@@ -11,9 +11,26 @@ void breakpoint_triggered();
 void dump_stack_trace(console_t *t);
 
 void debug_remap();
+
+//Lookups in the kernel's symbol table are O(log n) once the initcalls have
+//started, and a linear scan before that
 const elf_symbol_t * debug_lookup_symbol(uint32_t address);
 const char * debug_symbol_name(const elf_symbol_t *symbol);
 
+//An index of the functions in an ELF symbol table, by address. If owned, the
+//tables (from kmalloc) are freed along with the index.
+typedef struct symbol_index symbol_index_t;
+
+symbol_index_t * symbol_index_build(const elf_symbol_t *symtab, uint32_t num,
+    const char *strtab, uint32_t strtabsz, bool owned);
+void symbol_index_get(symbol_index_t *index);
+void symbol_index_put(symbol_index_t *index);
+
+const elf_symbol_t * symbol_index_lookup(symbol_index_t *index,
+    uint32_t address);
+const char * symbol_index_name(symbol_index_t *index,
+    const elf_symbol_t *symbol);
+
 phys_addr_t __init debug_kernel_start(phys_addr_t raw);
 phys_addr_t __init debug_kernel_end(phys_addr_t raw);
 
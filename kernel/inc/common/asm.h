@@ -23,6 +23,12 @@ static inline void sti() {
 
 #define hlt() do { __asm__ volatile("hlt"); } while(0)
 
+static inline void cpuid(uint32_t leaf, uint32_t *a, uint32_t *b,
+    uint32_t *c, uint32_t *d) {
+    __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+        : "a"(leaf), "c"(0));
+}
+
 static inline void ltr(uint32_t idx) {
     __asm__ volatile("ltr %%ax" :: "a" (idx));
 }
@@ -9,6 +9,7 @@
 #define __used __attribute__((used))
 #define __forceinline __attribute__((always_inline))
 #define __noreturn  __attribute__((noreturn))
+#define __noinline  __attribute__((noinline))
 
 #define FALLTHROUGH __attribute__((fallthrough))
 
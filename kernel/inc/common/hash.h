@@ -36,6 +36,24 @@ static inline uint32_t hash_32(uint32_t key, uint32_t bits) {
 	return hash >> (32 - bits);
 }
 
+//FNV-1a, which can be fed a string one character at a time
+#define STR_HASH_INIT  0x811c9dc5UL
+#define STR_HASH_PRIME 0x01000193UL
+
+static inline uint32_t str_hash_step(uint32_t hash, char c) {
+    return (hash ^ (uint8_t) c) * STR_HASH_PRIME;
+}
+
+static inline uint32_t str_hash(const char *str, uint32_t len) {
+    uint32_t hash = STR_HASH_INIT;
+
+    for(uint32_t i = 0; i < len; i++) {
+        hash = str_hash_step(hash, str[i]);
+    }
+
+    return hash;
+}
+
 static inline uint32_t str_to_key(const char *str, uint32_t len) {
     uint32_t key = 1;
 
@@ -19,6 +19,7 @@
 
 #define PCI_WORD_VENDOR 0x00
 #define PCI_WORD_DEVICE 0x02
+#define PCI_WORD_STATUS 0x06
 
 //Header type 0x00
 #define PCI_BYTE_REVISN 0x08
@@ -26,11 +27,19 @@
 #define PCI_BYTE_SCLASS 0x0A
 #define PCI_BYTE_CLASS  0x0B
 #define PCI_BYTE_HEADER 0x0E
+#define PCI_BYTE_CAPPTR 0x34
 #define PCI_BYTE_INTRPT 0x3C
 
 //Header type 0x01
 #define PCI_BYTE_2NDBUS 0x19
 
+//Status Register bits
+#define PCI_STATUS_CAPS (1 << 4)  //Capability List present
+
+//Capability IDs
+#define PCI_CAP_MSI     0x05
+#define PCI_CAP_MSIX    0x11
+
 #define BAR_TYPE(x)     (x & 0x7)
 #define BAR_ADDR_32(x)  (x & 0xFFFFFFFC)
 #define BAR_ADDR_64(x)  ((x & 0xFFFFFFF0) + ((*((&x) + 1) & 0xFFFFFFFF) << 32))
@@ -48,7 +57,9 @@ typedef struct pci_device {
     device_t device;
     pci_ident_t ident;
     pci_loc_t loc;
+    //The IOAPIC (or PIC) vector of the INTx line, until MSI is enabled
     volatile uint8_t interrupt;
+    bool msi;
     uint32_t bar[6];
 } pci_device_t;
 
@@ -65,5 +76,17 @@ uint16_t pci_readw(pci_loc_t loc, uint16_t offset);
 uint8_t pci_readb(pci_loc_t loc, uint16_t offset);
 
 void pci_writel(pci_loc_t loc, uint16_t offset, uint32_t val);
+void pci_writew(pci_loc_t loc, uint16_t offset, uint16_t val);
+
+//Returns the config space offset of the first capability with the given id, or
+//0 if the device doesn't have one
+uint8_t pci_find_cap(pci_device_t *dev, uint8_t id);
+
+//Switch dev over to message signalled interrupts (MSI-X if it has them, plain
+//MSI otherwise), on an edge triggered vector of its own aimed at a single CPU.
+//On success dev->interrupt becomes that vector and true is returned, otherwise
+//the device is left on its INTx line, as it always is while the legacy PIC is
+//in use. The device must already be a bus master.
+bool pci_enable_msi(pci_device_t *dev);
 
 #endif
@@ -19,6 +19,7 @@
 #define B_KEY      0x30
 #define C_KEY      0x2e
 #define S_KEY      0x1f
+#define L_KEY      0x26
 
 #define CAPS_KEY   0x3a
 #define LSHIFT_KEY 0x2a
@@ -43,6 +44,16 @@ typedef struct console {
     uint32_t row, col;
     char color;
 
+    //The screen is drawn into a ring of rows in RAM (which also holds the
+    //scrollback), and dirty rows are copied out to vram in batches.
+    uint16_t *shadow;
+    uint32_t top;
+    uint32_t view;
+    uint32_t history;
+    uint32_t dirty;
+    uint16_t cursor_pos;
+    bool deferred;
+
     term_state_t state;
 
     char *escseq_buff;
@@ -68,6 +79,9 @@ void vram_color(console_t *con, char c);
 void vram_clear(console_t *con);
 void vram_write(console_t *con, const char *str, size_t len);
 void vram_cursor(console_t *con, uint8_t r, uint8_t c);
+//Scroll the view rows further back into the scrollback (or forward, if
+//negative).
+void vram_scrollback(console_t *con, int32_t rows);
 void vram_puts(console_t *con, const char* str);
 void vram_putsf(console_t *con, const char* str, ...);
 
@@ -10,6 +10,10 @@ typedef struct char_device_ops char_device_ops_t;
 
 struct char_device_ops {
     ssize_t (*read)(char_device_t *device, char *buff, size_t len);
+    //Optional, used instead of read. pos is the reading file's own position,
+    //which the device may advance in whatever units suit it.
+    ssize_t (*read_at)(char_device_t *device, char *buff, size_t len,
+        uint32_t *pos);
     ssize_t (*write)(char_device_t *device, const char *buff, size_t len);
     ssize_t (*poll)(char_device_t *device, fpoll_data_t *fp);
 };
@@ -93,6 +93,24 @@ typedef struct elf32_phdr {
   Elf32_Word	p_align;
 } PACKED Elf32_Phdr;
 
+#define SHT_NULL     0
+#define SHT_PROGBITS 1
+#define SHT_SYMTAB   2
+#define SHT_STRTAB   3
+
+typedef struct elf32_shdr {
+  Elf32_Word	sh_name;
+  Elf32_Word	sh_type;
+  Elf32_Word	sh_flags;
+  Elf32_Addr	sh_addr;
+  Elf32_Off	    sh_offset;
+  Elf32_Word	sh_size;
+  Elf32_Word	sh_link;
+  Elf32_Word	sh_info;
+  Elf32_Word	sh_addralign;
+  Elf32_Word	sh_entsize;
+} PACKED Elf32_Shdr;
+
 #define ELF32_ST_TYPE(i) ((i) & 0xf)
 #define ELF32_ST_BIND(i) ((i) >> 4)
 #define ELF32_ST_INFO(b, t) (((b) << 4) + ((t) & 0xF))
@@ -0,0 +1,26 @@
+#ifndef KERNEL_FS_PIPE_H
+#define KERNEL_FS_PIPE_H
+
+#include "common/types.h"
+#include "fs/vfs.h"
+
+//Writes of at most this many bytes are never interleaved with other writes
+#define PIPE_ATOMIC 512
+
+#define SPLICE_F_NONBLOCK 0x02
+
+//Returns the read end and the write end of a new anonymous pipe
+void pipe_create(file_t **read, file_t **write);
+
+//Returns a new FIFO inode for fs, whose files share one pipe
+inode_t * fifo_inode_alloc(fs_t *fs);
+
+//Describe an anonymous pipe, which has no inode. Returns -EINVAL if file isn't
+//a pipe at all.
+int32_t pipe_getattr(file_t *file, stat_t *stat);
+
+//Move up to len bytes from in to out, at least one of which must be a pipe,
+//without copying through a buffer of the caller's.
+ssize_t vfs_splice(file_t *in, file_t *out, size_t len, uint32_t flags);
+
+#endif
@@ -3,6 +3,8 @@
 
 #include "common/types.h"
 
-void rootramfs_load(void *start, uint32_t len);
+//Populate the root fs from the image at start. Returns true if the image has
+//to stay resident (its pages now back files), false if it may be freed.
+bool rootramfs_load(void *start, uint32_t len);
 
 #endif
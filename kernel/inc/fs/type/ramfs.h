@@ -0,0 +1,17 @@
+#ifndef KERNEL_FS_TYPE_RAMFS_H
+#define KERNEL_FS_TYPE_RAMFS_H
+
+#include "common/types.h"
+#include "mm/mm.h"
+#include "fs/vfs.h"
+
+//Produces block idx of a file's initial contents. The returned page then
+//belongs to the file.
+typedef page_t * (*ramfs_fill_t)(void *private, uint32_t idx);
+
+//Give a freshly created, empty ramfs file size bytes of contents, which are
+//only brought in (by calling fill) a block at a time, on first access.
+void ramfs_set_source(inode_t *inode, uint32_t size, ramfs_fill_t fill,
+    void *private);
+
+#endif
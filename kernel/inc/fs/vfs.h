@@ -101,11 +101,10 @@ extern mount_t *root_mount;
 #include "common/types.h"
 #include "common/list.h"
 #include "common/hashtable.h"
+#include "sync/atomic.h"
 #include "fs/fd.h"
 #include "fs/block.h"
 
-#define DENTRY_HASH_BITS 5
-
 struct fs_type {
     const char *name;
     uint32_t flags;
@@ -143,8 +142,10 @@ struct file {
     path_t path;
     file_ops_t *ops;
 
-    uint32_t refs;
+    atomic_t refs;
 
+    //The O_* flags the file was opened with
+    uint32_t flags;
     uint32_t offset;
     void *private;
 };
@@ -204,23 +205,37 @@ struct inode_ops {
 
     int32_t (*create)(inode_t *inode, dentry_t *d, uint32_t mode);
     void (*getattr)(dentry_t *dentry, stat_t *stat);
+
+    //Optional. Set the size of a regular file, discarding data past the end.
+    int32_t (*truncate)(inode_t *inode, uint32_t size);
 };
 
 struct dentry {
     fs_t *fs;
     const char *name;
+    uint32_t len;
+    uint32_t hash;
     uint32_t flags;
 
+    //NULL for a negative dentry, which caches a failed lookup
     inode_t *inode;
 
+    //Users, plus one for each hashed child. Dentries from dentry_alloc() also
+    //start with a reference for their fs, as they are the only record of
+    //their file. Only those built by a lookup() drop this, and so sit on the
+    //dcache LRU once unused, to be reclaimed and looked up again later.
+    atomic_t refs;
+    //Set by path walks, gives unused dentries a second chance on the LRU
+    bool referenced;
+
     dentry_t *parent;
-    DECLARE_HASHTABLE(children_tab, DENTRY_HASH_BITS);
     list_head_t children_list;
 
     void *private;
 
     hashtable_node_t node;
     list_head_t list;
+    list_head_t lru;
 };
 
 struct stat {
@@ -253,6 +268,11 @@ file_t * file_alloc(file_ops_t *ops);
 
 void dentry_activate(dentry_t *child, dentry_t *parent);
 
+void dentry_get(dentry_t *dentry);
+void dentry_put(dentry_t *dentry);
+void path_get(path_t *path);
+void path_put(path_t *path);
+
 void register_fs_type(fs_type_t *fs_type);
 
 mount_t * vfs_mount(const char *raw_type, const char *device, path_t *mountpoint);
@@ -280,10 +300,14 @@ dentry_t * fs_create_single(fs_type_t *type, void (*fill)(fs_t *fs));
 void vfs_getattr(dentry_t *dentry, stat_t *stat);
 void generic_getattr(inode_t *inode, stat_t *stat);
 
+//On success the returned path holds a reference, which must be dropped with
+//path_put(). The same goes for the path filled by vfs_create().
 int32_t vfs_lookup(const path_t *start, const char *path, path_t *out);
-file_t * vfs_open_file(path_t *path);
+file_t * vfs_open_file(path_t *path, uint32_t flags);
 int32_t vfs_close_file(file_t *file);
 
+int32_t vfs_truncate(path_t *path, uint32_t size);
+
 off_t vfs_seek(file_t *file, uint32_t off, int whence);
 ssize_t vfs_read(file_t *file, void *buff, size_t bytes);
 ssize_t vfs_write(file_t *file, const void *buff, size_t bytes);
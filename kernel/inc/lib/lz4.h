@@ -0,0 +1,11 @@
+#ifndef KERNEL_LIB_LZ4_H
+#define KERNEL_LIB_LZ4_H
+
+#include "common/types.h"
+
+//Decompress one raw LZ4 block (no frame header). Returns the number of bytes
+//written to dst, or -1 if the block is malformed or would overflow dst.
+int32_t lz4_decompress(const void *src, uint32_t src_len, void *dst,
+    uint32_t dst_len);
+
+#endif
@@ -2,6 +2,12 @@
 #define KERNEL_LIB_PRINTF_H
 
 #include <stdarg.h>
+#include "common/types.h"
+
+//Like their C99 namesakes, these return the length the output would have had
+//without truncation, and terminate it whenever size is not zero
+int vsnprintf(char *buf, size_t size, const char *fmt, va_list args);
+int snprintf(char *buf, size_t size, const char *fmt, ...);
 
 int vsprintf(char *buf, const char *fmt, va_list args);
 int sprintf(char *buf, const char *fmt, ...);
@@ -22,6 +22,10 @@ void * memmove(void *dest, const void *source, size_t bytes);
 int memcmp(const void *a, const void *b, size_t bytes);
 void * memchr(void *ptr, int value, size_t bytes);
 
+//Copy or zero a single page-aligned, page-sized block
+void copy_page(void *dest, const void *source);
+void clear_page(void *page);
+
 char ** alloc_strtab(uint32_t len);
 uint32_t strtab_len(char * const tab[]);
 char ** copy_strtab(char *const raw[]);
@@ -6,6 +6,10 @@
 void kprint(const char *str);
 void kprintf(const char *fmt, ...);
 
+//Push pending records out to the console now, e.g. before a panic.
+void log_flush();
+void log_percpu_init();
+
 void vlog_disable();
 void vlog_enable();
 
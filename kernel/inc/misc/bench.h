@@ -0,0 +1,53 @@
+#ifndef KERNEL_MISC_BENCH_H
+#define KERNEL_MISC_BENCH_H
+
+#include "common/types.h"
+#include "common/compiler.h"
+#include "arch/tsc.h"
+
+//Each benchmark runs BENCH_ROUNDS times and the fastest round is reported,
+//which discards most of the noise from interrupts.
+#define BENCH_ROUNDS 8
+
+typedef struct bench {
+    char *name;
+    void (*run)();
+} bench_t;
+
+//Benchmarks run from the init process once initcalls have finished, after
+//init memory has been reclaimed, so they can't be marked __init.
+#define bench_initcall(key, fn)                       \
+    static bench_t bench_##fn                         \
+    __attribute__((section(".data.bench"), used)) = { \
+        .name = key,                                  \
+        .run = fn,                                    \
+    }
+
+//Prints a result line of the form
+//"bench - name=<name> ops=<n> ns_per_op=<n>.<nnn> cycles_per_op=<n>"
+void bench_report(const char *name, uint32_t ops, uint64_t cycles);
+
+//Times ops runs of stmt in each round, then reports the fastest
+#define BENCH_LOOP(name, ops, stmt)                                     \
+    do {                                                                \
+        uint64_t __best = ~0ULL;                                        \
+        for(uint32_t __round = 0; __round < BENCH_ROUNDS; __round++) {  \
+            uint64_t __then = rdtsc();                                  \
+            for(uint32_t i = 0; i < (ops); i++) {                       \
+                stmt;                                                   \
+            }                                                           \
+            uint64_t __cycles = rdtsc() - __then;                       \
+            if(__cycles < __best) {                                     \
+                __best = __cycles;                                      \
+            }                                                           \
+        }                                                               \
+        bench_report((name), (ops), __best);                            \
+    } while(0)
+
+//Kernel threads can't exit, so helpers sleep here forever once they're done
+void __noreturn bench_park();
+
+//Runs the benchmarks chosen with "bench=" on the command line, if any
+void bench_run();
+
+#endif
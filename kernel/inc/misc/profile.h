@@ -0,0 +1,10 @@
+#ifndef KERNEL_MISC_PROFILE_H
+#define KERNEL_MISC_PROFILE_H
+
+#include "arch/idt.h"
+
+//Take a sample of whatever interrupt interrupted, if the profiler is running.
+//Called from the local timer interrupt on every CPU.
+void profile_tick(interrupt_t *interrupt);
+
+#endif
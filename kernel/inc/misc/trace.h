@@ -0,0 +1,68 @@
+#ifndef KERNEL_MISC_TRACE_H
+#define KERNEL_MISC_TRACE_H
+
+#include "common/types.h"
+#include "common/compiler.h"
+
+//Events, each of which can be switched on separately (as bits of trace_mask).
+//util/src/trace2json.c knows what each one's arguments mean.
+#define TRACE_SWITCH  0 //arg0: pid switched from, arg1: pid switched to
+#define TRACE_WAKE    1 //arg0: pid woken
+#define TRACE_SYSCALL 2 //arg0: syscall number, arg1: return value (on exit)
+#define TRACE_IRQ     3 //arg0: vector
+#define TRACE_ALLOC   4 //arg0: number of pages, arg1: flags
+#define TRACE_PACKET  5 //arg0: payload length, arg1: frame length
+
+#define TRACE_NUM_EVENTS 6
+
+//Whether a record is for an instant, or starts or ends a span of time
+#define TRACE_INSTANT 'i'
+#define TRACE_BEGIN   'B'
+#define TRACE_END     'E'
+
+#define TRACE_MAGIC   "KTRC"
+#define TRACE_VERSION 1
+
+//The layout of /dev/trace is a header, then num_cpus runs of records (each
+//prefixed with a uint32_t count), oldest first.
+typedef struct trace_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t num_cpus;
+    //So that timestamps can be converted into real time
+    uint32_t tsc_freq;
+    uint32_t record_size;
+} PACKED trace_header_t;
+
+typedef struct trace_record {
+    uint64_t tsc;
+    uint8_t event;
+    uint8_t phase;
+    uint16_t cpu;
+    //Of whatever was running
+    uint32_t pid;
+    uint32_t arg0;
+    uint32_t arg1;
+} PACKED trace_record_t;
+
+#ifdef CONFIG_TRACE
+
+extern volatile uint32_t trace_mask;
+
+void trace_emit(uint8_t event, uint8_t phase, uint32_t arg0, uint32_t arg1);
+
+//A tracepoint costs a load and a predicted branch while its event is off
+#define trace(event, phase, arg0, arg1)                             \
+    do {                                                            \
+        if(unlikely(trace_mask & (1 << (event)))) {                 \
+            trace_emit((event), (phase), (arg0), (arg1));           \
+        }                                                           \
+    } while(0)
+
+#else
+
+#define trace(event, phase, arg0, arg1) do { } while(0)
+
+#endif
+
+#endif
@@ -4,11 +4,10 @@
 #define PAGE_SIZE 0x1000
 #define STACK_NUM_PAGES 4
 
-#define MALLOC_NUM_PAGES DIV_UP(sizeof(page_t) * NUM_ENTRIES * NUM_ENTRIES, PAGE_SIZE)
-
 typedef struct page page_t;
 
 #include "common/types.h"
+#include "common/compiler.h"
 #include "common/list.h"
 
 static inline uint32_t get_index(page_t *page);
@@ -17,27 +16,31 @@ static inline void * page_to_virt(page_t *page);
 #include "init/initcall.h"
 #include "arch/mmu.h"
 
+static inline phys_addr_t page_to_phys(page_t *page);
+
 #define ALLOC_CACHE (1 << 0)
 #define ALLOC_COMPOUND (1 << 1)
 #define ALLOC_ZERO (1 << 2)
 
+//Kept at 16 bytes so that descriptors never straddle a cache line, and so
+//that get_index() is a shift.
 struct page {
-    uint32_t addr;
     uint8_t flags;
     uint8_t order;
+    //A full word, as a compound allocation may span more than 65535 pages
     uint32_t compound_num;
     list_head_t list;
-};
+} ALIGN(16);
 
 extern page_t *pages;
+extern uint32_t page_frames;
 extern __initdata uint32_t lowmem;
 
+//All page frames live in the direct map, at VIRTUAL_BASE + phys.
 static inline void * page_to_virt(page_t *page) {
-    return (void *) (page->addr);
+    return (void *) (VIRTUAL_BASE + page_to_phys(page));
 }
 
-extern page_t *pages;
-
 static inline uint32_t get_index(page_t *page) {
     return (((uint32_t) page) - ((uint32_t) pages)) / (sizeof(page_t));
 }
@@ -52,10 +55,31 @@ page_t * alloc_pages(uint32_t pages, uint32_t flags);
 void free_page(page_t *page);
 void free_pages(page_t *first, uint32_t count);
 
+//Zero one free page into the pool backing ALLOC_ZERO. Returns false if there
+//was nothing to do.
+bool zero_pool_refill();
+
+//Counts of page frames, for /proc/meminfo
+typedef struct mm_info {
+    //Managed by the page allocator
+    uint32_t total;
+    uint32_t free;
+    //Free, and already zeroed by the idle loop
+    uint32_t zeroed;
+    //Free, but held by a CPU's page cache
+    uint32_t cpu_cached;
+} mm_info_t;
+
+void mm_get_info(mm_info_t *info);
+
 void mm_init();
+void mm_percpu_init();
 void mm_postinit_reclaim();
 
 void claim_pages(uint32_t idx, uint32_t num);
+//Turn reserved pages (e.g. those of a boot module) into ordinary allocated
+//pages, which the caller now owns and may later free_page() one by one.
+void adopt_pages(uint32_t idx, uint32_t num);
 
 void * kmalloc(uint32_t size);
 void kfree(void *mem);
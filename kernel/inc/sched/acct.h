@@ -0,0 +1,60 @@
+#ifndef KERNEL_SCHED_ACCT_H
+#define KERNEL_SCHED_ACCT_H
+
+#include "common/types.h"
+
+typedef struct thread thread_t;
+
+//Times are in TSC cycles. Each CPU charges the time since its last accounting
+//event to whatever was running, so a thread's current stretch only shows up
+//once it next enters or leaves the kernel, or is switched out.
+typedef struct thread_acct {
+    uint64_t utime;
+    uint64_t stime;
+
+    //Switches away while asleep, and while still runnable (preemptions)
+    uint32_t nvcsw;
+    uint32_t nivcsw;
+
+    //Whether the thread was last running in user mode
+    bool user;
+} thread_acct_t;
+
+typedef struct cpu_acct {
+    uint64_t user;
+    uint64_t system;
+    uint64_t idle;
+
+    uint32_t switches;
+} cpu_acct_t;
+
+static inline void acct_add(thread_acct_t *to, thread_acct_t *from) {
+    to->utime += from->utime;
+    to->stime += from->stime;
+    to->nvcsw += from->nvcsw;
+    to->nivcsw += from->nivcsw;
+}
+
+//Called on each CPU as it comes up, to start charging from then
+void acct_percpu_init();
+
+//The acct_* hooks must be called with interrupts disabled
+
+//On syscall entry
+void acct_enter_kernel();
+//On syscall exit, and the first entry into user mode
+void acct_enter_user();
+//When t, which has exited, is switched out for the last time. This comes
+//before its times are added to its task's, and so before acct_switch().
+void acct_exit(thread_t *t);
+//When old is switched out for next
+void acct_switch(thread_t *old, thread_t *next);
+
+void acct_cpu_get(uint32_t cpu, cpu_acct_t *out);
+
+//Convert a time in TSC cycles into clock ticks, as /proc reports them
+uint32_t acct_to_ticks(uint64_t cycles);
+
+#define ACCT_TICKS_PER_SEC 100
+
+#endif
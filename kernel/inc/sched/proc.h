@@ -21,6 +21,7 @@ struct processor {
 };
 
 extern processor_t *bsp;
+extern uint32_t num_procs;
 
 DECLARE_PER_CPU(processor_t *, this_proc);
 
@@ -28,5 +29,6 @@ void send_management_interrupt(processor_t *dest);
 void dispatch_management_interrupts();
 
 processor_t * register_proc(uint32_t num);
+processor_t * get_proc(uint32_t num);
 
 #endif
@@ -4,6 +4,10 @@
 #include "common/compiler.h"
 #include "sched/task.h"
 
+//Raised by sched_switch(), whose handler only returns once this thread is next
+//picked to run
+#define SWITCH_INT 0x81
+
 extern volatile bool tasking_up;
 
 void __noreturn sched_loop();
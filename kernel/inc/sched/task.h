@@ -1,7 +1,8 @@
 #ifndef KERNEL_SCHED_TASK_H
 #define KERNEL_SCHED_TASK_H
 
-#define UFDT_PAGES          1
+#define UFDT_MIN_FDS        32
+#define UFDT_MAX_FDS        (1 << 16)
 #define UFD_LIST_PAGES      1
 #define KERNEL_STACK_PAGES  16
 
@@ -36,6 +37,7 @@ typedef struct pgroup pgroup_t;
 #include "arch/cpu.h"
 #include "arch/idt.h"
 #include "sched/proc.h"
+#include "sched/acct.h"
 #include "sync/atomic.h"
 #include "sync/semaphore.h"
 #include "fs/fd.h"
@@ -44,16 +46,32 @@ typedef struct pgroup pgroup_t;
 
 typedef uint32_t ufd_idx_t;
 
+#define UFD_INVALID ((ufd_idx_t) -1)
+
 typedef struct ufd {
     uint32_t flags;
     file_t *gfd;
 } ufd_t;
 
+//An fd table is allocated in one piece, with the slots followed by a bitmap
+//of those which are open. Tables only ever grow (doubling in size), and
+//since fds are looked up without ufds->lock, an outgrown table is kept on the
+//prev list until its context is destroyed.
+typedef struct ufd_table {
+    uint32_t size;
+    ufd_t *slots;
+    uint32_t *open;
+
+    struct ufd_table *prev;
+} ufd_table_t;
+
 typedef struct ufd_context {
     spinlock_t lock;
     uint32_t refs;
 
-    ufd_t *table;
+    ufd_table_t *table;
+    //Every fd below this is open
+    ufd_idx_t next_free;
 } ufd_context_t;
 
 typedef struct fs_context {
@@ -103,6 +121,14 @@ typedef struct task_node {
     char **argv;
     char **envp;
 
+    //Uptime (in milliseconds) when the task was created
+    uint64_t start;
+    //Summed over the threads which have exited
+    thread_acct_t acct;
+
+    //Functions in the running binary, if they were loaded (see binfmt_elf)
+    struct symbol_index *symbols;
+
     atomic_t exit_state;
     uint32_t exit_code;
     uint8_t exit_cause;
@@ -149,6 +175,9 @@ typedef struct thread {
     sigset_t sig_pending;
     bool should_die;
 
+    //CPU time used, and how often the thread has been switched out
+    thread_acct_t acct;
+
     //architecture-specific execution state
     arch_thread_data_t arch;
 
@@ -164,6 +193,30 @@ typedef struct thread {
     list_head_t poll_list;
 } thread_t;
 
+#define TASK_COMM_LEN 16
+
+//A snapshot of a task, with its threads' accounting summed
+typedef struct task_stat {
+    pid_t pid;
+    pid_t ppid;
+    pid_t pgrp;
+    pid_t session;
+    char state;
+    char comm[TASK_COMM_LEN];
+
+    uint32_t num_threads;
+    uint64_t start;
+
+    //In TSC cycles
+    uint64_t utime;
+    uint64_t stime;
+    uint32_t nvcsw;
+    uint32_t nivcsw;
+
+    //Pages mapped into userspace
+    uint32_t rss;
+} task_stat_t;
+
 //FIXME delete the obtain_* functions because they aren't remotely thread safe
 
 static inline task_node_t * obtain_task_node(thread_t *t) {
@@ -192,6 +245,11 @@ thread_t * thread_fork(thread_t *t, uint32_t flags, void (*setup)(void *arg), vo
 void task_node_get(task_node_t *node);
 void task_node_put(task_node_t *node);
 task_node_t * task_node_find(pid_t pid);
+//Fill pids with (up to max of) the pids of every task, returning how many
+//tasks there are
+uint32_t task_list_pids(pid_t *pids, uint32_t max);
+//Returns false if there is no task with the given pid
+bool task_get_stat(pid_t pid, task_stat_t *stat);
 void task_node_exit(uint32_t code, uint8_t exit_cause);
 
 void session_create(task_node_t *t);
@@ -210,7 +268,7 @@ int32_t ufdt_replace(ufd_idx_t ufd, file_t *fd);
 int32_t ufdt_close(ufd_idx_t ufd);
 
 file_t * ufdt_get(ufd_idx_t ufd);
-void ufdt_put(ufd_idx_t ufd);
+void ufdt_put(file_t *gfd);
 
 void __init root_task_init(void *umain);
 
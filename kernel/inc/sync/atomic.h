@@ -14,10 +14,16 @@ void atomic_set(atomic_t *a, int32_t v);
 void atomic_inc(atomic_t *a);
 void atomic_dec(atomic_t *a);
 
+//Return whether the new value is zero
+bool atomic_inc_and_test(atomic_t *a);
+bool atomic_dec_and_test(atomic_t *a);
+
 int32_t atomic_xchg(atomic_t *a, int32_t v);
 
 void atomic_add(atomic_t *a, int32_t v);
 int32_t atomic_add_and_return(atomic_t *a, int32_t v);
+//Add v unless the value is u, returning whether the add happened
+bool atomic_add_unless(atomic_t *a, int32_t v, int32_t u);
 
 void atomic_sub(atomic_t *a, int32_t v);
 int32_t atomic_sub_and_return(atomic_t *a, int32_t v);
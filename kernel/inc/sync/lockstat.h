@@ -0,0 +1,31 @@
+#ifndef KERNEL_SYNC_LOCKSTAT_H
+#define KERNEL_SYNC_LOCKSTAT_H
+
+#include "common/types.h"
+
+typedef struct spinlock spinlock_t;
+
+#ifdef CONFIG_LOCK_STAT
+
+//Called by the spinlock code with interrupts disabled, just after lock was
+//taken at callsite having spun since start (a TSC reading)
+void lockstat_acquired(volatile spinlock_t *lock, void *callsite, bool contended,
+    uint64_t start);
+//Called just before lock is released
+void lockstat_released(volatile spinlock_t *lock);
+
+//Log the locks which have been waited for the longest
+void lockstat_dump();
+
+#else
+
+static inline void lockstat_acquired(volatile spinlock_t *lock, void *callsite,
+    bool contended, uint64_t start) {
+}
+
+static inline void lockstat_released(volatile spinlock_t *lock) {
+}
+
+#endif
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef KERNEL_SYNC_SEQLOCK_H
+#define KERNEL_SYNC_SEQLOCK_H
+
+#include "common/types.h"
+#include "common/asm.h"
+#include "common/compiler.h"
+
+//A sequence count lets readers run without taking any lock, by retrying
+//whenever a writer ran concurrently. Writers must serialise amongst
+//themselves (e.g. with a spinlock), and bump the count around each update.
+//The count is odd while an update is in progress.
+//
+//x86 keeps loads in order with loads and stores with stores, so compiler
+//barriers are enough here.
+
+typedef struct seqcount {
+    uint32_t sequence;
+} seqcount_t;
+
+#define SEQCOUNT_INIT {.sequence = 0}
+
+#define DEFINE_SEQCOUNT(name) seqcount_t name = SEQCOUNT_INIT
+
+static inline uint32_t read_seqbegin(seqcount_t *s) {
+    uint32_t seq;
+    while((seq = ACCESS_ONCE(s->sequence)) & 1) {
+        relax();
+    }
+
+    barrier();
+    return seq;
+}
+
+static inline bool read_seqretry(seqcount_t *s, uint32_t seq) {
+    barrier();
+    return ACCESS_ONCE(s->sequence) != seq;
+}
+
+static inline void write_seqbegin(seqcount_t *s) {
+    ACCESS_ONCE(s->sequence)++;
+    barrier();
+}
+
+static inline void write_seqend(seqcount_t *s) {
+    barrier();
+    ACCESS_ONCE(s->sequence)++;
+}
+
+#endif
@@ -9,7 +9,14 @@ typedef struct spinlock spinlock_t;
 
 struct spinlock {
     spinlock_arch_t arch;
+#ifdef CONFIG_DEBUG_LOCKS
     list_head_t list;
+#endif
+#ifdef CONFIG_LOCK_STAT
+    //Set by the holder, for lockstat_released()
+    uint64_t stat_since;
+    void *stat_entry;
+#endif
 };
 
 #define SPINLOCK_UNLOCKED {.arch = SPINLOCK_ARCH_UNLOCKED}
@@ -20,7 +27,9 @@ struct spinlock {
 
 static inline void spinlock_init(spinlock_t *spinlock) {
     *spinlock = (spinlock_t) SPINLOCK_UNLOCKED;
+#ifdef CONFIG_DEBUG_LOCKS
     list_init(&spinlock->list);
+#endif
 }
 
 static void spin_lock_irq(volatile spinlock_t *lock);
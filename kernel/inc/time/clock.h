@@ -6,6 +6,7 @@
 
 #define MILLIS_PER_SEC 1000
 #define MICROS_PER_MILLI 1000
+#define MICROS_PER_SEC 1000000
 #define FEMPTOS_PER_SEC 1000000000000000ULL
 
 typedef struct clock {
@@ -13,6 +13,7 @@
 #include "arch/hpet.h"
 #include "bug/panic.h"
 #include "mm/mm.h"
+#include "sched/proc.h"
 #include "log/log.h"
 
 #define ACPI_SIG_RSDP "RSD PTR "
@@ -70,6 +71,7 @@ void madt_parse(acpi_sdt_t *madt) {
     apic_init(madt_data->lapic_base);
 
     uint8_t bsp_id = apic_get_id();
+    bsp->arch.apic_id = bsp_id;
 
     uint32_t entry_ap_len = ((uint32_t) &entry_ap_end) - ((uint32_t) &entry_ap_start);
     uint32_t entry_ap_num_pages = DIV_UP(entry_ap_len, PAGE_SIZE);
@@ -1,14 +1,17 @@
 #include "common/types.h"
 #include "common/mmio.h"
+#include "common/math.h"
 #include "arch/gdt.h"
 #include "arch/idt.h"
 #include "arch/pic.h"
 #include "arch/apic.h"
 #include "arch/tsc.h"
 #include "arch/pit.h"
+#include "arch/proc.h"
 #include "mm/mm.h"
 #include "sched/sched.h"
 #include "time/clock.h"
+#include "misc/profile.h"
 #include "log/log.h"
 
 #define TIMER_VECTOR    0x7E
@@ -45,6 +48,14 @@
 
 static void *apic_base;
 
+bool apic_in_use = false;
+
+//How often every CPU's timer fires. Each CPU notices a change on its next
+//tick, since only it can reprogram its own timer.
+static volatile uint32_t timer_hz = APIC_TIMER_HZ;
+static DEFINE_PER_CPU(uint32_t, timer_cpu_hz);
+static DEFINE_PER_CPU(uint32_t, timer_ticks);
+
 uint32_t apic_get_id() {
     return readl(apic_base, REG_ID) >> 24;
 }
@@ -79,12 +90,29 @@ static void apic_eoi() {
     writel(apic_base, REG_EOI, 0);
 }
 
-static void handle_timer() {
-    if(!get_percpu(this_proc)->num) {
-        apic_clock_event_source.event(&apic_clock_event_source);
+static void handle_timer(interrupt_t *interrupt, void *data) {
+    uint32_t hz = timer_hz;
+    if(get_percpu(timer_cpu_hz) != hz) {
+        get_percpu(timer_cpu_hz) = hz;
+        writel(apic_base, REG_TIMER_INITIAL, apic_clock_event_source.freq / hz);
+    }
+
+    profile_tick(interrupt);
+
+    //Whatever the rate, clock events still come at APIC_TIMER_HZ
+    if(++get_percpu(timer_ticks) >= hz / APIC_TIMER_HZ) {
+        get_percpu(timer_ticks) = 0;
+
+        if(!get_percpu(this_proc)->num) {
+            apic_clock_event_source.event(&apic_clock_event_source);
+        }
     }
 }
 
+void apic_set_timer_hz(uint32_t hz) {
+    timer_hz = MAX(hz, APIC_TIMER_HZ);
+}
+
 #define CALIBRATE_INITIAL 0xC0000000
 
 static void calibrate_timer() {
@@ -120,13 +148,14 @@ void __init apic_enable() {
     }
 
     writel(apic_base, REG_TIMER_DIVIDE, DIVIDE_FACTOR_ONE);
-    writel(apic_base, REG_TIMER_INITIAL, apic_clock_event_source.freq);
+    writel(apic_base, REG_TIMER_INITIAL, apic_clock_event_source.freq / APIC_TIMER_HZ);
 }
 
 void __init apic_init(phys_addr_t base) {
     apic_base = map_page(base);
     eoi_handler = apic_eoi;
     is_spurious = apic_is_spurious;
+    apic_in_use = true;
 
     pic_configure(0xFF, 0xFF);
 
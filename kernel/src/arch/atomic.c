@@ -14,7 +14,7 @@ void atomic_set(atomic_t *a, int32_t v) {
 }
 
 void atomic_inc(atomic_t *a) {
-    asm volatile("lock incl %0" : "=m" (a->value));
+    asm volatile("lock incl %0" : "+m" (a->value) : : "memory");
 }
 
 bool atomic_inc_and_test(atomic_t *a) {
@@ -24,7 +24,7 @@ bool atomic_inc_and_test(atomic_t *a) {
 }
 
 void atomic_dec(atomic_t *a) {
-    asm volatile("lock decl %0" : "=m" (a->value));
+    asm volatile("lock decl %0" : "+m" (a->value) : : "memory");
 }
 
 bool atomic_dec_and_test(atomic_t *a) {
@@ -48,6 +48,23 @@ int32_t atomic_add_and_return(atomic_t *a, int32_t v) {
     return v + xchg_op(add, &a->value, v);
 }
 
+bool atomic_add_unless(atomic_t *a, int32_t v, int32_t u) {
+    int32_t old = ACCESS_ONCE(a->value);
+    while(old != u) {
+        int32_t seen = cmpxchg(&a->value, old, old + v);
+        if(seen == old) {
+            return true;
+        }
+        old = seen;
+    }
+
+    return false;
+}
+
+int32_t atomic_sub_and_return(atomic_t *a, int32_t v) {
+    return atomic_add_and_return(a, -v);
+}
+
 void atomic_sub(atomic_t *a, int32_t v) {
     register int val = v;
     asm volatile("lock sub %1, %0" : "=m" (a->value), "=r" (val) : "1" (v));
@@ -1,18 +1,30 @@
 #include "init/initcall.h"
 #include "common/compiler.h"
 #include "common/asm.h"
-#include "common/list.h"
+#include "common/math.h"
+#include "lib/string.h"
+#include "lib/printf.h"
 #include "bug/debug.h"
 #include "bug/panic.h"
 #include "arch/idt.h"
 #include "arch/gdt.h"
 #include "arch/pl.h"
+#include "arch/tsc.h"
+#include "arch/syscall.h"
 #include "mm/cache.h"
+#include "sync/spinlock.h"
+#include "sched/proc.h"
 #include "sched/sched.h"
+#include "fs/char.h"
+#include "misc/trace.h"
 #include "log/log.h"
 
 #define NUM_VECTORS 256
 
+//Vectors handed out to devices, up to (but not including) the APIC timer
+#define DEVICE_VECTOR_START 0x40
+#define DEVICE_VECTOR_END   0x7E
+
 typedef struct idtd {
 	uint16_t size;
 	uint32_t offset;
@@ -26,26 +38,80 @@ typedef struct idt_entry {
     uint16_t offset_hi;
 } PACKED idt_entry_t;
 
+//Big enough for the header line, and the columns of a single CPU
+#define INTERRUPTS_LINE_LEN 8
+#define INTERRUPTS_CPU_LEN  24
+
+typedef struct irq_stats {
+    uint32_t count[NUM_VECTORS];
+    //Time spent in the handlers of each vector
+    uint64_t cycles[NUM_VECTORS];
+} irq_stats_t;
+
+//Nearly every vector has a single handler, which lives in the table itself.
+//Only lines which really are shared chain further handlers off the first.
 typedef struct irq_handler {
     isr_t isr;
     void *data;
 
-    list_head_t list;
+    struct irq_handler *next;
 } irq_handler_t;
 
 void (*eoi_handler)(uint32_t vector);
 bool (*is_spurious)(uint32_t vector);
 
 static idt_entry_t idt[NUM_VECTORS];
-static list_head_t isrs[NUM_VECTORS - IRQ_OFFSET];
+static irq_handler_t isrs[NUM_VECTORS - IRQ_OFFSET];
+static DEFINE_SPINLOCK(isrs_lock);
+
+static DEFINE_PER_CPU(irq_stats_t, irq_stats);
+
+static uint8_t next_device_vector = DEVICE_VECTOR_START;
+static DEFINE_SPINLOCK(vector_lock);
+
+uint8_t alloc_irq_vector() {
+    uint32_t flags;
+    spin_lock_irqsave(&vector_lock, &flags);
+
+    uint8_t vector = 0;
+    if(next_device_vector < DEVICE_VECTOR_END) {
+        vector = next_device_vector++;
+    }
+
+    spin_unlock_irqstore(&vector_lock, flags);
+
+    return vector;
+}
 
 void register_isr(uint8_t vector, uint8_t cpl, isr_t handler, void *data) {
     BUG_ON(vector < IRQ_OFFSET);
 
-    irq_handler_t *new = kmalloc(sizeof(irq_handler_t));
-    new->isr = handler;
-    new->data = data;
-    list_add(&new->list, &isrs[vector - IRQ_OFFSET]);
+    uint32_t flags;
+    spin_lock_irqsave(&isrs_lock, &flags);
+
+    //The handler is filled in before it is published, since dispatch on
+    //other CPUs doesn't take the lock
+    irq_handler_t *first = &isrs[vector - IRQ_OFFSET];
+    if(!first->isr) {
+        first->data = data;
+        barrier();
+        first->isr = handler;
+    } else {
+        irq_handler_t *new = kmalloc(sizeof(irq_handler_t));
+        new->isr = handler;
+        new->data = data;
+        new->next = NULL;
+
+        irq_handler_t *last = first;
+        while(last->next) {
+            last = last->next;
+        }
+
+        barrier();
+        last->next = new;
+    }
+
+    spin_unlock_irqstore(&isrs_lock, flags);
 
 	//FIXME this doesn't make sense if multiple handlers are allowed
     idt[vector].type |= cpl;
@@ -116,13 +182,36 @@ void interrupt_dispatch(interrupt_t *interrupt) {
         handle_exception(interrupt);
     }
 
-		if(!is_spurious(interrupt->vector)
-				&& !list_empty(&isrs[interrupt->vector - IRQ_OFFSET])) {
-        irq_handler_t *handler;
-        LIST_FOR_EACH_ENTRY(handler, &isrs[interrupt->vector - IRQ_OFFSET], list) {
+    irq_stats_t *stats = &get_percpu(irq_stats);
+    stats->count[interrupt->vector]++;
+
+    irq_handler_t *handler = &isrs[interrupt->vector - IRQ_OFFSET];
+		if(!is_spurious(interrupt->vector) && handler->isr) {
+        //Syscalls and switches may sleep, and so come back late or on another
+        //CPU, so only the handlers which run straight through are timed
+        bool timed = interrupt->vector != SYSCALL_INT
+            && interrupt->vector != SWITCH_INT;
+        uint64_t start = rdtsc();
+
+        //Syscalls are traced by themselves, and a switch would only END once
+        //this thread next runs, swallowing everything in between
+        bool traced = timed;
+        if(traced) {
+            trace(TRACE_IRQ, TRACE_BEGIN, interrupt->vector, 0);
+        }
+
+        for(; handler; handler = handler->next) {
             handler->isr(interrupt, handler->data);
 						check_irqs_disabled();
         }
+
+        if(traced) {
+            trace(TRACE_IRQ, TRACE_END, interrupt->vector, 0);
+        }
+
+        if(timed) {
+            stats->cycles[interrupt->vector] += rdtsc() - start;
+        }
     }
 
 		sched_interrupt_notify();
@@ -141,6 +230,81 @@ void interrupt_dispatch(interrupt_t *interrupt) {
     sched_try_resched(is_user);
 }
 
+uint32_t irq_count(uint8_t vector) {
+    uint32_t count = 0;
+    for(uint32_t i = 0; i < num_procs; i++) {
+        count += get_percpu_raw(get_proc(i)->percpu_data, irq_stats).count[vector];
+    }
+
+    return count;
+}
+
+//Each line of /dev/interrupts is a vector which has fired, followed by the
+//number of times it fired on each CPU, then the time each CPU has spent in
+//its handlers (in units of 1024 cycles, and not kept for syscalls or
+//switches).
+static ssize_t interrupts_read_at(char_device_t *device, char *buff, size_t len,
+    uint32_t *pos) {
+    uint32_t line_len = INTERRUPTS_LINE_LEN + num_procs * INTERRUPTS_CPU_LEN;
+    char *text = kmalloc((NUM_VECTORS + 1) * line_len);
+    uint32_t text_len = 0;
+
+    text_len += sprintf(text + text_len, "VEC");
+    for(uint32_t i = 0; i < num_procs; i++) {
+        text_len += sprintf(text + text_len, "      CPU%-2u", i);
+    }
+    for(uint32_t i = 0; i < num_procs; i++) {
+        text_len += sprintf(text + text_len, "     KCYC%-2u", i);
+    }
+    text[text_len++] = '\n';
+
+    for(uint32_t vec = IRQ_OFFSET; vec < NUM_VECTORS; vec++) {
+        if(!irq_count(vec)) {
+            continue;
+        }
+
+        text_len += sprintf(text + text_len, "%02X:", vec);
+        for(uint32_t i = 0; i < num_procs; i++) {
+            text_len += sprintf(text + text_len, " %10u",
+                get_percpu_raw(get_proc(i)->percpu_data, irq_stats).count[vec]);
+        }
+        for(uint32_t i = 0; i < num_procs; i++) {
+            text_len += sprintf(text + text_len, " %10u", (uint32_t)
+                (get_percpu_raw(get_proc(i)->percpu_data, irq_stats).cycles[vec] >> 10));
+        }
+        text[text_len++] = '\n';
+    }
+
+    uint32_t amt = 0;
+    if(*pos < text_len) {
+        amt = MIN(len, text_len - *pos);
+        memcpy(buff, text + *pos, amt);
+        *pos += amt;
+    }
+
+    kfree(text);
+
+    return amt;
+}
+
+static ssize_t interrupts_write(char_device_t *device, const char *buff,
+    size_t len) {
+    return -EINVAL;
+}
+
+static ssize_t interrupts_poll(char_device_t *device, fpoll_data_t *fp) {
+    fp->readable = true;
+    fp->writable = false;
+    fp->errored = false;
+    return 0;
+}
+
+static char_device_ops_t interrupts_ops = {
+    .read_at = interrupts_read_at,
+    .write   = interrupts_write,
+    .poll    = interrupts_poll,
+};
+
 void idt_init() {
     volatile idtd_t idtd;
     idtd.size = (NUM_VECTORS * sizeof(idt_entry_t)) - 1;
@@ -154,11 +318,16 @@ extern void register_isr_stubs();
 static INITCALL isr_init() {
     register_isr_stubs();
 
-    for(uint32_t i = 0; i < NUM_VECTORS - IRQ_OFFSET; i++) {
-        list_init(&isrs[i]);
-    }
+    return 0;
+}
+
+static INITCALL interrupts_init() {
+    char_device_t *interrupts = char_device_alloc();
+    interrupts->ops = &interrupts_ops;
+    register_char_device(interrupts, "interrupts");
 
     return 0;
 }
 
 pure_initcall(isr_init);
+device_initcall(interrupts_init);
@@ -1,9 +1,19 @@
 #include "common/list.h"
+#include "common/math.h"
 #include "lib/string.h"
+#include "lib/printf.h"
+#include "init/initcall.h"
+#include "init/param.h"
 #include "arch/idt.h"
 #include "bug/panic.h"
 #include "mm/mm.h"
 #include "mm/cache.h"
+#include "sync/spinlock.h"
+#include "sched/proc.h"
+#include "sched/sched.h"
+#include "sched/ktaskd.h"
+#include "time/timer.h"
+#include "fs/char.h"
 #include "arch/ioapic.h"
 #include "log/log.h"
 
@@ -39,7 +49,13 @@
 
 #define INTIN_NUM 24
 
-static uint8_t next_pci_vec = 0x40;
+#define NUM_VECTORS 256
+
+//How often the balancer looks at interrupt counts
+#define BALANCE_INTERVAL 2000
+
+//Big enough to describe every vector in /dev/irqaffinity
+#define AFFINITY_TEXT_LEN PAGE_SIZE
 
 typedef struct mp_bus {
     uint8_t id;
@@ -62,10 +78,30 @@ typedef struct pci_ioint {
     list_head_t list;
 } pci_ioint_t;
 
+//Where each vector delivered by an IOAPIC comes from, and where it goes
+typedef struct irq_route {
+    //NULL if no IOAPIC delivers this vector
+    ioapic_t *ioapic;
+    uint8_t intin;
+    uint8_t rflags;
+
+    //The CPUs the interrupt may be sent to, and the one it is sent to now
+    uint32_t affinity;
+    uint32_t cpu;
+
+    //Count seen by the last balancing pass
+    uint32_t last_count;
+} irq_route_t;
+
 static DEFINE_LIST(bus_list);
 static DEFINE_LIST(ioapic_list);
 static DEFINE_LIST(pci_ioint_list);
 
+static irq_route_t routes[NUM_VECTORS];
+static DEFINE_SPINLOCK(route_lock);
+
+static bool balance_enabled = false;
+
 static inline void writel(ioapic_t *ioapic, uint32_t reg, uint32_t val) {
     *(volatile uint32_t *)(ioapic->base_addr + REGSEL_OFF) = reg;
     *(volatile uint32_t *)(ioapic->base_addr + REGWIN_OFF) = val;
@@ -82,6 +118,76 @@ static void set_redirect(ioapic_t *ioapic, uint8_t intin, uint8_t apic_id, uint8
     writel(ioapic, off + 0, (((uint32_t) flags) << 8) | vec);
 }
 
+static inline uint32_t online_cpus() {
+    return num_procs >= 32 ? ~0 : (1 << num_procs) - 1;
+}
+
+//route_lock must be held
+static void route_set_cpu(uint8_t vec, uint32_t cpu) {
+    irq_route_t *r = &routes[vec];
+    r->cpu = cpu;
+    set_redirect(r->ioapic, r->intin, get_proc(cpu)->arch.apic_id, r->rflags,
+        vec);
+}
+
+//Everything starts out going to the BSP, but may be moved anywhere
+static void route_irq(ioapic_t *ioapic, uint8_t intin, uint8_t rflags, uint8_t vec) {
+    uint32_t flags;
+    spin_lock_irqsave(&route_lock, &flags);
+
+    irq_route_t *r = &routes[vec];
+    r->ioapic = ioapic;
+    r->intin = intin;
+    r->rflags = rflags;
+    r->affinity = ~0;
+    r->last_count = irq_count(vec);
+    route_set_cpu(vec, BSP_ID);
+
+    spin_unlock_irqstore(&route_lock, flags);
+}
+
+int32_t ioapic_get_affinity(uint8_t vec, uint32_t *mask, uint32_t *cpu) {
+    int32_t ret = -ENODEV;
+
+    uint32_t flags;
+    spin_lock_irqsave(&route_lock, &flags);
+
+    irq_route_t *r = &routes[vec];
+    if(r->ioapic) {
+        *mask = r->affinity;
+        *cpu = r->cpu;
+        ret = 0;
+    }
+
+    spin_unlock_irqstore(&route_lock, flags);
+
+    return ret;
+}
+
+int32_t ioapic_set_affinity(uint8_t vec, uint32_t mask) {
+    if(!(mask & online_cpus())) {
+        return -EINVAL;
+    }
+
+    int32_t ret = -ENODEV;
+
+    uint32_t flags;
+    spin_lock_irqsave(&route_lock, &flags);
+
+    irq_route_t *r = &routes[vec];
+    if(r->ioapic) {
+        r->affinity = mask;
+        if(!(mask & (1 << r->cpu))) {
+            route_set_cpu(vec, __builtin_ctz(mask & online_cpus()));
+        }
+        ret = 0;
+    }
+
+    spin_unlock_irqstore(&route_lock, flags);
+
+    return ret;
+}
+
 static mp_bus_t * find_mp_bus(uint8_t id) {
     mp_bus_t *mp_bus;
     LIST_FOR_EACH_ENTRY(mp_bus, &bus_list, list) {
@@ -190,7 +296,7 @@ static uint8_t get_isa_rflags(uint8_t ioint_flags) {
 }
 
 static void register_isa_ioint(ioapic_t *ioapic, uint8_t bus_irq, uint8_t intin, uint16_t ioint_flags) {
-    set_redirect(ioapic, intin, 0, get_isa_rflags(ioint_flags), bus_irq + IRQ_OFFSET);
+    route_irq(ioapic, intin, get_isa_rflags(ioint_flags), bus_irq + IRQ_OFFSET);
 }
 
 void register_ioint(uint16_t flags, uint8_t bus_id, uint8_t bus_irq, uint8_t ioapic_id, uint8_t intin) {
@@ -216,9 +322,11 @@ uint8_t find_pci_ioint(uint8_t dev_num) {
         if(pioint->dev_num == dev_num) {
             uint8_t *vec = &pioint->ioapic->intinvecs[pioint->intin];
             if(!*vec) {
-                *vec = next_pci_vec++;
+                if(!(*vec = alloc_irq_vector())) {
+                    panic("ioapic - out of interrupt vectors");
+                }
 
-                set_redirect(pioint->ioapic, pioint->intin, 0, get_pci_rflags(pioint->flags), *vec);
+                route_irq(pioint->ioapic, pioint->intin, get_pci_rflags(pioint->flags), *vec);
             }
             return *vec;
         }
@@ -226,3 +334,205 @@ uint8_t find_pci_ioint(uint8_t dev_num) {
 
     return 0;
 }
+
+//Spread vectors over the CPUs they may use, according to how often each fired
+//since the last pass. The busiest vectors are placed first, each on the least
+//loaded CPU, although a vector stays put unless that would save a good deal.
+static void ioapic_balance() {
+    static uint32_t deltas[NUM_VECTORS];
+    static bool placed[NUM_VECTORS];
+    uint32_t load[32];
+    memset(load, 0, sizeof(load));
+
+    uint32_t flags;
+    spin_lock_irqsave(&route_lock, &flags);
+
+    uint32_t online = online_cpus();
+    for(uint32_t vec = 0; vec < NUM_VECTORS; vec++) {
+        irq_route_t *r = &routes[vec];
+        placed[vec] = !r->ioapic;
+        if(r->ioapic) {
+            uint32_t count = irq_count(vec);
+            deltas[vec] = count - r->last_count;
+            r->last_count = count;
+        }
+    }
+
+    while(true) {
+        uint32_t vec = NUM_VECTORS;
+        for(uint32_t i = 0; i < NUM_VECTORS; i++) {
+            if(!placed[i] && (vec == NUM_VECTORS || deltas[i] > deltas[vec])) {
+                vec = i;
+            }
+        }
+
+        //Idle vectors are left where they are
+        if(vec == NUM_VECTORS || !deltas[vec]) {
+            break;
+        }
+        placed[vec] = true;
+
+        irq_route_t *r = &routes[vec];
+        uint32_t allowed = r->affinity & online;
+
+        uint32_t best = r->cpu;
+        for(uint32_t cpu = 0; cpu < 32; cpu++) {
+            if((allowed & (1 << cpu)) && (!(allowed & (1 << best))
+                || load[cpu] < load[best])) {
+                best = cpu;
+            }
+        }
+
+        if(best != r->cpu && (allowed & (1 << r->cpu))
+            && load[r->cpu] <= load[best] + deltas[vec] / 4) {
+            best = r->cpu;
+        }
+
+        load[best] += deltas[vec];
+        if(best != r->cpu) {
+            route_set_cpu(vec, best);
+        }
+    }
+
+    spin_unlock_irqstore(&route_lock, flags);
+}
+
+static void balance_wake(void *task) {
+    thread_wake(task);
+}
+
+static void irqbalance_run(void *UNUSED(arg)) {
+    irqenable();
+
+    while(true) {
+        irqdisable();
+        thread_sleep_prepare();
+        timer_create(BALANCE_INTERVAL, balance_wake, current);
+        irqenable();
+
+        sched_switch();
+
+        ioapic_balance();
+    }
+}
+
+static bool balance_enable(char *yes) {
+    if(yes[0] == 'y' || yes[0] == 'Y') {
+        balance_enabled = true;
+    }
+
+    return true;
+}
+
+cmdline_param("irqbalance", balance_enable);
+
+//Each line of /dev/irqaffinity is "vector affinity cpu count", with the first
+//two in hex. Writing "vector affinity" lines sets the affinity of vectors.
+static ssize_t affinity_read_at(char_device_t *device, char *buff, size_t len,
+    uint32_t *pos) {
+    char *text = kmalloc(AFFINITY_TEXT_LEN);
+    uint32_t text_len = 0;
+
+    for(uint32_t vec = 0; vec < NUM_VECTORS; vec++) {
+        uint32_t mask, cpu;
+        if(!ioapic_get_affinity(vec, &mask, &cpu)) {
+            uint32_t left = AFFINITY_TEXT_LEN - text_len;
+            uint32_t line_len = snprintf(text + text_len, left,
+                "%02X %08X %u %u\n", vec, mask, cpu, irq_count(vec));
+
+            //Only whole lines are shown
+            if(line_len >= left) {
+                break;
+            }
+
+            text_len += line_len;
+        }
+    }
+
+    uint32_t amt = 0;
+    if(*pos < text_len) {
+        amt = MIN(len, text_len - *pos);
+        memcpy(buff, text + *pos, amt);
+        *pos += amt;
+    }
+
+    kfree(text);
+
+    return amt;
+}
+
+static const char * parse_hex(const char *str, const char *end, uint32_t *out) {
+    while(str < end && *str == ' ') {
+        str++;
+    }
+
+    const char *start = str;
+    *out = 0;
+    for(; str < end; str++) {
+        char c = *str;
+        if(c >= '0' && c <= '9') {
+            *out = (*out << 4) | (c - '0');
+        } else if(c >= 'a' && c <= 'f') {
+            *out = (*out << 4) | (c - 'a' + 10);
+        } else if(c >= 'A' && c <= 'F') {
+            *out = (*out << 4) | (c - 'A' + 10);
+        } else {
+            break;
+        }
+    }
+
+    return str == start ? NULL : str;
+}
+
+static ssize_t affinity_write(char_device_t *device, const char *buff,
+    size_t len) {
+    const char *end = buff + len;
+    const char *line = buff;
+
+    while(line < end) {
+        uint32_t vec, mask;
+        const char *next = parse_hex(line, end, &vec);
+        if(!next || !(next = parse_hex(next, end, &mask)) || vec >= NUM_VECTORS) {
+            return -EINVAL;
+        }
+
+        int32_t ret = ioapic_set_affinity(vec, mask);
+        if(ret) {
+            return ret;
+        }
+
+        while(next < end && *next != '\n') {
+            next++;
+        }
+        line = next + 1;
+    }
+
+    return len;
+}
+
+static ssize_t affinity_poll(char_device_t *device, fpoll_data_t *fp) {
+    fp->readable = true;
+    fp->writable = true;
+    fp->errored = false;
+    return 0;
+}
+
+static char_device_ops_t affinity_ops = {
+    .read_at = affinity_read_at,
+    .write   = affinity_write,
+    .poll    = affinity_poll,
+};
+
+static INITCALL ioapic_affinity_init() {
+    char_device_t *dev = char_device_alloc();
+    dev->ops = &affinity_ops;
+    register_char_device(dev, "irqaffinity");
+
+    if(balance_enabled) {
+        ktaskd_request("irqbalance", irqbalance_run, NULL);
+    }
+
+    return 0;
+}
+
+device_initcall(ioapic_affinity_init);
@@ -6,6 +6,7 @@
 
 .type isr_common, @function
 isr_common:
+    cld
     pushl %esp
 
     mov $0x18, %ax
@@ -37,6 +37,10 @@ SECTIONS {
 
     .data ALIGN (0x1000) : AT(ADDR(.data) - VIRTUAL_BASE) {
         *(.data)
+
+        bench_start = .;
+        *(.data.bench)
+        bench_end = .;
     }
 
     .data.percpu ALIGN(0x1000) : AT(ADDR(.data.percpu) - VIRTUAL_BASE) {
@@ -10,6 +10,7 @@
 .extern mp_ap_start                     # AP entry startup
 
 .extern init_page_directory             # AP startup page directory
+.extern mmu_cr4_features                # AP startup CR4 bits (PSE, PGE)
 .extern next_ap_stack                   # AP startup stack
 
 .extern entry_ap
@@ -152,6 +153,15 @@ boot_bsp:
 
 .type boot_ap, @function
 boot_ap:
+    # Enable large/global pages if the BSP did
+    mov mmu_cr4_features, %ecx
+    test %ecx, %ecx
+    jz 1f
+    mov %cr4, %eax
+    or %ecx, %eax
+    mov %eax, %cr4
+1:
+
     # Set up the AP page directory
     mov $(init_page_directory - 0xC0000000), %ecx
     mov %ecx, %cr3
@@ -1,11 +1,21 @@
 #include "common/types.h"
 #include "common/compiler.h"
+#include "common/asm.h"
+#include "common/math.h"
 #include "sync/spinlock.h"
 #include "bug/debug.h"
 #include "arch/proc.h"
 #include "arch/mmu.h"
 #include "arch/bios.h"
+#include "lib/string.h"
 #include "sched/task.h"
+#include "log/log.h"
+
+//Above this many pages it is cheaper to flush the whole TLB than to invlpg
+#define FLUSH_ALL_THRESHOLD 32
+
+#define CPUID_EDX_PSE (1 << 3)
+#define CPUID_EDX_PGE (1 << 13)
 
 pdir_t init_page_directory ALIGN(PAGE_SIZE);
 ptab_t kptab[KERNEL_NUM_TABLES] ALIGN(PAGE_SIZE);
@@ -14,6 +24,19 @@ ptab_t kptab[KERNEL_NUM_TABLES] ALIGN(PAGE_SIZE);
 static uint32_t kernel_next_page;
 static DEFINE_SPINLOCK(map_lock);
 
+//End of the direct map of RAM at VIRTUAL_BASE, see mmu_init()
+uint32_t direct_map_end;
+
+//CR4 bits every processor must set before loading a page directory, read by
+//boot_ap in loader.s.
+uint32_t mmu_cr4_features;
+
+//Kernel page directory slots which are mapped with a single 4MB page. kptab
+//is still filled in for these, so that virt_to_phys() and friends keep
+//working, but the hardware never walks it.
+static bool kptab_large[KERNEL_NUM_TABLES];
+static uint32_t large_flags;
+
 static inline phys_addr_t do_user_get_page(thread_t *task, uint32_t diridx, uint32_t tabidx) {
     ptab_t *tab = dir_get_tab(task->arch.dir, diridx);
     return tab ? tabentry_get_phys(tab, tabidx) : 0;
@@ -49,7 +72,18 @@ void user_map_page(thread_t *task, void *virt, phys_addr_t phys) {
 void user_map_pages(thread_t *task, void *virt, phys_addr_t phys, uint32_t num) {
     for(uint32_t i = 0; i < num; i++) {
         uint32_t off = i * PAGE_SIZE;
-        user_map_page(task, virt + off, phys + off);
+        do_user_map_page(task, addr_to_diridx(virt + off),
+            addr_to_tabidx(virt + off), phys + off);
+    }
+
+    if(task == current) {
+        if(num > FLUSH_ALL_THRESHOLD) {
+            flush_tlb();
+        } else {
+            for(uint32_t i = 0; i < num; i++) {
+                invlpg(virt + (i * PAGE_SIZE));
+            }
+        }
     }
 }
 
@@ -59,6 +93,22 @@ page_t * user_alloc_page(thread_t *task, void *virt, uint32_t flags) {
     return page;
 }
 
+uint32_t user_count_pages(thread_t *task) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < NUM_ENTRIES - KERNEL_NUM_TABLES; i++) {
+        ptab_t *tab = dir_get_tab(task->arch.dir, i);
+        if(tab) {
+            for (uint32_t j = 0; j < NUM_ENTRIES; j++) {
+                if(tabentry_get_flags(tab, j) & MMUFLAG_PRESENT) {
+                    count++;
+                }
+            }
+        }
+    }
+
+    return count;
+}
+
 void copy_mem(thread_t *to, thread_t *from) {
     for (uint32_t i = 0; i < NUM_ENTRIES - KERNEL_NUM_TABLES; i++) {
         ptab_t *tab = dir_get_tab(from->arch.dir, i);
@@ -67,7 +117,7 @@ void copy_mem(thread_t *to, thread_t *from) {
                 if(tabentry_get_flags(tab, j) & MMUFLAG_PRESENT) {
                     void *dst = kmalloc(PAGE_SIZE);
                     void *src = phys_to_virt(tabentry_get_phys(tab, j));
-                    memcpy(dst, src, PAGE_SIZE);
+                    copy_page(dst, src);
 
                     do_user_map_page(to, i, j, virt_to_phys(dst));
                 }
@@ -76,42 +126,108 @@ void copy_mem(thread_t *to, thread_t *from) {
     }
 }
 
-static inline void map_kernel_page(uint32_t page_idx, uint32_t phys) {
-    uint32_t diridx = page_idx / NUM_ENTRIES;
-    uint32_t tabidx = page_idx % NUM_ENTRIES;
-    tabentry_set(&kptab[diridx], tabidx, phys, MMUFLAG_WRITABLE | MMUFLAG_PRESENT);
-}
-
 static inline void * get_next_virt(uint32_t phys) {
     return (void *) ((kernel_next_page * PAGE_SIZE) + VIRTUAL_BASE + paddr_to_pageoff(phys));
 }
 
-static inline void do_map_page(phys_addr_t phys) {
-    void *virt = get_next_virt(0);
-    kernel_next_page++;
-    uint32_t idx = addr_to_diridx(virt) - addr_to_diridx((void *) VIRTUAL_BASE);
-    tabentry_set(&kptab[idx], addr_to_tabidx(virt), phys, MMUFLAG_WRITABLE | MMUFLAG_PRESENT);
-    invlpg(virt);
+//Fill in the kernel page tables for a run of pages, a whole table at a time.
+//page_idx is relative to VIRTUAL_BASE.
+static void map_range(uint32_t page_idx, phys_addr_t phys, uint32_t num) {
+    while(num) {
+        ptab_t *tab = &kptab[page_idx / NUM_ENTRIES];
+        uint32_t tabidx = page_idx % NUM_ENTRIES;
+        uint32_t run = MIN(num, NUM_ENTRIES - tabidx);
+
+        for(uint32_t i = 0; i < run; i++) {
+            tabentry_set(tab, tabidx + i, phys + (PAGE_SIZE * i),
+                MMUFLAG_WRITABLE | MMUFLAG_PRESENT);
+        }
+
+        page_idx += run;
+        phys += PAGE_SIZE * run;
+        num -= run;
+    }
 }
 
 void * map_page(phys_addr_t phys) {
     return map_pages(phys, 1);
 }
 
+//Kernel virtual addresses are handed out once and never unmapped, so the
+//pages being mapped here have never been present and can't be in any TLB.
+//There is nothing to invalidate.
 void * map_pages(phys_addr_t phys, uint32_t pages) {
     uint32_t flags;
     spin_lock_irqsave(&map_lock, &flags);
 
-    void *virt = get_next_virt(phys);
-    for(uint32_t i = 0; i < pages; i++) {
-        do_map_page(phys + (PAGE_SIZE * i));
+    if(kernel_next_page + pages > KERNEL_NUM_TABLES * NUM_ENTRIES) {
+        panicf("mmu - kernel address space exhausted mapping %u pages", pages);
     }
 
+    void *virt = get_next_virt(phys);
+    map_range(kernel_next_page, phys, pages);
+    kernel_next_page += pages;
+
     spin_unlock_irqstore(&map_lock, flags);
 
     return virt;
 }
 
+//Like map_pages(), but uses 4MB pages for every whole 4MB of the range if
+//the processor supports them. Only used during boot, before any page
+//directories other than init_page_directory have been built.
+static void * __init map_pages_large(phys_addr_t phys, uint32_t pages) {
+    //Large pages need the virtual and physical addresses to agree mod 4MB.
+    if(large_flags && !(phys % (PAGE_SIZE * NUM_ENTRIES))) {
+        kernel_next_page = DIV_UP(kernel_next_page, NUM_ENTRIES) * NUM_ENTRIES;
+    }
+
+    void *virt = map_pages(phys, pages);
+    if(!large_flags) {
+        return virt;
+    }
+
+    uint32_t first = addr_to_diridx(virt) - addr_to_diridx((void *) VIRTUAL_BASE);
+    for(uint32_t i = 0; i < KERNEL_NUM_TABLES - first; i++) {
+        ptab_t *tab = &kptab[first + i];
+        phys_addr_t start = tabentry_get_phys(tab, 0);
+
+        //The table must be wholly and contiguously mapped by this range.
+        //Don't cover the first 4MB of physical memory with a large page,
+        //it is riddled with fixed range MTRRs of differing memory types.
+        if(!(tabentry_get_flags(tab, 0) & MMUFLAG_PRESENT)
+            || start < phys || start % (PAGE_SIZE * NUM_ENTRIES)
+            || start + (PAGE_SIZE * NUM_ENTRIES) > phys + (PAGE_SIZE * pages)
+            || !start) {
+            continue;
+        }
+
+        kptab_large[first + i] = true;
+    }
+
+    return virt;
+}
+
+static void __init detect_large_pages() {
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+
+    if(d & CPUID_EDX_PSE) {
+        mmu_cr4_features |= CR4_PSE;
+        large_flags = MMUFLAG_LARGE;
+    }
+
+    //Kernel mappings never change, so the large ones can survive CR3 loads.
+    if(d & CPUID_EDX_PGE) {
+        mmu_cr4_features |= CR4_PGE;
+        large_flags |= MMUFLAG_GLOBAL;
+    }
+
+    if(mmu_cr4_features) {
+        loadcr4(readcr4() | mmu_cr4_features);
+    }
+}
+
 static inline phys_addr_t kvirt_to_phys(void *kaddr) {
     BUG_ON(((uint32_t) kaddr) < VIRTUAL_BASE);
     return ((uint32_t) kaddr) - VIRTUAL_BASE;
@@ -124,19 +240,35 @@ void build_page_dir(pdir_t *dir) {
 
     uint32_t baseoff = VIRTUAL_BASE / PAGE_SIZE / NUM_ENTRIES;
     for (uint32_t i = 0; i < KERNEL_NUM_TABLES; i++) {
-        phys_addr_t phys = kvirt_to_phys(&kptab[i]);
-        direntry_set(dir, i + baseoff, phys, MMUFLAG_PRESENT | MMUFLAG_WRITABLE);
+        if(kptab_large[i]) {
+            direntry_set(dir, i + baseoff, tabentry_get_phys(&kptab[i], 0),
+                MMUFLAG_PRESENT | MMUFLAG_WRITABLE | large_flags);
+        } else {
+            phys_addr_t phys = kvirt_to_phys(&kptab[i]);
+            direntry_set(dir, i + baseoff, phys, MMUFLAG_PRESENT | MMUFLAG_WRITABLE);
+        }
     }
 }
 
-void * __init mmu_init(phys_addr_t kernel_end, phys_addr_t malloc_start) {
+void __init mmu_init(phys_addr_t mem_end) {
     kernel_next_page = 0;
 
-    //Map 0xC0000000->0x00000000, 0xC0001000->0x00001000, etc. over the whole
-    //kernel image. Then map the page_t struct array just after the kernel
-    //image.
-    map_pages(0, DIV_UP(kernel_end, PAGE_SIZE));
-    void *pages = map_pages(malloc_start, MALLOC_NUM_PAGES);
+    //This has to happen before we load a page directory with large pages.
+    detect_large_pages();
+
+    //Map 0xC0000000->0x00000000, 0xC0001000->0x00001000, etc. over all of
+    //RAM, which includes the kernel image and the page_t array. This uses 4MB
+    //pages where possible.
+    uint32_t num_pages = DIV_UP(mem_end, PAGE_SIZE);
+    BUG_ON(num_pages > DIRECT_MAP_TABLES * NUM_ENTRIES);
+    map_pages_large(0, num_pages);
+    direct_map_end = VIRTUAL_BASE + (num_pages * PAGE_SIZE);
+
+    uint32_t large = 0;
+    for(uint32_t i = 0; i < KERNEL_NUM_TABLES; i++) {
+        large += kptab_large[i];
+    }
+    kprintf("mmu - %u 4MB kernel mappings (cr4 %X)", large, mmu_cr4_features);
 
     //Build the temporary page directory for all processors.
     build_page_dir(&init_page_directory);
@@ -148,6 +280,4 @@ void * __init mmu_init(phys_addr_t kernel_end, phys_addr_t malloc_start) {
     bios_early_remap();
     console_early_remap();
     debug_remap();
-
-    return pages;
 }
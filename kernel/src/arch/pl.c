@@ -9,6 +9,7 @@
 
 void enter_syscall() {
     check_irqs_disabled();
+    acct_enter_kernel();
 
     barrier();
     irqenable();
@@ -17,6 +18,7 @@ void enter_syscall() {
 void leave_syscall() {
     barrier();
     irqdisable();
+    acct_enter_user();
 }
 
 void save_stack(void *sp) {
@@ -128,6 +130,7 @@ void pl_enter_userland(void *user_ip, void *user_stack, registers_t *reg) {
 
     //Remove our the "kernel thread" flag
     me->flags &= ~THREAD_FLAG_KERNEL;
+    acct_enter_user();
 
     //Inform context_switch() of the register launchpad's location.
     set_live_state(me, &user_state);
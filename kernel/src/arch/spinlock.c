@@ -2,18 +2,142 @@
 #include "common/compiler.h"
 #include "common/asm.h"
 #include "sync/spinlock.h"
+#include "sync/lockstat.h"
 #include "bug/panic.h"
 #include "bug/debug.h"
 #include "arch/idt.h"
 #include "arch/proc.h"
 #include "arch/cpu.h"
+#include "arch/tsc.h"
 #include "time/clock.h"
 
 #include "atomic_ops.h"
 
+#ifdef CONFIG_LOCK_STAT
+    #define stat_clock() rdtsc()
+#else
+    #define stat_clock() 0
+#endif
+
+#define callsite() __builtin_return_address(0)
+
+#ifdef CONFIG_DEBUG_LOCKS
+
 DEFINE_PER_CPU(uint32_t, locks_held);
 DEFINE_PER_CPU(list_head_t, lock_list);
 
+static inline void lock_acquired(volatile spinlock_t *lock) {
+    if(percpu_up) {
+        if(lock->arch.holder != 0xFFFF){
+            panicf("spinlock lock violation %X vs %X", lock->arch.holder, get_percpu(this_proc)->num);
+        }
+        lock->arch.holder = get_percpu(this_proc)->num;
+        list_add(&((spinlock_t *) lock)->list, &get_percpu(lock_list));
+        get_percpu(locks_held)++;
+    }
+}
+
+static inline void lock_released(volatile spinlock_t *lock) {
+    if(percpu_up) {
+        if(lock->arch.holder == 0xFFFF){
+            panicf("spinlock unlock violation %X vs %X", lock->arch.holder, get_percpu(this_proc)->num);
+        }
+        lock->arch.holder = 0xFFFF;
+        list_rm(&((spinlock_t *) lock)->list);
+        get_percpu(locks_held)--;
+    }
+}
+
+#else
+
+static inline void lock_acquired(volatile spinlock_t *lock) {
+}
+
+static inline void lock_released(volatile spinlock_t *lock) {
+}
+
+#endif
+
+#ifdef CONFIG_SPINLOCK_MCS
+
+bool _spin_trylock(volatile spinlock_t *lock) {
+    check_irqs_disabled();
+    BUG_ON(!lock);
+
+    //Don't jump the queue
+    if(ACCESS_ONCE(lock->arch.tail) || xchg_op(chg, &lock->arch.locked, 1)) {
+        return false;
+    }
+
+    lock_acquired(lock);
+    lockstat_acquired(lock, callsite(), false, stat_clock());
+
+    return true;
+}
+
+void _spin_lock(volatile spinlock_t *lock) {
+    check_irqs_disabled();
+    BUG_ON(!lock);
+
+    uint64_t start = stat_clock();
+    bool contended = false;
+
+    //Uncontended, this is the only locked instruction
+    if(likely(!ACCESS_ONCE(lock->arch.tail)
+        && !xchg_op(chg, &lock->arch.locked, 1))) {
+        goto lock_out;
+    }
+
+    contended = true;
+    mcs_node_t node = {.next = NULL, .head = false};
+
+    mcs_node_t *prev = xchg_op(chg, &lock->arch.tail, &node);
+    if(prev) {
+        prev->next = &node;
+        while(!node.head) {
+            relax();
+        }
+    }
+
+    //At the front of the queue. The only competition left is the holder, and
+    //someone on the fast path who saw the queue empty at just the wrong time.
+    while(xchg_op(chg, &lock->arch.locked, 1)) {
+        while(ACCESS_ONCE(lock->arch.locked)) {
+            relax();
+        }
+    }
+
+    //Move the next waiter to the front, or empty the queue. Either way, node
+    //isn't needed once we hold the lock.
+    if(cmpxchg(&lock->arch.tail, &node, NULL) != &node) {
+        while(!node.next) {
+            relax();
+        }
+        node.next->head = true;
+    }
+
+lock_out:
+    barrier();
+
+    lock_acquired(lock);
+    lockstat_acquired(lock, callsite(), contended, start);
+}
+
+void _spin_unlock(volatile spinlock_t *lock) {
+    check_irqs_disabled();
+    BUG_ON(!lock);
+
+    lockstat_released(lock);
+    lock_released(lock);
+
+    //Stores aren't reordered with older loads or stores on x86
+    barrier();
+    lock->arch.locked = 0;
+    barrier();
+}
+
+#else
+
 #define TICKET_SHIFT 16
 
 bool _spin_trylock(volatile spinlock_t *lock) {
@@ -35,13 +159,9 @@ bool _spin_trylock(volatile spinlock_t *lock) {
 
     bool ret = res == old.raw;
 
-    if(ret && percpu_up) {
-        if(lock->arch.holder != 0xFFFF){
-            panicf("spinlock lock violation %X vs %X", lock->arch.holder, get_percpu(this_proc)->num);
-        }
-        lock->arch.holder = get_percpu(this_proc)->num;
-        list_add(&((spinlock_t *) lock)->list, &get_percpu(lock_list));
-        get_percpu(locks_held)++;
+    if(ret) {
+        lock_acquired(lock);
+        lockstat_acquired(lock, callsite(), false, stat_clock());
     }
 
     return ret;
@@ -51,6 +171,9 @@ void _spin_lock(volatile spinlock_t *lock) {
     check_irqs_disabled();
     BUG_ON(!lock);
 
+    uint64_t start = stat_clock();
+    bool contended = false;
+
     register ticket_pair_t local = {.tail = 1};
 
     local = xchg_op(add, &lock->arch.tickets, local);
@@ -58,6 +181,7 @@ void _spin_lock(volatile spinlock_t *lock) {
         goto lock_out;
     }
 
+    contended = true;
     while(true) {
         BUG_ON(!lock);
         if(ACCESS_ONCE(lock->arch.tickets.head) == local.tail) {
@@ -69,30 +193,20 @@ void _spin_lock(volatile spinlock_t *lock) {
 lock_out:
     barrier();
 
-    if(percpu_up) {
-        if(lock->arch.holder != 0xFFFF){
-            panicf("spinlock lock violation %X vs %X", lock->arch.holder, get_percpu(this_proc)->num);
-        }
-        lock->arch.holder = get_percpu(this_proc)->num;
-        list_add(&((spinlock_t *) lock)->list, &get_percpu(lock_list));
-        get_percpu(locks_held)++;
-    }
+    lock_acquired(lock);
+    lockstat_acquired(lock, callsite(), contended, start);
 }
 
 void _spin_unlock(volatile spinlock_t *lock) {
     check_irqs_disabled();
     BUG_ON(!lock);
 
-    if(percpu_up) {
-        if(lock->arch.holder == 0xFFFF){
-            panicf("spinlock unlock violation %X vs %X", lock->arch.holder, get_percpu(this_proc)->num);
-        }
-        lock->arch.holder = 0xFFFF;
-        list_rm(&((spinlock_t *) lock)->list);
-        get_percpu(locks_held)--;
-    }
+    lockstat_released(lock);
+    lock_released(lock);
 
     barrier();
     add(&lock->arch.tickets.head, 1);
     barrier();
 }
+
+#endif
@@ -2,6 +2,7 @@
 #include "sched/syscall.h"
 #include "sched/sched.h"
 #include "init/initcall.h"
+#include "misc/trace.h"
 
 static void syscall_handler(interrupt_t *interrupt, void *data) {
     enter_syscall();
@@ -9,6 +10,8 @@ static void syscall_handler(interrupt_t *interrupt, void *data) {
     cpu_state_t *state = &interrupt->cpu;
     uint32_t num = state->reg.eax;
 
+    trace(TRACE_SYSCALL, TRACE_BEGIN, num, 0);
+
     if(num >= MAX_SYSCALL || !syscalls[num]) {
         panicf("Unregistered Syscall #%u", num);
     } else {
@@ -21,6 +24,8 @@ static void syscall_handler(interrupt_t *interrupt, void *data) {
             state->reg.edx = ret >> 32;
             state->reg.eax = ret;
         }
+
+        trace(TRACE_SYSCALL, TRACE_END, num, ret);
     }
 
     leave_syscall();
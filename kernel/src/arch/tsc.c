@@ -18,6 +18,16 @@ clock_t tsc_clock = {
     .read = tsc_read,
 };
 
+uint64_t tsc_to_micros(uint64_t tsc) {
+    if(!tsc_clock.freq || tsc < initial) {
+        return 0;
+    }
+
+    uint64_t ticks = tsc - initial;
+    return ((ticks / tsc_clock.freq) * MICROS_PER_SEC)
+        + (((ticks % tsc_clock.freq) * MICROS_PER_SEC) / tsc_clock.freq);
+}
+
 void tsc_busywait_100ms() {
     BUG_ON(!tsc_clock.freq);
     barrier();
@@ -5,6 +5,7 @@
 #include "init/initcall.h"
 #include "common/math.h"
 #include "common/compiler.h"
+#include "sync/atomic.h"
 #include "bug/debug.h"
 #include "mm/mm.h"
 #include "log/log.h"
@@ -12,19 +13,6 @@
 void breakpoint_triggered() {
 }
 
-typedef struct {
-    uint32_t name;
-    uint32_t type;
-    uint32_t flags;
-    uint32_t addr;
-    uint32_t offset;
-    uint32_t size;
-    uint32_t link;
-    uint32_t info;
-    uint32_t addralign;
-    uint32_t entsize;
-} PACKED elf_section_header_t;
-
 extern uint32_t strtab_start;
 extern uint32_t strtab_end;
 extern uint32_t symtab_start;
@@ -35,12 +23,165 @@ static uint32_t strtabsz;
 static const elf_symbol_t *symtab;
 static uint32_t symtabsz;
 
+//Only functions are indexed, sorted by address, so that lookups can binary
+//search a small array rather than walk the whole symbol table
+typedef struct symbol_entry {
+    uint32_t start;
+    uint32_t end;
+    const elf_symbol_t *symbol;
+} symbol_entry_t;
+
+struct symbol_index {
+    atomic_t refs;
+
+    const elf_symbol_t *symtab;
+    const char *strtab;
+    uint32_t strtabsz;
+    //Whether symtab and strtab go with the index
+    bool owned;
+
+    uint32_t num;
+    symbol_entry_t *entries;
+};
+
+static symbol_index_t *kernel_index;
+
+static inline bool entry_before(symbol_entry_t *a, symbol_entry_t *b) {
+    return a->start < b->start || (a->start == b->start && a->end < b->end);
+}
+
+static void sift_down(symbol_entry_t *entries, uint32_t root, uint32_t num) {
+    while(root * 2 + 1 < num) {
+        uint32_t child = root * 2 + 1;
+        if(child + 1 < num && entry_before(&entries[child], &entries[child + 1])) {
+            child++;
+        }
+        if(!entry_before(&entries[root], &entries[child])) {
+            break;
+        }
+
+        symbol_entry_t tmp = entries[root];
+        entries[root] = entries[child];
+        entries[child] = tmp;
+        root = child;
+    }
+}
+
+//Heapsort, as kernel tables run to thousands of symbols and this shouldn't
+//need any more memory
+static void sort_entries(symbol_entry_t *entries, uint32_t num) {
+    for(uint32_t i = num / 2; i > 0; i--) {
+        sift_down(entries, i - 1, num);
+    }
+
+    for(uint32_t end = num; end > 1; end--) {
+        symbol_entry_t tmp = entries[0];
+        entries[0] = entries[end - 1];
+        entries[end - 1] = tmp;
+        sift_down(entries, 0, end - 1);
+    }
+}
+
+static inline bool symbol_indexed(const elf_symbol_t *symbol, uint32_t strtabsz) {
+    return ELF32_ST_TYPE(symbol->info) == ELF_TYPE_FUNC && symbol->size
+        && symbol->name < strtabsz;
+}
+
+symbol_index_t * symbol_index_build(const elf_symbol_t *symtab, uint32_t num,
+    const char *strtab, uint32_t strtabsz, bool owned) {
+    //Names mustn't run off the end of the table
+    if(!strtabsz || strtab[strtabsz - 1]) {
+        return NULL;
+    }
+
+    uint32_t funcs = 0;
+    for(uint32_t i = 0; i < num; i++) {
+        if(symbol_indexed(&symtab[i], strtabsz)) {
+            funcs++;
+        }
+    }
+
+    if(!funcs) {
+        return NULL;
+    }
+
+    symbol_index_t *index = kmalloc(sizeof(symbol_index_t));
+    atomic_set(&index->refs, 1);
+    index->symtab = symtab;
+    index->strtab = strtab;
+    index->strtabsz = strtabsz;
+    index->owned = owned;
+    index->num = funcs;
+    index->entries = kmalloc(funcs * sizeof(symbol_entry_t));
+
+    for(uint32_t i = 0, j = 0; i < num; i++) {
+        if(symbol_indexed(&symtab[i], strtabsz)) {
+            index->entries[j].start = symtab[i].value;
+            index->entries[j].end = symtab[i].value + symtab[i].size;
+            index->entries[j].symbol = &symtab[i];
+            j++;
+        }
+    }
+
+    sort_entries(index->entries, index->num);
+
+    return index;
+}
+
+void symbol_index_get(symbol_index_t *index) {
+    atomic_inc(&index->refs);
+}
+
+void symbol_index_put(symbol_index_t *index) {
+    if(!atomic_dec_and_test(&index->refs)) {
+        return;
+    }
+
+    if(index->owned) {
+        kfree((void *) index->symtab);
+        kfree((void *) index->strtab);
+    }
+    kfree(index->entries);
+    kfree(index);
+}
+
+const elf_symbol_t * symbol_index_lookup(symbol_index_t *index,
+    uint32_t address) {
+    //Find the last function starting at or before address
+    uint32_t lo = 0, hi = index->num;
+    while(lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if(index->entries[mid].start <= address) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if(lo && address < index->entries[lo - 1].end) {
+        return index->entries[lo - 1].symbol;
+    }
+
+    return NULL;
+}
+
+const char * symbol_index_name(symbol_index_t *index,
+    const elf_symbol_t *symbol) {
+    if(symbol == NULL) return NULL;
+    return index->strtab + symbol->name;
+}
+
 const char * debug_symbol_name(const elf_symbol_t *symbol) {
     if(symbol == NULL) return NULL;
     return (const char *) ((uint32_t) strtab + symbol->name);
 }
 
 const elf_symbol_t * debug_lookup_symbol(uint32_t address) {
+    if(kernel_index) {
+        return symbol_index_lookup(kernel_index, address);
+    }
+
+    //Before the index is built (or if there wasn't the memory to build it)
     if(!strtabsz || !symtabsz) return NULL;
 
     for(uint32_t i = 0; i < (symtabsz / sizeof(elf_symbol_t)); i++) {
@@ -108,16 +249,16 @@ void __init debug_remap() {
 }
 
 void __init debug_init() {
-    elf_section_header_t *sh = (elf_section_header_t *) mbi->u.elf_sec.addr;
+    Elf32_Shdr *sh = (Elf32_Shdr *) mbi->u.elf_sec.addr;
 
     for(uint32_t i = 0; i < mbi->u.elf_sec.num; i++) {
-        const char *name = (const char *) sh[mbi->u.elf_sec.shndx].addr + sh[i].name;
+        const char *name = (const char *) sh[mbi->u.elf_sec.shndx].sh_addr + sh[i].sh_name;
         if (!strcmp(name, ".strtab")) {
-            strtab = (const char *) sh[i].addr;
-            strtabsz = sh[i].size;
+            strtab = (const char *) sh[i].sh_addr;
+            strtabsz = sh[i].sh_size;
         } else if (!strcmp(name, ".symtab")) {
-            symtab = (elf_symbol_t *) sh[i].addr;
-            symtabsz = sh[i].size;
+            symtab = (elf_symbol_t *) sh[i].sh_addr;
+            symtabsz = sh[i].sh_size;
         }
     }
 
@@ -134,6 +275,21 @@ void __init debug_init() {
     }
 }
 
+static INITCALL debug_index_init() {
+    if(strtabsz && symtabsz) {
+        kernel_index = symbol_index_build(symtab,
+            symtabsz / sizeof(elf_symbol_t), strtab, strtabsz, false);
+    }
+
+    if(kernel_index) {
+        kprintf("debug - indexed %u kernel functions", kernel_index->num);
+    }
+
+    return 0;
+}
+
+core_initcall(debug_index_init);
+
 phys_addr_t __init debug_kernel_start(phys_addr_t raw) {
     if(strtab) {
         raw = MIN(raw, (phys_addr_t) strtab);
@@ -25,6 +25,9 @@ void panic(char *message) {
 
     dispatch_management_interrupts();
 
+    //Get whatever led up to this onto the screen first
+    log_flush();
+
     console_t *t = con_global;
 
     console_lockup(t);
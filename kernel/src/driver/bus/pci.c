@@ -1,12 +1,16 @@
 #include "lib/printf.h"
 #include "common/compiler.h"
+#include "common/math.h"
 #include "init/initcall.h"
 #include "common/asm.h"
 #include "arch/idt.h"
+#include "arch/apic.h"
 #include "arch/ioapic.h"
 #include "bug/debug.h"
 #include "bug/panic.h"
 #include "mm/mm.h"
+#include "sync/spinlock.h"
+#include "sched/proc.h"
 #include "device/device.h"
 #include "driver/bus/pci.h"
 #include "log/log.h"
@@ -16,6 +20,46 @@
 #define CONFIG_ADDRESS  0xCF8
 #define CONFIG_DATA     0xCFC
 
+//Command Register bits
+#define PCI_CMD_INTX_DISABLE (1 << 10)
+
+//Messages are writes into the local APIC window, with the destination APIC ID
+//in the address and the vector in the data
+#define MSI_ADDR_BASE       0xFEE00000
+#define MSI_ADDR_DEST_SHIFT 12
+
+//MSI capability layout
+#define MSI_REG_CTRL        0x02
+#define MSI_REG_ADDR        0x04
+#define MSI_REG_ADDR_HI     0x08
+#define MSI_REG_DATA_32     0x08
+#define MSI_REG_DATA_64     0x0C
+
+#define MSI_CTRL_ENABLE     (1 << 0)
+#define MSI_CTRL_MME_MASK   (7 << 4)  //Multiple Message Enable
+#define MSI_CTRL_64BIT      (1 << 7)
+
+//MSI-X capability layout
+#define MSIX_REG_CTRL       0x02
+#define MSIX_REG_TABLE      0x04
+
+#define MSIX_CTRL_SIZE_MASK 0x7FF
+#define MSIX_CTRL_FMASK     (1 << 14) //Function Mask
+#define MSIX_CTRL_ENABLE    (1 << 15)
+
+#define MSIX_TABLE_BIR_MASK 0x7
+
+//MSI-X table entries
+#define MSIX_ENTRY_SIZE     16
+#define MSIX_ENTRY_ADDR     0x00
+#define MSIX_ENTRY_ADDR_HI  0x04
+#define MSIX_ENTRY_DATA     0x08
+#define MSIX_ENTRY_CTRL     0x0C
+
+#define MSIX_ENTRY_MASKED   (1 << 0)
+
+#define PCI_CAP_MAX_WALK    48
+
 static char * classes[] = {
     [0x00] = "Unspecified Type",
     [0x01] = "Mass Storage Controller",
@@ -56,6 +100,145 @@ void pci_writel(pci_loc_t loc, uint16_t offset, uint32_t val) {
     outl(CONFIG_DATA, val);
 }
 
+void pci_writew(pci_loc_t loc, uint16_t offset, uint16_t val) {
+    uint32_t shift = (offset & 0x2) * 8;
+    uint32_t old = pci_readl(loc, offset & ~0x3);
+    pci_writel(loc, offset & ~0x3, (old & ~(0xFFFF << shift)) | (((uint32_t) val) << shift));
+}
+
+uint8_t pci_find_cap(pci_device_t *dev, uint8_t id) {
+    if(!(pci_readw(dev->loc, PCI_WORD_STATUS) & PCI_STATUS_CAPS)) {
+        return 0;
+    }
+
+    //The walk is bounded in case a broken device links the list into a loop
+    uint8_t cap = pci_readb(dev->loc, PCI_BYTE_CAPPTR) & ~0x3;
+    for(uint32_t i = 0; cap && i < PCI_CAP_MAX_WALK; i++) {
+        if(pci_readb(dev->loc, cap) == id) {
+            return cap;
+        }
+
+        cap = pci_readb(dev->loc, cap + 1) & ~0x3;
+    }
+
+    return 0;
+}
+
+static uint32_t next_msi_cpu;
+static DEFINE_SPINLOCK(msi_lock);
+
+//Hand out CPUs round robin, so that devices don't all land on the BSP
+static uint32_t msi_pick_cpu() {
+    uint32_t flags;
+    spin_lock_irqsave(&msi_lock, &flags);
+
+    uint32_t cpu = next_msi_cpu++ % num_procs;
+
+    spin_unlock_irqstore(&msi_lock, flags);
+
+    return cpu;
+}
+
+static inline uint32_t msi_addr(uint32_t cpu) {
+    return MSI_ADDR_BASE | (get_proc(cpu)->arch.apic_id << MSI_ADDR_DEST_SHIFT);
+}
+
+//Every entry but the first stays masked, since each device only gets one vector
+static bool setup_msix(pci_device_t *dev, uint8_t cap, uint8_t vector, uint32_t cpu) {
+    uint16_t ctrl = pci_readw(dev->loc, cap + MSIX_REG_CTRL);
+    uint32_t table = pci_readl(dev->loc, cap + MSIX_REG_TABLE);
+
+    uint32_t bir = table & MSIX_TABLE_BIR_MASK;
+    if(bir > 5 || (dev->bar[bir] & 0x1) || !BAR_ADDR_32(dev->bar[bir])) {
+        return false;
+    }
+
+    uint32_t entries = (ctrl & MSIX_CTRL_SIZE_MASK) + 1;
+    uint32_t phys = (dev->bar[bir] & ~0xF) + (table & ~MSIX_TABLE_BIR_MASK);
+    uint32_t off = phys & (PAGE_SIZE - 1);
+    void *base = map_pages(phys - off, DIV_UP(off + entries * MSIX_ENTRY_SIZE, PAGE_SIZE)) + off;
+
+    //Hold off every vector while the table is being filled in
+    pci_writew(dev->loc, cap + MSIX_REG_CTRL, ctrl | MSIX_CTRL_ENABLE | MSIX_CTRL_FMASK);
+
+    for(uint32_t i = 0; i < entries; i++) {
+        volatile uint32_t *entry = base + i * MSIX_ENTRY_SIZE;
+        entry[MSIX_ENTRY_CTRL / sizeof(uint32_t)] |= MSIX_ENTRY_MASKED;
+    }
+
+    volatile uint32_t *entry = base;
+    entry[MSIX_ENTRY_ADDR / sizeof(uint32_t)] = msi_addr(cpu);
+    entry[MSIX_ENTRY_ADDR_HI / sizeof(uint32_t)] = 0;
+    entry[MSIX_ENTRY_DATA / sizeof(uint32_t)] = vector;
+    entry[MSIX_ENTRY_CTRL / sizeof(uint32_t)] &= ~MSIX_ENTRY_MASKED;
+
+    pci_writew(dev->loc, cap + MSIX_REG_CTRL, (ctrl | MSIX_CTRL_ENABLE) & ~MSIX_CTRL_FMASK);
+
+    return true;
+}
+
+//Only one message is asked for (MME of zero), so the data is just the vector
+static bool setup_msi(pci_device_t *dev, uint8_t cap, uint8_t vector, uint32_t cpu) {
+    uint16_t ctrl = pci_readw(dev->loc, cap + MSI_REG_CTRL);
+
+    pci_writel(dev->loc, cap + MSI_REG_ADDR, msi_addr(cpu));
+    if(ctrl & MSI_CTRL_64BIT) {
+        pci_writel(dev->loc, cap + MSI_REG_ADDR_HI, 0);
+        pci_writew(dev->loc, cap + MSI_REG_DATA_64, vector);
+    } else {
+        pci_writew(dev->loc, cap + MSI_REG_DATA_32, vector);
+    }
+
+    pci_writew(dev->loc, cap + MSI_REG_CTRL, (ctrl & ~MSI_CTRL_MME_MASK) | MSI_CTRL_ENABLE);
+
+    return true;
+}
+
+bool pci_enable_msi(pci_device_t *dev) {
+    //Messages go straight to a local APIC, and would never be EOI'd while the
+    //PIC is handling interrupts
+    if(!apic_in_use) {
+        return false;
+    }
+
+    uint8_t msix = pci_find_cap(dev, PCI_CAP_MSIX);
+    uint8_t msi = pci_find_cap(dev, PCI_CAP_MSI);
+    if(!msix && !msi) {
+        return false;
+    }
+
+    uint8_t vector = alloc_irq_vector();
+    if(!vector) {
+        kprintf("pci - %02X:%02X:%02X out of vectors, staying on INTx",
+            dev->loc.bus, dev->loc.device, dev->loc.function);
+        return false;
+    }
+
+    uint32_t cpu = msi_pick_cpu();
+
+    //A vector whose setup fails is simply never used again
+    const char *kind;
+    if(msix && setup_msix(dev, msix, vector, cpu)) {
+        kind = "MSI-X";
+    } else if(msi && setup_msi(dev, msi, vector, cpu)) {
+        kind = "MSI";
+    } else {
+        return false;
+    }
+
+    //Only write the command half back, since the status half is write-1-to-clear
+    pci_writel(dev->loc, PCI_FULL_CMDSTA,
+        (pci_readl(dev->loc, PCI_FULL_CMDSTA) & 0xFFFF) | PCI_CMD_INTX_DISABLE);
+
+    dev->interrupt = vector;
+    dev->msi = true;
+
+    kprintf("pci - %02X:%02X:%02X using %s vector %X on cpu %u",
+        dev->loc.bus, dev->loc.device, dev->loc.function, kind, vector, cpu);
+
+    return true;
+}
+
 static bool pci_match(device_t *device, driver_t *driver) {
     pci_device_t *pci_device = containerof(device, pci_device_t, device);
     pci_driver_t *pci_driver = containerof(driver, pci_driver_t, driver);
@@ -122,6 +305,7 @@ static void probe_function(uint8_t bus, uint8_t device, uint8_t function) {
     dev->bar[4] = pci_readl(dev->loc, PCI_FULL_BAR4);
     dev->bar[5] = pci_readl(dev->loc, PCI_FULL_BAR5);
 
+    dev->msi = false;
     dev->interrupt = find_pci_ioint(device);
     if(!dev->interrupt) {
         dev->interrupt = pci_readb(dev->loc, PCI_BYTE_INTRPT) + IRQ_OFFSET;
@@ -210,6 +210,15 @@ static ssize_t populate_rb(tty_t *tty) {
             case 0x4F: { s = CSI_DOUBLE "F"; break; }
             //Delete key (not DEL!)
             case 0x53: { s = CSI_DOUBLE "3~"; break; }
+            //Shift+PgUp/PgDn move through the scrollback
+            case 0x49:
+            case 0x51: {
+                if(is_shift_down(tty)) {
+                    vram_scrollback(con_global, (c == 0x49 ? 1 : -1)
+                        * (CONSOLE_HEIGHT / 2));
+                }
+                return 0;
+            }
             //Drop the code
             default: { return 0; }
         }
@@ -343,7 +352,8 @@ void tty_create(char *name) {
     }
 
     tty_t *tty = kmalloc(sizeof(tty_t));
-    tty->console = vfs_open_file(&out);
+    tty->console = vfs_open_file(&out, O_RDWR);
+    path_put(&out);
     memset(tty->keystate, 0, sizeof(tty->keystate));
     ringbuff_init(&tty->rb, BUFFLEN, char);
     spinlock_init(&tty->lock);
@@ -7,6 +7,8 @@
 #include "arch/bios.h"
 #include "sync/spinlock.h"
 #include "mm/mm.h"
+#include "init/initcall.h"
+#include "time/clock.h"
 #include "driver/console/console.h"
 
 #define TABSTOP_WIDTH 8
@@ -15,6 +17,15 @@
 
 #define ESCSEQ_BUFF_SIZE 128
 
+//Rows kept in the shadow ring, i.e. the screen plus its scrollback
+#define SHADOW_ROWS 256
+#define SCROLLBACK_ROWS (SHADOW_ROWS - CONSOLE_HEIGHT)
+
+#define ALL_ROWS_DIRTY ((1 << CONSOLE_HEIGHT) - 1)
+
+//How often deferred updates are copied out to vram
+#define FLUSH_INTERVAL 20
+
 #define ASCII_BELL      '\x7'
 #define ASCII_BACKSPACE '\x8'
 #define ASCII_TAB       '\x9'
@@ -72,20 +83,66 @@ static void cursor_enable(console_t *con, uint8_t top_scanline, uint8_t bot_scan
     set_reg_bits(con, REG_CURSOR_END  , 0x1F, (bot_scanline & 0x1F));
 }
 
+//There is only ever the one console.
+static uint16_t shadow_buff[SHADOW_ROWS * CONSOLE_WIDTH];
+static uint64_t last_flush;
+
+//Returns screen row r as it is currently being viewed, i.e. counting the rows
+//scrolled back.
+static inline uint16_t * shadow_row(console_t *con, uint32_t r, uint32_t back) {
+    uint32_t idx = (con->top + SHADOW_ROWS - back + r) % SHADOW_ROWS;
+    return &con->shadow[idx * CONSOLE_WIDTH];
+}
+
+static inline uint16_t make_cell(console_t *con, char c) {
+    return ((uint16_t) (uint8_t) c) | (((uint16_t) (uint8_t) con->color) << 8);
+}
+
+static inline void put_cell(console_t *con, uint32_t r, uint32_t c, char ch) {
+    shadow_row(con, r, 0)[c] = make_cell(con, ch);
+    con->dirty |= 1 << r;
+}
+
 static void do_refresh_cursor(console_t *con) {
-    uint16_t pos = con->row * CONSOLE_WIDTH + con->col;
+    //Hide the cursor while looking at the scrollback
+    uint16_t pos = con->view ? CONSOLE_WIDTH * CONSOLE_HEIGHT
+        : con->row * CONSOLE_WIDTH + con->col;
+    if(pos == con->cursor_pos) {
+        return;
+    }
+
+    con->cursor_pos = pos;
     set_reg_bits(con, REG_CURSOR_LO, 0xFF, (uint8_t) (pos & 0xFF));
     set_reg_bits(con, REG_CURSOR_HI, 0x3F, (uint8_t) ((pos >> 8) & 0xFF));
 }
 
+//Copy the dirty rows out to vram.
+static void do_flush(console_t *con) {
+    for(uint32_t r = 0; con->dirty && r < CONSOLE_HEIGHT; r++) {
+        if(con->dirty & (1 << r)) {
+            memcpy(con->vram + (r * CONSOLE_WIDTH * 2),
+                shadow_row(con, r, con->view), CONSOLE_WIDTH * 2);
+            con->dirty &= ~(1 << r);
+        }
+    }
+
+    do_refresh_cursor(con);
+}
+
+static void do_clear_row(console_t *con, uint32_t r) {
+    uint16_t *row = shadow_row(con, r, 0);
+    for(uint32_t c = 0; c < CONSOLE_WIDTH; c++) {
+        row[c] = make_cell(con, ' ');
+    }
+    con->dirty |= 1 << r;
+}
+
 static void do_clear(console_t *con) {
     con->row = 0;
     con->col = 0;
-    for(uint32_t i = 0; i < CONSOLE_WIDTH * CONSOLE_HEIGHT; i++) {
-        con->vram[i * 2] = ' ';
-        con->vram[i * 2 + 1] = con->color;
+    for(uint32_t r = 0; r < CONSOLE_HEIGHT; r++) {
+        do_clear_row(con, r);
     }
-    do_refresh_cursor(con);
 }
 
 static void do_erase(console_t *con, bool to_end) {
@@ -95,8 +152,7 @@ static void do_erase(console_t *con, bool to_end) {
 
     while(rstart >= 0 && rstart < CONSOLE_HEIGHT) {
         while(cstart >= 0 && cstart < CONSOLE_WIDTH) {
-            con->vram[(rstart * CONSOLE_WIDTH + cstart) * 2] = ' ';
-            con->vram[(rstart * CONSOLE_WIDTH + cstart) * 2 + 1] = con->color;
+            put_cell(con, rstart, cstart, ' ');
             cstart += dir;
         }
         cstart = dir == 1 ? 0 : CONSOLE_WIDTH - 1;
@@ -106,22 +162,18 @@ static void do_erase(console_t *con, bool to_end) {
 
 static void cursor_up(console_t *con, uint32_t amt) {
     con->row -= MIN(con->row, amt);
-    do_refresh_cursor(con);
 }
 
 static void cursor_down(console_t *con, uint32_t amt) {
     con->row += MAX(CONSOLE_HEIGHT - con->row, amt);
-    do_refresh_cursor(con);
 }
 
 static void cursor_forward(console_t *con, uint32_t amt) {
     con->col += MAX(CONSOLE_WIDTH - con->col, amt);
-    do_refresh_cursor(con);
 }
 
 static void cursor_back(console_t *con, uint32_t amt) {
     con->col -= MIN(con->col, amt);
-    do_refresh_cursor(con);
 }
 
 static void cursor_position(console_t *con, uint32_t r, uint32_t c) {
@@ -130,8 +182,6 @@ static void cursor_position(console_t *con, uint32_t r, uint32_t c) {
 
     con->row = MIN(r, CONSOLE_HEIGHT - 1);
     con->col = MIN(c, CONSOLE_WIDTH - 1);
-
-    do_refresh_cursor(con);
 }
 
 void vram_color(console_t *con, char c) {
@@ -143,11 +193,19 @@ void vram_color(console_t *con, char c) {
     spin_unlock_irqstore(&con->lock, flags);
 }
 
+//Unless updates are being batched up, they go straight out to vram.
+static void maybe_flush(console_t *con) {
+    if(!con->deferred || con->lockup) {
+        do_flush(con);
+    }
+}
+
 void vram_clear(console_t *con) {
     uint32_t flags;
     spin_lock_irqsave(&con->lock, &flags);
 
     do_clear(con);
+    maybe_flush(con);
 
     spin_unlock_irqstore(&con->lock, flags);
 }
@@ -160,12 +218,12 @@ static void fix_pos_overflow(console_t *con) {
     }
 
     if(con->row == CONSOLE_HEIGHT) {
-        memmove(con->vram, con->vram + CONSOLE_WIDTH * 2, (CONSOLE_HEIGHT - 1) * CONSOLE_WIDTH * 2);
-
-        for(int i = 0; i < CONSOLE_WIDTH; i++) {
-            (con->vram + (CONSOLE_HEIGHT - 1) * CONSOLE_WIDTH * 2)[i * 2] = ' ';
-            (con->vram + (CONSOLE_HEIGHT - 1) * CONSOLE_WIDTH * 2)[i * 2 + 1] = con->color;
-        }
+        //Scrolling just moves the top of the screen along the ring, and the
+        //next flush redraws the whole screen (however many lines scrolled).
+        con->top = (con->top + 1) % SHADOW_ROWS;
+        con->history = MIN(con->history + 1, SCROLLBACK_ROWS);
+        do_clear_row(con, CONSOLE_HEIGHT - 1);
+        con->dirty = ALL_ROWS_DIRTY;
 
         con->row = CONSOLE_HEIGHT - 1;
     }
@@ -210,8 +268,7 @@ static void process_char(console_t *con, char c) {
             break;
         }
         default: {
-            con->vram[(con->row * CONSOLE_WIDTH + con->col) * 2] = c;
-            con->vram[(con->row * CONSOLE_WIDTH + con->col) * 2 + 1] = con->color;
+            put_cell(con, con->row, con->col, c);
             con->col++;
             fix_pos_overflow(con);
             break;
@@ -222,6 +279,12 @@ static void process_char(console_t *con, char c) {
 static void vram_putc(console_t *con, char c) {
     check_irqs_disabled();
 
+    //Output snaps the view back from the scrollback
+    if(con->view) {
+        con->view = 0;
+        con->dirty = ALL_ROWS_DIRTY;
+    }
+
     process_char(con, c);
 }
 
@@ -402,10 +465,9 @@ void vram_write(console_t *con, const char *str, size_t len) {
     for(size_t i = 0; i < len; i++) {
         vram_handle(con, str[i]);
     }
+    maybe_flush(con);
 
     spin_unlock_irqstore(&con->lock, flags);
-
-    do_refresh_cursor(con);
 }
 
 void vram_cursor(console_t *con, uint8_t r, uint8_t c) {
@@ -417,6 +479,18 @@ void vram_cursor(console_t *con, uint8_t r, uint8_t c) {
     spin_unlock_irqstore(&con->lock, flags);
 }
 
+void vram_scrollback(console_t *con, int32_t rows) {
+    uint32_t flags;
+    spin_lock_irqsave(&con->lock, &flags);
+
+    int32_t view = ((int32_t) con->view) + rows;
+    con->view = MAX(0, MIN(view, (int32_t) con->history));
+    con->dirty = ALL_ROWS_DIRTY;
+    maybe_flush(con);
+
+    spin_unlock_irqstore(&con->lock, flags);
+}
+
 void vram_puts(console_t *con, const char* str) {
     vram_write(con, str, strlen(str));
 }
@@ -448,6 +522,14 @@ void __init vram_early_init(console_t *console) {
     console->vram = (void *) BIOS_VRAM;
     console->port = bda_getw(BDA_VRAM_PORT);
 
+    console->shadow = shadow_buff;
+    console->top = 0;
+    console->view = 0;
+    console->history = 0;
+    console->dirty = 0;
+    console->cursor_pos = 0xFFFF;
+    console->deferred = false;
+
     cursor_enable(console, 14, 15, CURSOR_BLINK_SLOW);
 
     vram_clear(con_global);
@@ -461,3 +543,36 @@ void vram_init(console_t *console) {
     console->escseq_buff = kmalloc(ESCSEQ_BUFF_SIZE);
     console->escseq_buff_front = 0;
 }
+
+static void vram_tick(clock_event_source_t *source) {
+    check_irqs_disabled();
+
+    console_t *con = con_global;
+
+    //Only batch up updates once the clock is known to be ticking
+    con->deferred = true;
+
+    uint64_t now = uptime();
+    if(now - last_flush < FLUSH_INTERVAL) {
+        return;
+    }
+    last_flush = now;
+
+    //Whoever holds the lock is busy drawing, so catch it next time
+    if(spin_trylock(&con->lock)) {
+        do_flush(con);
+        spin_unlock(&con->lock);
+    }
+}
+
+static clock_event_listener_t vram_listener = {
+    .handle = vram_tick
+};
+
+static INITCALL vram_flush_init() {
+    register_clock_event_listener(&vram_listener);
+
+    return 0;
+}
+
+subsys_initcall(vram_flush_init);
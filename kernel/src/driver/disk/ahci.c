@@ -7,6 +7,8 @@
 #include "arch/idt.h"
 #include "mm/mm.h"
 #include "mm/cache.h"
+#include "sync/semaphore.h"
+#include "sched/sched.h"
 #include "time/clock.h"
 #include "fs/disk.h"
 #include "driver/bus/pci.h"
@@ -18,8 +20,16 @@
 #define AHCI_NUM_PORTS 32
 #define AHCI_NUM_PRDT_ENTRIES 16
 
+#define AHCI_ABAR_GHC        0x04
+#define AHCI_ABAR_IS         0x08
 #define AHCI_ABAR_PORTS_IMPL 0x0C
 
+#define GHC_IE (1 << 1)
+
+//PCI Command Register bits
+#define PCI_CMD_MAE (1 << 1) //Memory Access Enable
+#define PCI_CMD_BME (1 << 2) //Bus Mastering Enable
+
 #define PORT_CMD_ST (1 << 0)
 #define PORT_CMD_FR (1 << 4)
 
@@ -38,6 +48,15 @@
 #define PORT_REG_PxSACT 0x34
 #define PORT_REG_PxCI   0x38
 
+//Port interrupts which may mean a command has finished
+#define PORT_INT_DHRS (1 << 0)  //D2H Register FIS
+#define PORT_INT_PSS  (1 << 1)  //PIO Setup FIS
+#define PORT_INT_DSS  (1 << 2)  //DMA Setup FIS
+#define PORT_INT_SDBS (1 << 3)  //Set Device Bits FIS
+#define PORT_INT_TFES (1 << 30) //Task File Error
+
+#define PORT_INT_DONE (PORT_INT_DHRS | PORT_INT_PSS | PORT_INT_DSS | PORT_INT_SDBS | PORT_INT_TFES)
+
 #define PORT_SIG_SATA   0x00000101
 #define PORT_SIG_SATAPI 0xEB140101
 #define PORT_SIG_SEMB   0xC33C0101
@@ -66,6 +85,10 @@ typedef enum ahci_port_type {
 
 typedef struct ahci_controller {
     void *base;
+
+    //Zero unless the controller has an MSI vector of its own
+    uint8_t vector;
+    struct ahci_port *ports[AHCI_NUM_PORTS];
 } ahci_controller_t;
 
 typedef struct ahci_cmd_fis {
@@ -147,6 +170,9 @@ typedef struct ahci_port {
     uint32_t cmdtable_phys;
 
     block_device_t *blockdev;
+
+    //Upped by the interrupt handler whenever the port has something to say
+    semaphore_t done;
 } ahci_port_t;
 
 #define AHCI_PORT_BASE 0x100
@@ -156,9 +182,36 @@ static inline void * port_to_base(ahci_port_t *port) {
     return (void *) (((uint32_t) port->cont->base) + AHCI_PORT_BASE + (port->num * AHCI_PORT_SIZE));
 }
 
-static ssize_t sata_access(bool write, ahci_port_t *port, void *buff, size_t lba, size_t count) {
+//Issue the command in slot 0 and wait for it to complete. Once threads are
+//running and the controller has its own vector, the wait sleeps until the
+//interrupt handler says something happened, otherwise it spins.
+static void port_run(ahci_port_t *port) {
     void *port_base = port_to_base(port);
 
+    writel(port_base, PORT_REG_PxIS, ~0);
+
+    uint32_t tmp = readl(port_base, PORT_REG_PxCMD);
+    tmp |= PORT_CMD_ST;
+    tmp |= PORT_CMD_FR;
+    writel(port_base, PORT_REG_PxCMD, tmp);
+
+    writel(port_base, PORT_REG_PxCI, 1);
+    if(port->cont->vector && tasking_up) {
+        //Stale ups (e.g. from spinning at boot) just cost an extra pass
+        while(readl(port_base, PORT_REG_PxCI)) {
+            semaphore_down(&port->done);
+        }
+    } else {
+        while(readl(port_base, PORT_REG_PxCI));
+    }
+
+    tmp = readl(port_base, PORT_REG_PxCMD);
+    tmp &= ~PORT_CMD_ST;
+    tmp &= ~PORT_CMD_FR;
+    writel(port_base, PORT_REG_PxCMD, tmp);
+}
+
+static ssize_t sata_access(bool write, ahci_port_t *port, void *buff, size_t lba, size_t count) {
     memset((void *) port->cmdlist, 0, sizeof(ahci_cmdlist_t));
     port->cmdlist->fis_length = sizeof(ahci_cmd_fis_t) / sizeof(uint32_t);
     port->cmdlist->cmdtable_addr_low = port->cmdtable_phys;
@@ -202,20 +255,7 @@ static ssize_t sata_access(bool write, ahci_port_t *port, void *buff, size_t lba
         port->cmdlist->prdt_length = i;
 	}
 
-    writel(port->cont->base, PORT_REG_PxIS, 0);
-
-    uint32_t tmp = readl(port_base, PORT_REG_PxCMD);
-    tmp |= PORT_CMD_ST;
-    tmp |= PORT_CMD_FR;
-    writel(port_base, PORT_REG_PxCMD, tmp);
-
-    writel(port_base, PORT_REG_PxCI, 1);
-    while(readl(port_base, PORT_REG_PxCI));
-
-    tmp = readl(port_base, PORT_REG_PxCMD);
-    tmp &= ~PORT_CMD_ST;
-    tmp &= ~PORT_CMD_FR;
-    writel(port_base, PORT_REG_PxCMD, tmp);
+    port_run(port);
 
     return 1;
 }
@@ -252,7 +292,6 @@ static block_device_ops_t ahci_device_ops = {
 static void sata_identify(ahci_port_t *port) {
     port->type = PORT_TYPE_SATA;
 
-    void *port_base = port_to_base(port);
     uint8_t *buff = kmalloc(ATA_SECTOR_SIZE);
 
     memset((void *) port->cmdlist, 0, sizeof(ahci_cmdlist_t));
@@ -270,20 +309,7 @@ static void sata_identify(ahci_port_t *port) {
     port->cmdtable->prdt[0].addr_low = (uint32_t) virt_to_phys(buff);
     port->cmdtable->prdt[0].bytes = ATA_SECTOR_SIZE - 1;
 
-    writel(port->cont->base, PORT_REG_PxIS, 0);
-
-    uint32_t tmp = readl(port_base, PORT_REG_PxCMD);
-    tmp |= PORT_CMD_ST;
-    tmp |= PORT_CMD_FR;
-    writel(port_base, PORT_REG_PxCMD, tmp);
-
-    writel(port_base, PORT_REG_PxCI, 1);
-    while(readl(port_base, PORT_REG_PxCI));
-
-    tmp = readl(port_base, PORT_REG_PxCMD);
-    tmp &= ~PORT_CMD_ST;
-    tmp &= ~PORT_CMD_FR;
-    writel(port_base, PORT_REG_PxCMD, tmp);
+    port_run(port);
 
     char model[ATA_MODEL_LENGTH + 1];
     for(uint8_t k = 0; k < ATA_MODEL_LENGTH; k += 2) {
@@ -321,6 +347,28 @@ static char * ahci_controller_name(device_t UNUSED(*device)) {
     return name;
 }
 
+//Acknowledge everything at the port, then the controller, so that anything
+//arriving in between raises a fresh message
+static void handle_ahci_irq(interrupt_t *interrupt, void *data) {
+    ahci_controller_t *cont = data;
+
+    uint32_t is = readl(cont->base, AHCI_ABAR_IS);
+    for(uint32_t i = 0; i < AHCI_NUM_PORTS; i++) {
+        if(!(is & (1 << i))) {
+            continue;
+        }
+
+        void *port_base = (void *) (((uint32_t) cont->base) + AHCI_PORT_BASE + (i * AHCI_PORT_SIZE));
+        writel(port_base, PORT_REG_PxIS, readl(port_base, PORT_REG_PxIS));
+
+        if(cont->ports[i]) {
+            semaphore_up(&cont->ports[i]->done);
+        }
+    }
+
+    writel(cont->base, AHCI_ABAR_IS, is);
+}
+
 static bool ahci_probe(device_t *device) {
     pci_device_t *pci_device = containerof(device, pci_device_t, device);
     if(!pci_device->bar[5]) return false;
@@ -328,21 +376,29 @@ static bool ahci_probe(device_t *device) {
     ahci_controller_t *cont = device->private = kmalloc(sizeof(ahci_controller_t));
 
     cont->base = map_page(pci_device->bar[5]);
+    memset(cont->ports, 0, sizeof(cont->ports));
+
+    //Without a vector of its own the controller is left polled, as before
+    cont->vector = 0;
+    //Messages are memory writes, so the controller has to be a bus master.
+    //Only the command half is written back, as the status half is W1C.
+    pci_writel(pci_device->loc, PCI_FULL_CMDSTA,
+        (pci_readl(pci_device->loc, PCI_FULL_CMDSTA) & 0xFFFF)
+        | PCI_CMD_MAE | PCI_CMD_BME);
+    if(pci_enable_msi(pci_device)) {
+        cont->vector = pci_device->interrupt;
+        register_isr(cont->vector, CPL_KRNL, handle_ahci_irq, cont);
+    }
 
     return true;
 }
 
-/*
-static void handle_ahci_irq(interrupt_t *interrupt, ahci_controller_t *cont) {
-
-}
-*/
-
 static void port_init(ahci_controller_t *cont, uint32_t num) {
     ahci_port_t *port = kmalloc(sizeof(ahci_port_t));
     port->cont = cont;
     port->num = num;
     port->type = PORT_TYPE_NONE;
+    semaphore_init(&port->done, 0);
 
     page_t *page = alloc_pages(DIV_UP(sizeof(ahci_cmdlist_t), PAGE_SIZE), 0);
     port->cmdlist = (ahci_cmdlist_t *) page_to_virt(page);
@@ -365,6 +421,8 @@ static void port_init(ahci_controller_t *cont, uint32_t num) {
     writel(port_base, PORT_REG_PxIS  , 0);
     writel(port_base, PORT_REG_PxIE  , 0);
 
+    cont->ports[num] = port;
+
     //Is the port unused?
     if ((readl(port_base, PORT_REG_PxSSTS) & 0x0F) != PORT_STATUS_DET_PRESENT) {
         return;
@@ -386,6 +444,9 @@ static void port_init(ahci_controller_t *cont, uint32_t num) {
             kprintf("ahci - PM unsupported");
             break;
         default:
+            if(cont->vector) {
+                writel(port_base, PORT_REG_PxIE, PORT_INT_DONE);
+            }
             sata_identify(port);
             break;
     }
@@ -402,6 +463,11 @@ static void ahci_enable(device_t *device) {
 
         ports_impl >>= 1;
     }
+
+    if(cont->vector) {
+        writel(cont->base, AHCI_ABAR_IS, ~0);
+        writel(cont->base, AHCI_ABAR_GHC, readl(cont->base, AHCI_ABAR_GHC) | GHC_IE);
+    }
 }
 
 static void ahci_disable(device_t UNUSED(*device)) {
@@ -1,6 +1,5 @@
 #include "lib/string.h"
 #include "lib/printf.h"
-#include "common/list.h"
 #include "common/compiler.h"
 #include "common/math.h"
 #include "common/swap.h"
@@ -157,8 +156,6 @@ typedef struct tx_desc {
 } PACKED tx_desc_t;
 
 typedef struct net_825xx {
-    list_head_t list;
-
     uint32_t mmio, rx_front, tx_front;
     uint8_t *rx_buff[NUM_RX_DESCS];
     uint8_t *tx_buff[NUM_TX_DESCS];
@@ -167,12 +164,12 @@ typedef struct net_825xx {
     tx_desc_t *tx_desc;
 
     spinlock_t state_lock;
+    //Interrupts are acknowledged but otherwise ignored until this is set
+    volatile bool enabled;
 
     net_interface_t interface;
 } PACKED net_825xx_t;
 
-static DEFINE_LIST(net_825xx_devices);
-
 static uint32_t mmio_read(net_825xx_t *net_device, uint32_t reg) {
     return *(uint32_t *)(net_device->mmio + reg);
 }
@@ -211,27 +208,31 @@ static void net_825xx_poll(net_interface_t *interface) {
     }
 }
 
+//Each device has its own handler, so (with MSI, where the vector isn't shared)
+//there is no need to poll every other device to find the one which fired.
 static void handle_network(interrupt_t *interrupt, void *data) {
-    net_825xx_t *net_device;
-    LIST_FOR_EACH_ENTRY(net_device, &net_825xx_devices, list) {
-        uint32_t icr = mmio_read(net_device, REG_ICR);
+    net_825xx_t *net_device = data;
+    uint32_t icr = mmio_read(net_device, REG_ICR);
 
-        if(icr & ICR_LSC) {
-            uint32_t flags;
-            spin_lock_irqsave(&net_device->state_lock, &flags);
+    if(!net_device->enabled) {
+        return;
+    }
 
-            if(mmio_read(net_device, REG_STATUS) & STATUS_LU) {
-                net_set_state(&net_device->interface, IF_UP);
-            } else {
-                net_set_state(&net_device->interface, IF_DOWN);
-            }
+    if(icr & ICR_LSC) {
+        uint32_t flags;
+        spin_lock_irqsave(&net_device->state_lock, &flags);
 
-            spin_unlock_irqstore(&net_device->state_lock, flags);
+        if(mmio_read(net_device, REG_STATUS) & STATUS_LU) {
+            net_set_state(&net_device->interface, IF_UP);
+        } else {
+            net_set_state(&net_device->interface, IF_DOWN);
         }
 
-        if(icr & ICR_RXT) {
-            net_825xx_poll(&net_device->interface);
-        }
+        spin_unlock_irqstore(&net_device->state_lock, flags);
+    }
+
+    if(icr & ICR_RXT) {
+        net_825xx_poll(&net_device->interface);
     }
 }
 
@@ -275,9 +276,14 @@ static bool net_825xx_probe(device_t *device) {
     net_825xx_t *net_device = pci_device->device.private = kmalloc(sizeof(net_825xx_t));
 
     spinlock_init(&net_device->state_lock);
+    net_device->enabled = false;
 
     net_device->mmio = (uint32_t) map_pages(BAR_ADDR_32(pci_device->bar[0]), DIV_UP(REG_LAST, PAGE_SIZE));
-    register_isr(pci_device->interrupt, CPL_KRNL, handle_network, NULL);
+
+    //Messages are memory writes, so the device has to be a bus master first
+    pci_writel(pci_device->loc, PCI_FULL_CMDSTA, pci_readl(pci_device->loc, PCI_FULL_CMDSTA) | PCI_CMD_MAE | PCI_CMD_BME);
+    pci_enable_msi(pci_device);
+    register_isr(pci_device->interrupt, CPL_KRNL, handle_network, net_device);
 
     mac_t *mac = kmalloc(sizeof(mac_t));
 
@@ -361,8 +367,6 @@ static bool net_825xx_probe(device_t *device) {
     net_device->interface.hard_addr.family = AF_LINK;
     net_device->interface.hard_addr.addr = mac;
 
-    pci_writel(pci_device->loc, PCI_FULL_CMDSTA, pci_readl(pci_device->loc, PCI_FULL_CMDSTA) | PCI_CMD_MAE | PCI_CMD_BME);
-
     return true;
 }
 
@@ -370,12 +374,11 @@ static void net_825xx_enable(device_t *device) {
     pci_device_t *pci_device = containerof(device, pci_device_t, device);
     net_825xx_t *net_device = pci_device->device.private;
 
-    list_add(&net_device->list, &net_825xx_devices); //FIXME this is probably not thread-safe
-
     mmio_write(net_device, REG_TCTL, mmio_read(net_device, REG_TCTL) | TCTL_EN | TCTL_PSP);
     mmio_write(net_device, REG_RCTL, mmio_read(net_device, REG_RCTL) | RCTL_EN);
 
     register_net_interface(&net_device->interface);
+    net_device->enabled = true;
 
     uint32_t flags;
     spin_lock_irqsave(&net_device->state_lock, &flags);
@@ -389,7 +392,7 @@ static void net_825xx_disable(device_t *device) {
     pci_device_t *pci_device = containerof(device, pci_device_t, device);
     net_825xx_t *net_device = pci_device->device.private;
 
-    list_rm(&net_device->list); //FIXME this is probably not thread-safe
+    net_device->enabled = false;
 
     mmio_write(net_device, REG_TCTL, mmio_read(net_device, REG_TCTL) & ~(TCTL_EN | TCTL_PSP));
     mmio_write(net_device, REG_RCTL, mmio_read(net_device, REG_RCTL) & ~(RCTL_EN));
@@ -4,6 +4,7 @@
 #include "lib/string.h"
 #include "common/math.h"
 #include "init/initcall.h"
+#include "init/param.h"
 #include "bug/debug.h"
 #include "arch/pl.h"
 #include "mm/mm.h"
@@ -27,6 +28,24 @@
 #define designate_args(t)                                   \
     designate_space(t, (void *) UARGS_ADDR_START, UARGS_NUM_PAGES)
 
+//Symbol tables bigger than this aren't loaded
+#define SYMBOLS_MAX_SIZE (1 << 20)
+//Nor are those of binaries with more sections than this
+#define SYMBOLS_MAX_SECTIONS 256
+
+//Whether to load the symbols of each binary executed, for the profiler
+static bool load_symbols = false;
+
+static bool usersyms_enable(char *yes) {
+    if(yes[0] == 'y' || yes[0] == 'Y') {
+        load_symbols = true;
+    }
+
+    return true;
+}
+
+cmdline_param("usersyms", usersyms_enable);
+
 static bool elf_header_valid(Elf32_Ehdr *ehdr) {
     return ehdr->e_ident[EI_MAG0] == ELFMAG0
         && ehdr->e_ident[EI_MAG1] == ELFMAG1
@@ -90,6 +109,73 @@ static void * build_strtab(char **start, char **tab, uint32_t *out_tablen) {
     return end;
 }
 
+static void * read_section(file_t *file, Elf32_Shdr *shdr) {
+    if(!shdr->sh_size || shdr->sh_size > SYMBOLS_MAX_SIZE) {
+        return NULL;
+    }
+    if(vfs_seek(file, shdr->sh_offset, SEEK_SET) != shdr->sh_offset) {
+        return NULL;
+    }
+
+    void *data = kmalloc(shdr->sh_size);
+    if(!data) {
+        return NULL;
+    }
+    if(vfs_read(file, data, shdr->sh_size) != (ssize_t) shdr->sh_size) {
+        kfree(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+//Returns an index of the functions in the binary's symbol table, or NULL if
+//it hasn't got one (or it can't be read)
+static symbol_index_t * read_symbols(binary_t *binary, Elf32_Ehdr *ehdr) {
+    if(!ehdr->e_shoff || ehdr->e_shentsize != sizeof(Elf32_Shdr)
+        || ehdr->e_shnum > SYMBOLS_MAX_SECTIONS) {
+        return NULL;
+    }
+
+    uint32_t shdrsz = sizeof(Elf32_Shdr) * ehdr->e_shnum;
+    Elf32_Shdr *shdr = kmalloc(shdrsz);
+    if(!shdr) {
+        return NULL;
+    }
+
+    symbol_index_t *index = NULL;
+
+    if(vfs_seek(binary->file, ehdr->e_shoff, SEEK_SET) != ehdr->e_shoff
+        || vfs_read(binary->file, shdr, shdrsz) != (ssize_t) shdrsz) {
+        goto out;
+    }
+
+    for(uint32_t i = 0; i < ehdr->e_shnum; i++) {
+        if(shdr[i].sh_type != SHT_SYMTAB || shdr[i].sh_link >= ehdr->e_shnum) {
+            continue;
+        }
+
+        Elf32_Shdr *strhdr = &shdr[shdr[i].sh_link];
+        elf_symbol_t *symtab = read_section(binary->file, &shdr[i]);
+        char *strtab = read_section(binary->file, strhdr);
+        if(symtab && strtab) {
+            index = symbol_index_build(symtab,
+                shdr[i].sh_size / sizeof(elf_symbol_t), strtab,
+                strhdr->sh_size, true);
+        }
+
+        if(!index) {
+            kfree(symtab);
+            kfree(strtab);
+        }
+        break;
+    }
+
+out:
+    kfree(shdr);
+    return index;
+}
+
 static int32_t load_elf(binary_t *binary) {
     uint32_t flags;
     irqsave(&flags);
@@ -170,6 +256,8 @@ static int32_t load_elf(binary_t *binary) {
 
     kprintf("binfmt_elf - entry: %X", ehdr->e_entry);
 
+    symbol_index_t *symbols = load_symbols ? read_symbols(binary, ehdr) : NULL;
+
     irqdisable();
 
     thread_t *me = current;
@@ -180,8 +268,15 @@ static int32_t load_elf(binary_t *binary) {
     spin_lock(&node->lock);
     node->argv = binary->argv;
     node->envp = binary->envp;
+
+    symbol_index_t *old_symbols = node->symbols;
+    node->symbols = symbols;
     spin_unlock(&node->lock);
 
+    if(old_symbols) {
+        symbol_index_put(old_symbols);
+    }
+
     void *ustack = designate_stack(me) + USTACK_SIZE;
 
     uint32_t argc;
@@ -75,7 +75,8 @@ static int32_t load_shebang(binary_t *binary) {
         return ret;
     }
 
-    file_t *f = vfs_open_file(&path);
+    file_t *f = vfs_open_file(&path, O_RDONLY);
+    path_put(&path);
     if(!f) {
         return -EIO;
     }
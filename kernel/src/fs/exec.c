@@ -5,7 +5,7 @@
 #include "fs/exec.h"
 
 bool execute_path(path_t *path, char **raw_argv, char **raw_envp) {
-    file_t *f = vfs_open_file(path);
+    file_t *f = vfs_open_file(path, O_RDONLY);
     if(!f) {
         return false;
     }
@@ -1,59 +1,44 @@
 #include "init/initcall.h"
-#include "sync/spinlock.h"
+#include "sync/atomic.h"
 #include "bug/debug.h"
 #include "mm/mm.h"
 #include "mm/cache.h"
 #include "fs/fd.h"
+#include "fs/vfs.h"
 #include "log/log.h"
 #include "misc/stats.h"
 
 static cache_t *file_cache;
-static DEFINE_SPINLOCK(gfdt_lock);
 
 file_t * gfdt_obtain() {
-    uint32_t flags;
-    spin_lock_irqsave(&gfdt_lock, &flags);
-
-    gfdt_entries_in_use++;
-
     file_t *f = cache_alloc(file_cache);
+    atomic_set(&f->refs, 0);
 
-    spin_unlock_irqstore(&gfdt_lock, flags);
-
-    f->refs = 0;
+    atomic_inc(&gfdt_entries_in_use);
 
     return f;
 }
 
 void gfdt_get(file_t *f) {
-    uint32_t flags;
-    spin_lock_irqsave(&gfdt_lock, &flags);
-
-    f->refs++;
-
-    spin_unlock_irqstore(&gfdt_lock, flags);
+    atomic_inc(&f->refs);
 }
 
+//Called once the last reference is gone, so nobody else can see f, and no
+//lock need be held while the file is closed (which may well sleep).
 static void gfdt_free(file_t *f) {
     f->ops->close(f);
+    if(f->path.dentry) {
+        path_put(&f->path);
+    }
     cache_free(file_cache, f);
 
-    gfdt_entries_in_use--;
+    atomic_dec(&gfdt_entries_in_use);
 }
 
 void gfdt_put(file_t *f) {
-    uint32_t flags;
-    spin_lock_irqsave(&gfdt_lock, &flags);
-
-    if(f->refs) {
-        f->refs--;
-    }
-
-    if(!f->refs) {
+    if(atomic_dec_and_test(&f->refs)) {
         gfdt_free(f);
     }
-
-    spin_unlock_irqstore(&gfdt_lock, flags);
 }
 
 static INITCALL gfdt_init() {
@@ -0,0 +1,446 @@
+#include "common/types.h"
+#include "common/list.h"
+#include "common/math.h"
+#include "common/ringbuff.h"
+#include "lib/string.h"
+#include "bug/debug.h"
+#include "init/initcall.h"
+#include "mm/cache.h"
+#include "sync/spinlock.h"
+#include "sync/semaphore.h"
+#include "arch/proc.h"
+#include "sched/sched.h"
+#include "user/signal.h"
+#include "fs/vfs.h"
+#include "fs/pipe.h"
+
+//One byte of the ring is always left empty, so this fills a page exactly
+#define PIPE_BUFF_SIZE (PAGE_SIZE - 1)
+
+typedef struct pipe {
+    spinlock_t lock;
+    ringbuff_head_t rb;
+
+    //Number of open ends which read and which write
+    uint32_t readers;
+    uint32_t writers;
+    //How many of each have ever been opened, so that a FIFO open waiting for
+    //its peer notices one which came and went while it slept
+    uint32_t reader_opens;
+    uint32_t writer_opens;
+    //Anonymous pipes go with their last end, FIFOs live as long as the inode
+    bool anonymous;
+
+    //Only one reader and one writer at a time, so that each can copy to or
+    //from the ring without holding lock (the other side of the copy may be
+    //user memory, or another file entirely).
+    semaphore_t read_mutex;
+    semaphore_t write_mutex;
+
+    list_head_t read_waiters;
+    list_head_t write_waiters;
+} pipe_t;
+
+typedef struct pipe_waiter {
+    thread_t *thread;
+    list_head_t list;
+} pipe_waiter_t;
+
+//Moves len bytes into or out of chunk, which lies in the ring. Returns the
+//number of bytes moved, or -errno.
+typedef ssize_t (*pipe_actor_t)(void *arg, char *chunk, size_t len);
+
+static cache_t *pipe_cache;
+
+static file_ops_t pipe_file_ops;
+
+static pipe_t * pipe_alloc(bool anonymous) {
+    pipe_t *pipe = cache_alloc(pipe_cache);
+    spinlock_init(&pipe->lock);
+    ringbuff_init(&pipe->rb, PIPE_BUFF_SIZE, char);
+
+    pipe->readers = 0;
+    pipe->writers = 0;
+    pipe->reader_opens = 0;
+    pipe->writer_opens = 0;
+    pipe->anonymous = anonymous;
+
+    semaphore_init(&pipe->read_mutex, 1);
+    semaphore_init(&pipe->write_mutex, 1);
+    list_init(&pipe->read_waiters);
+    list_init(&pipe->write_waiters);
+
+    return pipe;
+}
+
+static void pipe_free(pipe_t *pipe) {
+    ringbuff_destroy(&pipe->rb, char);
+    cache_free(pipe_cache, pipe);
+}
+
+static inline bool file_reads(file_t *file) {
+    return (file->flags & O_ACCMODE) != O_WRONLY;
+}
+
+static inline bool file_writes(file_t *file) {
+    return (file->flags & O_ACCMODE) != O_RDONLY;
+}
+
+//Expects lock held (with flags its saved interrupt flags), which is dropped
+//while asleep. Waiters must recheck whatever they were waiting for.
+static void pipe_wait(pipe_t *pipe, list_head_t *queue, uint32_t *flags) {
+    pipe_waiter_t waiter = {.thread = current};
+    list_add(&waiter.list, queue);
+
+    thread_sleep_prepare();
+
+    spin_unlock_irqstore(&pipe->lock, *flags);
+    sched_switch();
+    spin_lock_irqsave(&pipe->lock, flags);
+
+    list_rm(&waiter.list);
+}
+
+//Expects lock held
+static void pipe_wake(list_head_t *queue) {
+    pipe_waiter_t *waiter;
+    LIST_FOR_EACH_ENTRY(waiter, queue, list) {
+        thread_wake(waiter->thread);
+    }
+}
+
+static void pipe_attach(pipe_t *pipe, file_t *file) {
+    uint32_t flags;
+    spin_lock_irqsave(&pipe->lock, &flags);
+
+    if(file_reads(file)) {
+        pipe->readers++;
+        pipe->reader_opens++;
+        pipe_wake(&pipe->write_waiters);
+    }
+    if(file_writes(file)) {
+        pipe->writers++;
+        pipe->writer_opens++;
+        pipe_wake(&pipe->read_waiters);
+    }
+
+    spin_unlock_irqstore(&pipe->lock, flags);
+
+    file->private = pipe;
+}
+
+//Returns 1 once there is something to read, 0 at end of file, or -errno
+static int32_t pipe_wait_data(pipe_t *pipe, bool nonblock, uint32_t *flags) {
+    while(ringbuff_is_empty(&pipe->rb, char)) {
+        if(!pipe->writers) return 0;
+        if(nonblock) return -EAGAIN;
+        if(should_abort_slow_io()) return -EINTR;
+
+        pipe_wait(pipe, &pipe->read_waiters, flags);
+    }
+
+    return 1;
+}
+
+//Returns 1 once there is room for need bytes, or -errno
+static int32_t pipe_wait_room(pipe_t *pipe, size_t need, bool nonblock,
+    uint32_t *flags) {
+    while(true) {
+        if(!pipe->readers) return -EPIPE;
+        if(ringbuff_space_left(&pipe->rb, char) >= need) return 1;
+        if(nonblock) return -EAGAIN;
+        if(should_abort_slow_io()) return -EINTR;
+
+        pipe_wait(pipe, &pipe->write_waiters, flags);
+    }
+}
+
+//Hand up to len bytes from the front of the ring to actor, a contiguous chunk
+//at a time (so at most two calls, if the data wraps).
+static ssize_t pipe_drain(pipe_t *pipe, bool nonblock, size_t len,
+    pipe_actor_t actor, void *arg) {
+    if(!len) {
+        return 0;
+    }
+
+    semaphore_down(&pipe->read_mutex);
+
+    uint32_t flags;
+    spin_lock_irqsave(&pipe->lock, &flags);
+
+    size_t total = 0;
+    ssize_t ret = pipe_wait_data(pipe, nonblock, &flags);
+    while(ret > 0 && total < len && !ringbuff_is_empty(&pipe->rb, char)) {
+        char *chunk = (char *) pipe->rb.front;
+        size_t amt = MIN(len - total, _ringbuff_chunksize_read(&pipe->rb));
+
+        spin_unlock_irqstore(&pipe->lock, flags);
+        ret = actor(arg, chunk, amt);
+        spin_lock_irqsave(&pipe->lock, &flags);
+
+        if(ret <= 0) {
+            break;
+        }
+
+        _ringbuff_advance_front(&pipe->rb, ret);
+        total += ret;
+        pipe_wake(&pipe->write_waiters);
+
+        //Don't go back to a sink which can't keep up
+        if((size_t) ret < amt) {
+            break;
+        }
+    }
+
+    spin_unlock_irqstore(&pipe->lock, flags);
+    semaphore_up(&pipe->read_mutex);
+
+    return total ? (ssize_t) total : ret;
+}
+
+//Have actor fill up to len bytes at the back of the ring, a contiguous chunk
+//at a time, waiting for room as neccessary.
+static ssize_t pipe_fill(pipe_t *pipe, bool nonblock, size_t len,
+    pipe_actor_t actor, void *arg) {
+    semaphore_down(&pipe->write_mutex);
+
+    uint32_t flags;
+    spin_lock_irqsave(&pipe->lock, &flags);
+
+    size_t total = 0;
+    ssize_t ret = 0;
+    while(total < len) {
+        //Small writes wait until they fit whole, so they are never split
+        size_t need = len <= PIPE_ATOMIC ? len - total : 1;
+        if((ret = pipe_wait_room(pipe, need, nonblock, &flags)) <= 0) {
+            break;
+        }
+
+        char *chunk = (char *) pipe->rb.back;
+        size_t amt = MIN(len - total,
+            _ringbuff_chunksize_write(&pipe->rb, sizeof(char)));
+
+        spin_unlock_irqstore(&pipe->lock, flags);
+        ret = actor(arg, chunk, amt);
+        spin_lock_irqsave(&pipe->lock, &flags);
+
+        if(ret <= 0) {
+            break;
+        }
+
+        _ringbuff_advance_back(&pipe->rb, ret);
+        total += ret;
+        pipe_wake(&pipe->read_waiters);
+
+        //Don't go back to a source which has run dry
+        if((size_t) ret < amt) {
+            break;
+        }
+    }
+
+    spin_unlock_irqstore(&pipe->lock, flags);
+    semaphore_up(&pipe->write_mutex);
+
+    if(!total && ret == -EPIPE) {
+        thread_send_signal(current, SIGPIPE);
+    }
+
+    return total ? (ssize_t) total : ret;
+}
+
+static ssize_t copy_out(void *arg, char *chunk, size_t len) {
+    char **buff = arg;
+    memcpy(*buff, chunk, len);
+    *buff += len;
+    return len;
+}
+
+static ssize_t copy_in(void *arg, char *chunk, size_t len) {
+    const char **buff = arg;
+    memcpy(chunk, *buff, len);
+    *buff += len;
+    return len;
+}
+
+static ssize_t splice_to_file(void *arg, char *chunk, size_t len) {
+    return vfs_write(arg, chunk, len);
+}
+
+static ssize_t splice_from_file(void *arg, char *chunk, size_t len) {
+    return vfs_read(arg, chunk, len);
+}
+
+//Opening just one end of a FIFO waits until the other end has been opened
+//too, so that a reader doesn't see end of file (or a writer a broken pipe)
+//before anyone has turned up. Opens can't fail, so a nonblocking or
+//interrupted open goes ahead regardless.
+static void fifo_file_open(file_t *file, inode_t *inode) {
+    pipe_t *pipe = inode->private;
+    pipe_attach(pipe, file);
+
+    if((file->flags & O_NONBLOCK) || (file_reads(file) && file_writes(file))) {
+        return;
+    }
+
+    bool reads = file_reads(file);
+    uint32_t *peers = reads ? &pipe->writers : &pipe->readers;
+    uint32_t *peer_opens = reads ? &pipe->writer_opens : &pipe->reader_opens;
+    list_head_t *queue = reads ? &pipe->read_waiters : &pipe->write_waiters;
+
+    uint32_t flags;
+    spin_lock_irqsave(&pipe->lock, &flags);
+
+    uint32_t seen = *peer_opens;
+    while(!*peers && *peer_opens == seen && !should_abort_slow_io()) {
+        pipe_wait(pipe, queue, &flags);
+    }
+
+    spin_unlock_irqstore(&pipe->lock, flags);
+}
+
+static void pipe_file_close(file_t *file) {
+    pipe_t *pipe = file->private;
+
+    uint32_t flags;
+    spin_lock_irqsave(&pipe->lock, &flags);
+
+    if(file_reads(file)) pipe->readers--;
+    if(file_writes(file)) pipe->writers--;
+
+    //Whoever is left may now see end of file, or a broken pipe
+    pipe_wake(&pipe->read_waiters);
+    pipe_wake(&pipe->write_waiters);
+
+    bool unused = !pipe->readers && !pipe->writers;
+    if(unused && !pipe->anonymous) {
+        //A FIFO forgets its contents once nobody has it open
+        pipe->rb.front = pipe->rb.back = pipe->rb.start;
+    }
+
+    spin_unlock_irqstore(&pipe->lock, flags);
+
+    if(unused && pipe->anonymous) {
+        pipe_free(pipe);
+    }
+}
+
+static off_t pipe_file_seek(file_t *file, off_t off, int whence) {
+    return -ESPIPE;
+}
+
+static ssize_t pipe_file_read(file_t *file, char *buff, size_t bytes) {
+    if(!file_reads(file)) {
+        return -EBADF;
+    }
+
+    return pipe_drain(file->private, file->flags & O_NONBLOCK, bytes, copy_out,
+        &buff);
+}
+
+static ssize_t pipe_file_write(file_t *file, const char *buff, size_t bytes) {
+    if(!file_writes(file)) {
+        return -EBADF;
+    }
+
+    return pipe_fill(file->private, file->flags & O_NONBLOCK, bytes, copy_in,
+        &buff);
+}
+
+static int32_t pipe_file_poll(file_t *file, fpoll_data_t *fp) {
+    pipe_t *pipe = file->private;
+
+    uint32_t flags;
+    spin_lock_irqsave(&pipe->lock, &flags);
+
+    fp->readable = !ringbuff_is_empty(&pipe->rb, char) || !pipe->writers;
+    fp->writable = ringbuff_space_left(&pipe->rb, char) || !pipe->readers;
+    fp->errored = file_writes(file) && !pipe->readers;
+
+    spin_unlock_irqstore(&pipe->lock, flags);
+
+    return 0;
+}
+
+static file_ops_t pipe_file_ops = {
+    .open  = fifo_file_open,
+    .close = pipe_file_close,
+    .seek  = pipe_file_seek,
+    .read  = pipe_file_read,
+    .write = pipe_file_write,
+    .poll  = pipe_file_poll,
+};
+
+static inode_ops_t fifo_inode_ops = {
+    .file_ops = &pipe_file_ops,
+
+    .create = fs_no_create,
+};
+
+void pipe_create(file_t **read, file_t **write) {
+    *read = file_alloc(&pipe_file_ops);
+    *write = file_alloc(&pipe_file_ops);
+    if(!*read || !*write) {
+        BUG();
+    }
+
+    (*read)->flags = O_RDONLY;
+    (*write)->flags = O_WRONLY;
+
+    pipe_t *pipe = pipe_alloc(true);
+    pipe_attach(pipe, *read);
+    pipe_attach(pipe, *write);
+}
+
+inode_t * fifo_inode_alloc(fs_t *fs) {
+    inode_t *inode = inode_alloc(fs, &fifo_inode_ops);
+    inode->private = pipe_alloc(false);
+
+    return inode;
+}
+
+int32_t pipe_getattr(file_t *file, stat_t *stat) {
+    if(file->ops != &pipe_file_ops) {
+        return -EINVAL;
+    }
+
+    //An anonymous pipe has no inode, so there is little to say about it
+    memset(stat, 0, sizeof(stat_t));
+    stat->st_mode = S_IFIFO | 0600;
+    stat->st_nlink = 1;
+    stat->st_blksize = PAGE_SIZE;
+
+    return 0;
+}
+
+ssize_t vfs_splice(file_t *in, file_t *out, size_t len, uint32_t flags) {
+    bool nonblock = flags & SPLICE_F_NONBLOCK;
+
+    if(in->ops == &pipe_file_ops && out->ops == &pipe_file_ops
+        && in->private == out->private) {
+        return -EINVAL;
+    }
+
+    //Data leaves a pipe straight from the ring, and enters one straight into
+    //it. Pipe to pipe is then a single copy, made by the writing side.
+    if(in->ops == &pipe_file_ops) {
+        if(!file_reads(in)) {
+            return -EBADF;
+        }
+        return pipe_drain(in->private, nonblock, len, splice_to_file, out);
+    } else if(out->ops == &pipe_file_ops) {
+        if(!file_writes(out)) {
+            return -EBADF;
+        }
+        return pipe_fill(out->private, nonblock, len, splice_from_file, in);
+    }
+
+    return -EINVAL;
+}
+
+static INITCALL pipe_init() {
+    pipe_cache = cache_create(sizeof(pipe_t));
+
+    return 0;
+}
+
+core_initcall(pipe_init);
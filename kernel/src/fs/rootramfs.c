@@ -1,96 +1,194 @@
 #include "common/types.h"
 #include "common/compiler.h"
+#include "common/math.h"
 #include "bug/debug.h"
+#include "lib/string.h"
+#include "lib/lz4.h"
 #include "mm/mm.h"
 #include "fs/vfs.h"
+#include "fs/type/ramfs.h"
+#include "fs/rootramfs.h"
 #include "log/log.h"
 
-#define MAGIC "KRFS"
+#define MAGIC "KRF2"
 
-#define ENTRY_TYPE_DIR      1
-#define ENTRY_TYPE_FRECORD  2
+#define BLOCK_SIZE PAGE_SIZE
 
-typedef struct frecord {
-    uint32_t len;
-    uint8_t data[];
-} PACKED frecord_t;
+#define ENTRY_FLAG_DIR (1 << 0)
+#define ENTRY_FLAG_LZ4 (1 << 1)
+//The data is also used by other entries with identical contents
+#define ENTRY_FLAG_SHARED (1 << 2)
 
+//The image is a header, then the index (one entry_t per file or directory),
+//then the name table, then the file data. Entry 0 is the root directory, and
+//every entry comes after its parent.
+typedef struct rootramfs_header {
+    char magic[4];
+    uint32_t num_entries;
+    uint32_t names_off;
+    uint32_t names_len;
+} PACKED rootramfs_header_t;
+
+//File data starts on a page boundary. Plain data is padded with zeroes to a
+//whole number of blocks, so that its pages can be handed to ramfs directly.
+//LZ4 data starts with num_blocks + 1 offsets (from data_off) delimiting each
+//compressed block; a block as long as its uncompressed size is stored raw.
 typedef struct entry {
-    uint8_t type;
+    uint32_t parent;
+    uint32_t name_off;
     uint32_t name_len;
-    char name[];
+    uint32_t flags;
+    uint32_t mode;
+    uint32_t size;
+    uint32_t data_off;
+    uint32_t data_len;
 } PACKED entry_t;
 
-typedef struct rootramfs_header {
-    char magic[4];
-} PACKED rootramfs_header_t;
+typedef struct source {
+    void *image;
+    entry_t *entry;
+} source_t;
+
+static page_t * source_fill(void *private, uint32_t idx) {
+    source_t *src = private;
+    entry_t *e = src->entry;
+    void *data = src->image + e->data_off;
+
+    //The image stays resident, so plain data pages just change hands, unless
+    //other files still need them
+    if(!(e->flags & ENTRY_FLAG_LZ4)) {
+        if(!(e->flags & ENTRY_FLAG_SHARED)) {
+            return virt_to_page(data + (idx * BLOCK_SIZE));
+        }
 
-static uint32_t entry_reconstruct(entry_t *e, const path_t *root) {
-    switch(e->type) {
-        case ENTRY_TYPE_DIR: {
-            char *pathname = kmalloc(e->name_len + 2);
-            memcpy(pathname, e->name, e->name_len);
-            pathname[e->name_len] = '/';
-            pathname[e->name_len + 1] = '\0';
+        page_t *page = alloc_page(0);
+        memcpy(page_to_virt(page), data + (idx * BLOCK_SIZE), BLOCK_SIZE);
+        return page;
+    }
 
-            kprintf("rootramfs - loading \"/%s\"", pathname);
+    uint32_t *offs = data;
+    uint32_t want = MIN(BLOCK_SIZE, e->size - (idx * BLOCK_SIZE));
+    uint32_t clen = offs[idx + 1] - offs[idx];
+
+    page_t *page = alloc_page(0);
+    void *block = page_to_virt(page);
+    if(clen == want) {
+        memcpy(block, data + offs[idx], want);
+    } else if(lz4_decompress(data + offs[idx], clen, block, want)
+        != (int32_t) want) {
+        panicf("rootramfs - corrupt block %u", idx);
+    }
+    memset(block + want, 0, BLOCK_SIZE - want);
 
-            char *part = pathname;
-            while(*part) {
-                part = strchr(part, '/');
+    return page;
+}
 
-                if(!part) break;
+static void entry_check(entry_t *e, uint32_t idx, rootramfs_header_t *hdr,
+    entry_t *entries, uint32_t len) {
+    if(e->parent >= idx || !(entries[e->parent].flags & ENTRY_FLAG_DIR)
+        || !e->name_len || e->name_len > hdr->names_len
+        || e->name_off > hdr->names_len - e->name_len) {
+        panicf("rootramfs - bad entry %u", idx);
+    }
 
-                part[0] = '\0';
+    if((e->flags & ENTRY_FLAG_DIR) || !e->size) {
+        return;
+    }
 
-                path_t path;
-                int32_t ret = vfs_create(root, pathname, S_IFDIR | 0755, &path);
-                if(ret < 0 && ret != -EEXIST) {
-                    panicf("rootramfs - vfs_create() failed: %d", ret);
-                }
+    uint32_t blocks = DIV_UP(e->size, BLOCK_SIZE);
+    if(e->data_off % BLOCK_SIZE || e->data_off > len
+        || e->data_len > len - e->data_off) {
+        panicf("rootramfs - bad data for entry %u", idx);
+    }
 
-                part[0] = '/';
-                part++;
-            }
+    if(!(e->flags & ENTRY_FLAG_LZ4)) {
+        if(e->data_len < blocks * BLOCK_SIZE) {
+            panicf("rootramfs - bad data for entry %u", idx);
+        }
+        return;
+    }
 
-            return sizeof(entry_t) + e->name_len;
+    uint32_t *offs = ((void *) hdr) + e->data_off;
+    if(blocks >= e->data_len / sizeof(uint32_t)) {
+        panicf("rootramfs - bad data for entry %u", idx);
+    }
+    for(uint32_t i = 0; i < blocks; i++) {
+        if(offs[i] > offs[i + 1] || offs[i + 1] > e->data_len) {
+            panicf("rootramfs - bad data for entry %u", idx);
         }
-        case ENTRY_TYPE_FRECORD: {
-            char *pathname = kmalloc(e->name_len + 1);
-            memcpy(pathname, e->name, e->name_len);
-            pathname[e->name_len] = '\0';
+    }
+}
 
-            kprintf("rootramfs - loading \"/%s\"", pathname);
+bool rootramfs_load(void *start, uint32_t len) {
+    rootramfs_header_t *hdr = start;
+    if(len < sizeof(rootramfs_header_t) || memcmp(&hdr->magic, MAGIC, 4)) {
+        panic("rootramfs - invalid magic hdr");
+    }
+
+    uint32_t max_entries = (len - sizeof(rootramfs_header_t)) / sizeof(entry_t);
+    if(!hdr->num_entries || hdr->num_entries > max_entries
+        || hdr->names_off > len || hdr->names_len > len - hdr->names_off) {
+        panic("rootramfs - truncated index");
+    }
 
-            path_t path;
-            int32_t ret = vfs_create(root, pathname, S_IFREG | 0755, &path);
-            if(ret < 0) {
-                panicf("rootramfs - vfs_create() failed: %d", ret);
-            }
+    entry_t *entries = start + sizeof(rootramfs_header_t);
+    char *names = start + hdr->names_off;
 
-            frecord_t *fr = ((void *) e) + sizeof(entry_t) + e->name_len;
+    //Directories stay referenced until all of their children exist
+    path_t *dirs = kmalloc(hdr->num_entries * sizeof(path_t));
+    dirs[0] = MNT_ROOT(root_mount);
+    path_get(&dirs[0]);
 
-            file_t *f = vfs_open_file(&path);
-            vfs_write(f, fr->data, fr->len);
+    uint32_t files = 0, compressed = 0;
+    for(uint32_t i = 1; i < hdr->num_entries; i++) {
+        entry_t *e = &entries[i];
+        entry_check(e, i, hdr, entries, len);
 
-            return sizeof(entry_t) + e->name_len + sizeof(frecord_t) + fr->len;
+        char *name = kmalloc(e->name_len + 1);
+        memcpy(name, names + e->name_off, e->name_len);
+        name[e->name_len] = '\0';
+
+        bool is_dir = e->flags & ENTRY_FLAG_DIR;
+        uint32_t mode = (is_dir ? S_IFDIR : S_IFREG) | (e->mode & 07777);
+
+        path_t path;
+        int32_t ret = vfs_create(&dirs[e->parent], name, mode, &path);
+        if(ret < 0 && !(is_dir && ret == -EEXIST)) {
+            panicf("rootramfs - vfs_create(\"%s\") failed: %d", name, ret);
         }
-        default: {
-            BUG();
+        kfree(name);
 
-            break;
+        if(is_dir) {
+            dirs[i] = path;
+            continue;
         }
-    }
-}
 
-void rootramfs_load(void *start, uint32_t len) {
-    rootramfs_header_t *hdr = start;
-    if(memcmp(&hdr->magic, MAGIC, 4)) {
-        panic("rootramfs - invalid magic hdr");
+        dirs[i].dentry = NULL;
+
+        if(e->size) {
+            source_t *src = kmalloc(sizeof(source_t));
+            src->image = start;
+            src->entry = e;
+            ramfs_set_source(path.dentry->inode, e->size, source_fill, src);
+        }
+        path_put(&path);
+
+        files++;
+        if(e->flags & ENTRY_FLAG_LZ4) {
+            compressed++;
+        }
     }
 
-    uint32_t off = sizeof(rootramfs_header_t);
-    while(off < len) {
-        off += entry_reconstruct(start + off, &MNT_ROOT(root_mount));
+    for(uint32_t i = 0; i < hdr->num_entries; i++) {
+        if(dirs[i].dentry) {
+            path_put(&dirs[i]);
+        }
     }
+    kfree(dirs);
+
+    kprintf("rootramfs - %u entries, %u files (%u compressed)",
+        hdr->num_entries, files, compressed);
+
+    //File data is read straight out of the image from now on
+    return true;
 }
@@ -29,6 +29,9 @@ static ssize_t char_file_read(file_t *file, char *buff, size_t bytes) {
     devfs_device_t *device = file->private;
     char_device_t *cdev = device->chardev;
 
+    if(cdev->ops->read_at) {
+        return cdev->ops->read_at(cdev, buff, bytes, &file->offset);
+    }
     return cdev->ops->read(cdev, buff, bytes);
 }
 
@@ -340,10 +343,14 @@ static INITCALL devfs_mount() {
             kprintf("devfs - could not create path \"%s\"", mntpoint);
         } else if((ret = vfs_lookup(&wd, mntpoint, &target))) {
             kprintf("devfs - could not lookup \"%s\": %d", mntpoint, ret);
-        } else if(vfs_do_mount(devfs, &target)) {
-            kprintf("devfs - mounted at \"%s\"", mntpoint);
         } else {
-            kprintf("devfs - could not mount at \"%s\"", mntpoint);
+            if(vfs_do_mount(devfs, &target)) {
+                kprintf("devfs - mounted at \"%s\"", mntpoint);
+            } else {
+                kprintf("devfs - could not mount at \"%s\"", mntpoint);
+            }
+
+            path_put(&target);
         }
     }
 
@@ -0,0 +1,455 @@
+#include "common/types.h"
+#include "common/math.h"
+#include "common/hashtable.h"
+#include "lib/string.h"
+#include "lib/printf.h"
+#include "init/initcall.h"
+#include "init/param.h"
+#include "sync/semaphore.h"
+#include "mm/mm.h"
+#include "arch/proc.h"
+#include "sched/proc.h"
+#include "sched/task.h"
+#include "sched/acct.h"
+#include "fs/vfs.h"
+#include "misc/stats.h"
+#include "log/log.h"
+
+//Every inode is named by a key: the pid it describes (0 for none) and what
+//it is. Files are rendered afresh each time they are read.
+#define PROC_ROOT       0
+#define PROC_STAT       1
+#define PROC_MEMINFO    2
+#define PROC_PID        3
+#define PROC_PID_STAT   4
+#define PROC_PID_STATUS 5
+
+#define PROC_KIND_BITS 3
+
+#define PROC_KEY(pid, kind) ((((uint32_t) (pid)) << PROC_KIND_BITS) | (kind))
+#define PROC_KEY_PID(key)   ((pid_t) ((key) >> PROC_KIND_BITS))
+#define PROC_KEY_KIND(key)  ((key) & ((1 << PROC_KIND_BITS) - 1))
+
+#define PROC_FILE_LEN    512
+#define PROC_STAT_CPU_LEN 96
+
+typedef struct proc_entry {
+    const char *name;
+    uint32_t kind;
+} proc_entry_t;
+
+static const proc_entry_t root_entries[] = {
+    {"stat",    PROC_STAT},
+    {"meminfo", PROC_MEMINFO},
+};
+
+static const proc_entry_t pid_entries[] = {
+    {"stat",   PROC_PID_STAT},
+    {"status", PROC_PID_STATUS},
+};
+
+//Dentries from lookups are reclaimed once unused, but inodes are never freed,
+//so each one is kept here to be handed out again next time.
+typedef struct proc_inode {
+    uint32_t key;
+    inode_t *inode;
+
+    hashtable_node_t node;
+} proc_inode_t;
+
+static fs_t *procfs;
+static DEFINE_HASHTABLE(proc_inodes, 6);
+static DEFINE_SEMAPHORE(proc_inodes_mutex, 1);
+static const char *mntpoint = "/proc";
+
+static inode_ops_t proc_dir_inode_ops;
+static inode_ops_t proc_file_inode_ops;
+
+static bool is_dir(uint32_t kind) {
+    return kind == PROC_ROOT || kind == PROC_PID;
+}
+
+static inode_t * proc_inode_get(uint32_t key) {
+    semaphore_down(&proc_inodes_mutex);
+
+    proc_inode_t *entry;
+    HASHTABLE_FOR_EACH_COLLISION(key, entry, proc_inodes, node) {
+        if(entry->key == key) {
+            semaphore_up(&proc_inodes_mutex);
+            return entry->inode;
+        }
+    }
+
+    inode_t *inode;
+    if(is_dir(PROC_KEY_KIND(key))) {
+        inode = inode_alloc(procfs, &proc_dir_inode_ops);
+        inode->flags |= INODE_FLAG_DIRECTORY;
+        inode->mode = S_IFDIR | 0555;
+    } else {
+        inode = inode_alloc(procfs, &proc_file_inode_ops);
+        inode->mode = S_IFREG | 0444;
+    }
+
+    inode->blkshift = 12;
+    inode->private = (void *) key;
+
+    entry = kmalloc(sizeof(proc_inode_t));
+    entry->key = key;
+    entry->inode = inode;
+    hashtable_add(key, &entry->node, proc_inodes);
+
+    semaphore_up(&proc_inodes_mutex);
+
+    return inode;
+}
+
+static uint32_t render_pid_stat(char *buff, task_stat_t *s) {
+    //The same fields, in the same order, as Linux's. Those not kept here are
+    //zero (or -1 for the terminal's process group).
+    return sprintf(buff, "%d (%s) %c %d %d %d 0 -1 0 0 0 0 0 %u %u 0 0 20 0 "
+        "%u 0 %u %u %u\n", s->pid, s->comm, s->state, s->ppid, s->pgrp,
+        s->session, acct_to_ticks(s->utime), acct_to_ticks(s->stime),
+        s->num_threads, (uint32_t) (s->start * ACCT_TICKS_PER_SEC / 1000),
+        s->rss * PAGE_SIZE, s->rss);
+}
+
+static uint32_t render_pid_status(char *buff, task_stat_t *s) {
+    return sprintf(buff,
+        "Name:\t%s\n"
+        "State:\t%c\n"
+        "Pid:\t%d\n"
+        "PPid:\t%d\n"
+        "Threads:\t%u\n"
+        "VmRSS:\t%u kB\n"
+        "voluntary_ctxt_switches:\t%u\n"
+        "nonvoluntary_ctxt_switches:\t%u\n",
+        s->comm, s->state, s->pid, s->ppid, s->num_threads,
+        s->rss * (PAGE_SIZE / 1024), s->nvcsw, s->nivcsw);
+}
+
+static uint32_t render_cpu(char *buff, const char *name, cpu_acct_t *acct) {
+    //user nice system idle iowait irq softirq
+    return sprintf(buff, "%-5s%u 0 %u %u 0 0 0\n", name,
+        acct_to_ticks(acct->user), acct_to_ticks(acct->system),
+        acct_to_ticks(acct->idle));
+}
+
+static uint32_t render_stat(char *buff) {
+    cpu_acct_t total, cpu[num_procs];
+    memset(&total, 0, sizeof(cpu_acct_t));
+    for(uint32_t i = 0; i < num_procs; i++) {
+        acct_cpu_get(i, &cpu[i]);
+        total.user += cpu[i].user;
+        total.system += cpu[i].system;
+        total.idle += cpu[i].idle;
+        total.switches += cpu[i].switches;
+    }
+
+    uint32_t len = render_cpu(buff, "cpu", &total);
+    for(uint32_t i = 0; i < num_procs; i++) {
+        char name[16];
+        sprintf(name, "cpu%u", i);
+        len += render_cpu(buff + len, name, &cpu[i]);
+    }
+
+    len += sprintf(buff + len, "ctxt %u\n", total.switches);
+    len += sprintf(buff + len, "processes %u\n", thread_count);
+
+    return len;
+}
+
+static uint32_t render_meminfo(char *buff) {
+    mm_info_t info;
+    mm_get_info(&info);
+
+    uint32_t kb = PAGE_SIZE / 1024;
+    uint32_t free = info.free + info.zeroed + info.cpu_cached;
+    return sprintf(buff,
+        "%-16s%8u kB\n%-16s%8u kB\n%-16s%8u kB\n%-16s%8u kB\n%-16s%8u kB\n",
+        "MemTotal:", info.total * kb,
+        "MemFree:", free * kb,
+        "MemUsed:", (info.total - free) * kb,
+        "MemZeroed:", info.zeroed * kb,
+        "MemPerCPU:", info.cpu_cached * kb);
+}
+
+//Returns the file named by key in a new buffer, or NULL if its task is gone
+static char * render(uint32_t key, uint32_t *len) {
+    switch(PROC_KEY_KIND(key)) {
+        case PROC_STAT: {
+            char *buff = kmalloc(PROC_FILE_LEN + num_procs * PROC_STAT_CPU_LEN);
+            *len = render_stat(buff);
+            return buff;
+        }
+        case PROC_MEMINFO: {
+            char *buff = kmalloc(PROC_FILE_LEN);
+            *len = render_meminfo(buff);
+            return buff;
+        }
+        case PROC_PID_STAT:
+        case PROC_PID_STATUS: {
+            task_stat_t stat;
+            if(!task_get_stat(PROC_KEY_PID(key), &stat)) {
+                return NULL;
+            }
+
+            char *buff = kmalloc(PROC_FILE_LEN);
+            if(PROC_KEY_KIND(key) == PROC_PID_STAT) {
+                *len = render_pid_stat(buff, &stat);
+            } else {
+                *len = render_pid_status(buff, &stat);
+            }
+            return buff;
+        }
+        default: {
+            BUG();
+        }
+    }
+}
+
+static void proc_file_open(file_t *file, inode_t *inode) {
+}
+
+static void proc_file_close(file_t *file) {
+}
+
+static off_t proc_file_seek(file_t *file, off_t offset, int whence) {
+    int64_t pos;
+    switch(whence) {
+        case SEEK_SET: {
+            pos = offset;
+            break;
+        }
+        case SEEK_CUR: {
+            pos = ((int64_t) file->offset) + ((int32_t) offset);
+            break;
+        }
+        default: {
+            //The size isn't known until the file is read
+            return -EINVAL;
+        }
+    }
+
+    if(pos < 0 || pos > UINT32_MAX) {
+        return -EINVAL;
+    }
+
+    file->offset = pos;
+    return pos;
+}
+
+static ssize_t proc_file_read(file_t *file, char *buff, size_t bytes) {
+    uint32_t key = (uint32_t) file->path.dentry->inode->private;
+
+    uint32_t len;
+    char *text = render(key, &len);
+    if(!text) {
+        return -ESRCH;
+    }
+
+    uint32_t amt = 0;
+    if(file->offset < len) {
+        amt = MIN(bytes, len - file->offset);
+        memcpy(buff, text + file->offset, amt);
+        file->offset += amt;
+    }
+
+    kfree(text);
+
+    return amt;
+}
+
+static ssize_t proc_file_write(file_t *file, const char *buff, size_t bytes) {
+    return -EINVAL;
+}
+
+static int32_t proc_file_poll(file_t *file, fpoll_data_t *fp) {
+    fp->readable = true;
+    fp->writable = false;
+    fp->errored = false;
+
+    return 0;
+}
+
+static file_ops_t proc_file_ops = {
+    .open  = proc_file_open,
+    .close = proc_file_close,
+    .seek  = proc_file_seek,
+    .read  = proc_file_read,
+    .write = proc_file_write,
+    .poll  = proc_file_poll,
+};
+
+static inode_ops_t proc_file_inode_ops = {
+    .file_ops = &proc_file_ops,
+};
+
+static bool parse_pid(const char *name, pid_t *pid) {
+    //No leading zeroes, so each pid has just the one name
+    if(name[0] < '1' || name[0] > '9') {
+        return false;
+    }
+
+    uint32_t val = 0;
+    for(; *name; name++) {
+        if(*name < '0' || *name > '9' || val > (INT32_MAX / 10)) {
+            return false;
+        }
+        val = (val * 10) + (*name - '0');
+    }
+
+    *pid = val;
+    return val <= INT32_MAX;
+}
+
+static inode_t * find_entry(const proc_entry_t *entries, uint32_t num,
+    pid_t pid, const char *name) {
+    for(uint32_t i = 0; i < num; i++) {
+        if(!strcmp(entries[i].name, name)) {
+            return proc_inode_get(PROC_KEY(pid, entries[i].kind));
+        }
+    }
+
+    return NULL;
+}
+
+//Pids are handed out in order and never reused, so a miss here is only ever
+//cached for a pid which doesn't exist yet, and only until the dentry is
+//reclaimed.
+static void proc_dir_lookup(inode_t *inode, dentry_t *target) {
+    uint32_t key = (uint32_t) inode->private;
+    pid_t pid;
+
+    if(PROC_KEY_KIND(key) == PROC_ROOT) {
+        target->inode = find_entry(root_entries, ARRAY_SIZE(root_entries), 0,
+            target->name);
+
+        task_node_t *node;
+        if(!target->inode && parse_pid(target->name, &pid)
+            && (node = task_node_find(pid))) {
+            task_node_put(node);
+            target->inode = proc_inode_get(PROC_KEY(pid, PROC_PID));
+        }
+    } else {
+        target->inode = find_entry(pid_entries, ARRAY_SIZE(pid_entries),
+            PROC_KEY_PID(key), target->name);
+    }
+}
+
+static void fill_dirent(dir_entry_dat_t *ent, uint32_t key, const char *name) {
+    ent->ino = proc_inode_get(key)->ino;
+    ent->type = is_dir(PROC_KEY_KIND(key)) ? ENTRY_TYPE_DIR : ENTRY_TYPE_FILE;
+    strcpy(ent->name, name);
+}
+
+//The root lists its files, then a directory for each task
+static uint32_t proc_dir_iterate(file_t *file, dir_entry_dat_t *buff,
+    uint32_t num) {
+    uint32_t key = (uint32_t) file->path.dentry->inode->private;
+    uint32_t pos = file->offset;
+    uint32_t num_read = 0;
+
+    const proc_entry_t *entries = root_entries;
+    uint32_t num_entries = ARRAY_SIZE(root_entries);
+    if(PROC_KEY_KIND(key) == PROC_PID) {
+        entries = pid_entries;
+        num_entries = ARRAY_SIZE(pid_entries);
+    }
+
+    for(; pos < num_entries && num_read < num; pos++, num_read++) {
+        fill_dirent(&buff[num_read],
+            PROC_KEY(PROC_KEY_PID(key), entries[pos].kind), entries[pos].name);
+    }
+
+    if(PROC_KEY_KIND(key) == PROC_ROOT && num_read < num) {
+        uint32_t num_pids = task_list_pids(NULL, 0);
+        pid_t *pids = kmalloc(MAX(num_pids, 1) * sizeof(pid_t));
+        num_pids = MIN(num_pids, task_list_pids(pids, num_pids));
+
+        for(; pos - num_entries < num_pids && num_read < num;
+            pos++, num_read++) {
+            pid_t pid = pids[pos - num_entries];
+
+            char name[16];
+            sprintf(name, "%d", pid);
+            fill_dirent(&buff[num_read], PROC_KEY(pid, PROC_PID), name);
+        }
+
+        kfree(pids);
+    }
+
+    file->offset = pos;
+    return num_read;
+}
+
+static file_ops_t proc_dir_file_ops = {
+    .open    = proc_file_open,
+    .close   = proc_file_close,
+
+    .iterate = proc_dir_iterate,
+};
+
+static inode_ops_t proc_dir_inode_ops = {
+    .file_ops = &proc_dir_file_ops,
+
+    .lookup = proc_dir_lookup,
+    .create = fs_no_create,
+};
+
+static void procfs_fill(fs_t *fs) {
+    procfs = fs;
+
+    fs->root = dentry_alloc("");
+    fs->root->fs = fs;
+    fs->root->inode = proc_inode_get(PROC_KEY(0, PROC_ROOT));
+}
+
+static dentry_t * procfs_create(fs_type_t *fs_type, const char *device) {
+    return fs_create_single(fs_type, procfs_fill);
+}
+
+static fs_type_t procfs_type = {
+    .name   = "procfs",
+    .flags  = FSTYPE_FLAG_NODEV,
+    .create = procfs_create,
+};
+
+static bool procfs_set_mntpoint(char *point) {
+    mntpoint = point;
+
+    return true;
+}
+
+cmdline_param("procfs.mount", procfs_set_mntpoint);
+
+static INITCALL procfs_init() {
+    register_fs_type(&procfs_type);
+
+    return 0;
+}
+
+static INITCALL procfs_mount() {
+    fs_t *fs = vfs_fs_create("procfs", NULL);
+
+    path_t wd = MNT_ROOT(root_mount), target;
+
+    int32_t ret = vfs_create(&wd, mntpoint, S_IFDIR | 0555, NULL);
+    if(ret && ret != -EEXIST) {
+        kprintf("procfs - could not create \"%s\": %d", mntpoint, ret);
+    } else if((ret = vfs_lookup(&wd, mntpoint, &target))) {
+        kprintf("procfs - could not lookup \"%s\": %d", mntpoint, ret);
+    } else {
+        if(vfs_do_mount(fs, &target)) {
+            kprintf("procfs - mounted at \"%s\"", mntpoint);
+        } else {
+            kprintf("procfs - could not mount at \"%s\"", mntpoint);
+        }
+
+        path_put(&target);
+    }
+
+    return 0;
+}
+
+core_initcall(procfs_init);
+fs_initcall(procfs_mount);
@@ -1,177 +1,287 @@
 #include "common/types.h"
+#include "common/math.h"
 #include "bug/debug.h"
 #include "lib/string.h"
 #include "init/initcall.h"
+#include "mm/mm.h"
 #include "mm/cache.h"
+#include "sync/semaphore.h"
 #include "fs/vfs.h"
+#include "fs/pipe.h"
+#include "fs/type/ramfs.h"
 #include "log/log.h"
 
-#define CHUNK_SIZE 1024
+//File data lives in whole pages, indexed by a radix tree of page-sized nodes.
+//A tree of height h covers RADIX_ENTRIES^h blocks; at height 0 the root is
+//the single data page itself, so small files pay for no index at all.
+#define RADIX_SHIFT   10
+#define RADIX_ENTRIES (1 << RADIX_SHIFT)
+#define RADIX_MASK    (RADIX_ENTRIES - 1)
 
-typedef struct chunk {
-    uint32_t used;
-    void *buff;
+//Two levels cover 2^20 pages, i.e. all of a 32 bit file size.
+#define RADIX_MAX_HEIGHT 2
 
-    list_head_t list;
-} chunk_t;
+#define BLOCK_SHIFT 12
+#define BLOCK_SIZE  (1 << BLOCK_SHIFT)
 
 typedef struct record {
-    list_head_t chunks;
+    semaphore_t lock;
+
+    //Either a page_t * (height 0), or a node of RADIX_ENTRIES pointers to
+    //the next level down. NULL slots are holes, which read as zero.
+    void *root;
+    uint32_t height;
+
+    //Blocks below fill_blocks which are not in the tree yet still have to be
+    //fetched from fill, rather than reading as holes.
+    ramfs_fill_t fill;
+    void *fill_private;
+    uint32_t fill_blocks;
 } record_t;
 
 static cache_t *record_cache;
-static cache_t *chunk_cache;
-static cache_t *chunk_buff_cache;
 
-static chunk_t * chunk_alloc(record_t *r) {
-    chunk_t *c = cache_alloc(chunk_cache);
-    c->used = 0;
-    c->buff = cache_alloc(chunk_buff_cache);
+static inline uint32_t radix_capacity(uint32_t height) {
+    return 1 << (height * RADIX_SHIFT);
+}
 
-    //FIXME is this the right call?
-    list_add_before(&c->list, &r->chunks);
-    return c;
+static void ** node_alloc() {
+    return page_to_virt(alloc_page(ALLOC_ZERO));
 }
 
-//CONTRACT: if chunk_read and chunk_write return a size less than the size
-//passed to them, then immediately calling chunk_read/write with the remainder
-//must return zero (they return having filled/emptied the buffer as best they
-//could). This might become important if the data structure underlying chunks
-//is changed (and the get bigger).
-
-static ssize_t chunk_read(chunk_t *c, void *buff, size_t len, size_t off) {
-    BUG_ON(off > c->used);
-    len = MIN(c->used - off, len);
-    memcpy(buff, c->buff + off, len);
-    return len;
+static void node_free(void **node) {
+    free_page(virt_to_page(node));
 }
 
-//record_size is for bookkeeping of this record, and is updated when we expand
-static ssize_t chunk_write(chunk_t *c, size_t *record_size, const void *buff,
-    size_t len, size_t off) {
-    BUG_ON(off >= CHUNK_SIZE);
-    len = MIN(CHUNK_SIZE - off, len);
-    memcpy(c->buff + off, buff, len);
+//Free everything below slot, which is at the given level (0 for data pages).
+static void radix_free(void **slot, uint32_t level) {
+    if(!*slot) {
+        return;
+    }
 
-    uint32_t old_used = c->used;
-    c->used = MAX(c->used, off + len);
-    *record_size += c->used - old_used;
+    if(level) {
+        void **node = *slot;
+        for(uint32_t i = 0; i < RADIX_ENTRIES; i++) {
+            radix_free(&node[i], level - 1);
+        }
+        node_free(node);
+    } else {
+        free_page(*slot);
+    }
 
-    return len;
+    *slot = NULL;
 }
 
-static ssize_t record_read(file_t *file, void *buff, size_t len, size_t off) {
-    chunk_t *c = file->private; //current chunk
-    inode_t *inode = file->path.dentry->inode;
-    record_t *r = inode->private;
-    ssize_t amt = 0;
+//Free every block with index >= from below slot, which covers the blocks
+//starting at base.
+static void radix_trim(void **slot, uint32_t level, uint32_t base, uint32_t from) {
+    if(!*slot) {
+        return;
+    }
 
-    if(!c) {
-        return 0;
+    if(base >= from) {
+        radix_free(slot, level);
+        return;
     }
 
-    while(len - amt && c) {
-        amt += chunk_read(c, buff + amt, len - amt, (off + amt) % CHUNK_SIZE);
+    if(!level) {
+        return;
+    }
 
-        if(!(len - amt) || list_is_last(c, &r->chunks, list)) {
-            file->private = (off + amt) % CHUNK_SIZE ? c : list_next(c, &r->chunks, list);
+    void **node = *slot;
+    uint32_t child_span = radix_capacity(level - 1);
+    for(uint32_t i = 0; i < RADIX_ENTRIES; i++) {
+        uint32_t child_base = base + (i * child_span);
+        if(child_base + child_span > from) {
+            radix_trim(&node[i], level - 1, child_base, from);
         }
-        c = list_next(c, &r->chunks, list);
     }
-
-    file->offset += amt;
-    return amt;
 }
 
-static ssize_t record_write(file_t *file, const void *buff, size_t len, size_t off) {
-    chunk_t *c = file->private; //current chunk
-    inode_t *inode = file->path.dentry->inode;
-    record_t *r = inode->private;
-    ssize_t amt = 0;
+//Returns the page backing block idx, allocating it (and any index nodes on
+//the way) if create is set. Otherwise, holes return NULL.
+static page_t * record_get_block(record_t *r, uint32_t idx, bool create) {
+    //Blocks still held by the source are brought in just like new ones
+    bool fill = idx < r->fill_blocks;
+    create |= fill;
 
-    while(len - amt) {
-        if(!c) {
-            c = chunk_alloc(r);
+    if(idx >= radix_capacity(r->height)) {
+        if(!create) {
+            return NULL;
         }
 
-        amt += chunk_write(c, &inode->size, buff + amt, len - amt,
-            (off + amt) % CHUNK_SIZE);
+        while(idx >= radix_capacity(r->height)) {
+            BUG_ON(r->height >= RADIX_MAX_HEIGHT);
 
-        if(len - amt) {
-            if(c) {
-                c = list_next(c, &r->chunks, list);
+            if(r->root) {
+                void **node = node_alloc();
+                node[0] = r->root;
+                r->root = node;
             }
+            r->height++;
+        }
+    }
+
+    void **slot = &r->root;
+    for(uint32_t level = r->height; level; level--) {
+        if(!*slot) {
+            if(!create) {
+                return NULL;
+            }
+            *slot = node_alloc();
+        }
+
+        void **node = *slot;
+        slot = &node[(idx >> ((level - 1) * RADIX_SHIFT)) & RADIX_MASK];
+    }
+
+    if(!*slot && create) {
+        *slot = fill ? r->fill(r->fill_private, idx) : alloc_page(ALLOC_ZERO);
+    }
+
+    return *slot;
+}
+
+static void record_truncate(record_t *r, uint32_t old_size, uint32_t size) {
+    if(size >= old_size) {
+        return;
+    }
+
+    r->fill_blocks = MIN(r->fill_blocks, DIV_UP(size, BLOCK_SIZE));
+    radix_trim(&r->root, r->height, 0, DIV_UP(size, BLOCK_SIZE));
+
+    //Zero the tail of the last block, so that extending the file again reads
+    //back zeroes.
+    uint32_t tail = size % BLOCK_SIZE;
+    if(tail) {
+        page_t *page = record_get_block(r, size / BLOCK_SIZE, false);
+        if(page) {
+            memset(page_to_virt(page) + tail, 0, BLOCK_SIZE - tail);
+        }
+    }
+}
+
+static ssize_t record_read(record_t *r, uint32_t size, void *buff, size_t len,
+    uint32_t off) {
+    if(off >= size) {
+        return 0;
+    }
+
+    len = MIN(len, size - off);
+
+    size_t amt = 0;
+    while(amt < len) {
+        uint32_t pos = off + amt;
+        uint32_t boff = pos % BLOCK_SIZE;
+        uint32_t num = MIN(BLOCK_SIZE - boff, len - amt);
+
+        page_t *page = record_get_block(r, pos / BLOCK_SIZE, false);
+        if(page) {
+            memcpy(buff + amt, page_to_virt(page) + boff, num);
         } else {
-            file->private = (off + amt) % CHUNK_SIZE ? c : list_next(c, &r->chunks, list);
+            memset(buff + amt, 0, num);
         }
+
+        amt += num;
+    }
+
+    return amt;
+}
+
+static ssize_t record_write(record_t *r, const void *buff, size_t len,
+    uint32_t off) {
+    //Don't wrap the 32 bit file size
+    len = MIN(len, ~off);
+
+    size_t amt = 0;
+    while(amt < len) {
+        uint32_t pos = off + amt;
+        uint32_t boff = pos % BLOCK_SIZE;
+        uint32_t num = MIN(BLOCK_SIZE - boff, len - amt);
+
+        page_t *page = record_get_block(r, pos / BLOCK_SIZE, true);
+        memcpy(page_to_virt(page) + boff, buff + amt, num);
+
+        amt += num;
     }
 
-    file->offset += amt;
     return amt;
 }
 
 static record_t * record_create() {
     record_t *r = cache_alloc(record_cache);
-    list_init(&r->chunks);
+    semaphore_init(&r->lock, 1);
+    r->root = NULL;
+    r->height = 0;
+    r->fill = NULL;
+    r->fill_private = NULL;
+    r->fill_blocks = 0;
     return r;
 }
 
-//Note: inode->private stores a record_t *, while file->private stores a
-//chunk_t *.
-
-//XXX if we ever implement deletion/deallocation of chunks, we must be mindful
-//of other file_t *s storing pointers to chunks which we are deleting, or
-//rearranging.
+//Note: inode->private stores a record_t *, while file->private is unused. The
+//file position is kept in file->offset.
 
 static void ramfs_file_open(file_t *file, inode_t *inode) {
-    if(!(inode->flags & INODE_FLAG_DIRECTORY)) {
-        record_t *r = inode->private;
-        if(list_empty(&r->chunks)) {
-            file->private = NULL;
-        } else {
-            file->private = list_first(&r->chunks, chunk_t, list);
-        }
-    }
 }
 
 static void ramfs_file_close(file_t *file) {
 }
 
 static off_t ramfs_file_seek(file_t *file, off_t offset, int whence) {
-    if(!(whence == SEEK_SET)) {
-        panicf("ramfs - unimplemented whence value %d", whence);
-    }
-
     inode_t *inode = file->path.dentry->inode;
-    record_t *r = inode->private;
-    size_t pos = 0;
-
-    //FIXME only do a relative seek, instead of just starting over
-    chunk_t *c;
-    LIST_FOR_EACH_ENTRY(c, &r->chunks, list) {
-        if(offset - pos < CHUNK_SIZE) {
-            if(offset - pos > c->used) {
-                //FIXME allow seeking beyond end of file
-                panic("ramfs - seek beyond EOF");
-            }
 
-            file->private = c;
-            file->offset = offset;
-            return offset;
+    //Seeking past the end of the file is fine, writing there leaves a hole.
+    int64_t pos;
+    switch(whence) {
+        case SEEK_SET: {
+            pos = offset;
+            break;
         }
-        pos += CHUNK_SIZE;
+        case SEEK_CUR: {
+            pos = ((int64_t) file->offset) + ((int32_t) offset);
+            break;
+        }
+        case SEEK_END: {
+            pos = ((int64_t) inode->size) + ((int32_t) offset);
+            break;
+        }
+        default: {
+            return -EINVAL;
+        }
+    }
+
+    if(pos < 0 || pos > UINT32_MAX) {
+        return -EINVAL;
     }
 
-    //FIXME allow seeking beyond end of file
-    panic("ramfs - seek beyond EOF");
+    file->offset = pos;
+    return pos;
 }
 
 static ssize_t ramfs_file_read(file_t *file, char *buff, size_t bytes) {
-    return record_read(file, buff, bytes, file->offset);
+    inode_t *inode = file->path.dentry->inode;
+    record_t *r = inode->private;
+
+    semaphore_down(&r->lock);
+    ssize_t amt = record_read(r, inode->size, buff, bytes, file->offset);
+    file->offset += amt;
+    semaphore_up(&r->lock);
+
+    return amt;
 }
 
 static ssize_t ramfs_file_write(file_t *file, const char *buff, size_t bytes) {
-    return record_write(file, buff, bytes, file->offset);
+    inode_t *inode = file->path.dentry->inode;
+    record_t *r = inode->private;
+
+    semaphore_down(&r->lock);
+    ssize_t amt = record_write(r, buff, bytes, file->offset);
+    file->offset += amt;
+    inode->size = MAX(inode->size, file->offset);
+    semaphore_up(&r->lock);
+
+    return amt;
 }
 
 static int32_t ramfs_file_poll(file_t *file, fpoll_data_t *fp) {
@@ -194,18 +304,48 @@ static file_ops_t ramfs_file_ops = {
 
 static void ramfs_inode_lookup(inode_t *inode, dentry_t *dentry);
 static int32_t ramfs_inode_create(inode_t *inode, dentry_t *new, uint32_t mode);
+static int32_t ramfs_inode_truncate(inode_t *inode, uint32_t size);
 
 static inode_ops_t ramfs_inode_ops = {
     .file_ops = &ramfs_file_ops,
 
-    .lookup = ramfs_inode_lookup,
-    .create = ramfs_inode_create,
+    .lookup   = ramfs_inode_lookup,
+    .create   = ramfs_inode_create,
+    .truncate = ramfs_inode_truncate,
 };
 
 static void ramfs_inode_lookup(inode_t *inode, dentry_t *dentry) {
     dentry->inode = NULL;
 }
 
+static int32_t ramfs_inode_truncate(inode_t *inode, uint32_t size) {
+    record_t *r = inode->private;
+
+    semaphore_down(&r->lock);
+    record_truncate(r, inode->size, size);
+    inode->size = size;
+    semaphore_up(&r->lock);
+
+    return 0;
+}
+
+void ramfs_set_source(inode_t *inode, uint32_t size, ramfs_fill_t fill,
+    void *private) {
+    BUG_ON(inode->ops != &ramfs_inode_ops);
+    BUG_ON(!S_ISREG(inode->mode));
+
+    record_t *r = inode->private;
+
+    semaphore_down(&r->lock);
+    BUG_ON(inode->size || r->root);
+
+    r->fill = fill;
+    r->fill_private = private;
+    r->fill_blocks = DIV_UP(size, BLOCK_SIZE);
+    inode->size = size;
+    semaphore_up(&r->lock);
+}
+
 static int32_t ramfs_create_internal(fs_t *fs, dentry_t *new, uint32_t mode) {
     if(S_ISREG(mode)) {
         new->inode = inode_alloc(fs, &ramfs_inode_ops);
@@ -219,6 +359,11 @@ static int32_t ramfs_create_internal(fs_t *fs, dentry_t *new, uint32_t mode) {
         new->inode->flags = INODE_FLAG_DIRECTORY;
         new->inode->size = 1 << new->inode->blkshift;
         new->inode->private = NULL;
+    } else if(S_ISFIFO(mode)) {
+        new->inode = fifo_inode_alloc(fs);
+        new->inode->mode = mode;
+        new->inode->flags = 0;
+        new->inode->size = 0;
     } else {
         return -EINVAL;
     }
@@ -234,7 +379,7 @@ static int32_t ramfs_create_internal(fs_t *fs, dentry_t *new, uint32_t mode) {
     new->inode->mtime = 0;
     new->inode->ctime = 0;
 
-    new->inode->blkshift = 12;
+    new->inode->blkshift = BLOCK_SHIFT;
     new->inode->blocks = 8;
 
     return 0;
@@ -269,8 +414,6 @@ static dentry_t * ramfs_create(fs_type_t *type, const char *device) {
 
 static INITCALL ramfs_init() {
     record_cache = cache_create(sizeof(record_t));
-    chunk_cache = cache_create(sizeof(chunk_t));
-    chunk_buff_cache = cache_create(CHUNK_SIZE);
 
     register_fs_type(&ramfs);
 
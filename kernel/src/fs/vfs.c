@@ -9,12 +9,15 @@
 #include "bug/debug.h"
 #include "bug/panic.h"
 #include "sync/spinlock.h"
+#include "sync/seqlock.h"
+#include "sync/atomic.h"
 #include "mm/mm.h"
 #include "mm/cache.h"
 #include "sched/sched.h"
 #include "fs/fd.h"
 #include "fs/vfs.h"
 #include "log/log.h"
+#include "misc/stats.h"
 
 mount_t *root_mount;
 
@@ -32,25 +35,243 @@ static DEFINE_SPINLOCK(global_ino_lock);
 
 static DEFINE_HASHTABLE(mount_hashtable, log2(PAGE_SIZE / sizeof(hashtable_node_t)));
 static DEFINE_SPINLOCK(mount_hashtable_lock);
-
-dentry_t * dentry_alloc(const char *name) {
+static DEFINE_SEQCOUNT(mount_seq);
+
+//The dcache: every dentry with a parent is hashed on (parent, name) here.
+//dcache_lock serialises all changes to the table, the LRU and the children
+//lists, and dcache_seq is bumped around any change to the table, so that
+//path walks can read it without taking the lock.
+#define DCACHE_HASH_BITS 11
+
+//Keep at most one unused dentry per this many page frames (but at least
+//DCACHE_UNUSED_MIN), and when free memory drops below 1/DCACHE_PRESSURE_RATIO
+//of all pages shed DCACHE_SHRINK_BATCH more whenever the cache is touched.
+#define DCACHE_UNUSED_RATIO   8
+#define DCACHE_UNUSED_MIN     256
+#define DCACHE_PRESSURE_RATIO 16
+#define DCACHE_SHRINK_BATCH   8
+
+static DEFINE_HASHTABLE(dentry_hashtable, DCACHE_HASH_BITS);
+static DEFINE_SPINLOCK(dcache_lock);
+static DEFINE_SEQCOUNT(dcache_seq);
+
+//Unreferenced dentries, most recently added first
+static DEFINE_LIST(dcache_lru);
+static uint32_t dcache_max_unused;
+
+//A lockless walk may still be looking at a dentry after it has been freed.
+//This is fine, since the dentry cache never hands its pages back and the
+//walk is validated against dcache_seq before anything it found is used.
+//Freed dentries are left with no references, so that a racing walk can never
+//take one.
+
+//The dentry cache is type-stable, so a lockless walk may still be looking at
+//what new used to be, and will take a reference on it if refs is nonzero. refs
+//must therefore be set once, to its final value.
+static dentry_t * __dentry_alloc(const char *name, uint32_t refs) {
     dentry_t *new = cache_alloc(dentry_cache);
     new->name = name;
+    new->len = strlen(name);
+    new->hash = str_hash(name, new->len);
     new->inode = NULL;
     new->flags = 0;
+    new->referenced = false;
     new->parent = 0;
-    hashtable_init(new->children_tab);
     list_init(&new->children_list);
+    chain_init_node(&new->node);
+    list_init(&new->lru);
+
+    atomic_set(&new->refs, refs);
 
     return new;
 }
 
+dentry_t * dentry_alloc(const char *name) {
+    //This first reference belongs to the fs, see vfs.h
+    return __dentry_alloc(name, 1);
+}
+
 void dentry_free(dentry_t *dentry) {
+    atomic_set(&dentry->refs, 0);
     kfree((char *) dentry->name);
 
     cache_free(dentry_cache, dentry);
 }
 
+static inline uint32_t dentry_key(dentry_t *parent, uint32_t hash) {
+    return ((uint32_t) parent) + hash;
+}
+
+//Without dcache_lock, pass the sequence count the walk started at; the
+//search then gives up (returning NULL) as soon as the table changes.
+static dentry_t * dcache_find(dentry_t *parent, const char *name, uint32_t len,
+    uint32_t hash, const uint32_t *seq) {
+    dentry_t *dentry;
+    HASHTABLE_FOR_EACH_COLLISION(dentry_key(parent, hash), dentry, dentry_hashtable, node) {
+        if(seq && read_seqretry(&dcache_seq, *seq)) {
+            break;
+        }
+
+        if(dentry->parent == parent && dentry->hash == hash
+            && dentry->len == len && !memcmp(dentry->name, name, len)) {
+            return dentry;
+        }
+    }
+
+    return NULL;
+}
+
+//The following dcache_* and __dentry_* functions expect dcache_lock to be held
+
+static void __dentry_put(dentry_t *dentry);
+
+static void dcache_kill(dentry_t *dentry) {
+    BUG_ON(atomic_read(&dentry->refs));
+
+    if(!chain_unhashed(&dentry->node)) {
+        write_seqbegin(&dcache_seq);
+        hashtable_rm(&dentry->node);
+        write_seqend(&dcache_seq);
+    }
+
+    if(!list_empty(&dentry->lru)) {
+        list_rm(&dentry->lru);
+        dentries_unused--;
+    }
+
+    dentry_t *parent = dentry->parent;
+    dentry_free(dentry);
+
+    if(parent) {
+        __dentry_put(parent);
+    }
+}
+
+static void dcache_unhash(dentry_t *dentry) {
+    write_seqbegin(&dcache_seq);
+    hashtable_rm(&dentry->node);
+    write_seqend(&dcache_seq);
+
+    if(!atomic_read(&dentry->refs)) {
+        dcache_kill(dentry);
+    }
+}
+
+static void dcache_lru_add(dentry_t *dentry) {
+    list_add(&dentry->lru, &dcache_lru);
+    dentries_unused++;
+}
+
+//Outside of dcache_lock, references may only be taken and dropped while the
+//count stays above zero; reaching or leaving zero takes the lock, since that
+//moves the dentry on or off the LRU.
+
+static void __dentry_get(dentry_t *dentry) {
+    if(atomic_add_and_return(&dentry->refs, 1) == 1 && !list_empty(&dentry->lru)) {
+        list_rm(&dentry->lru);
+        list_init(&dentry->lru);
+        dentries_unused--;
+    }
+}
+
+static void __dentry_put(dentry_t *dentry) {
+    BUG_ON(!atomic_read(&dentry->refs));
+
+    if(atomic_add_and_return(&dentry->refs, -1)) {
+        return;
+    }
+
+    if(chain_unhashed(&dentry->node)) {
+        dcache_kill(dentry);
+    } else {
+        dcache_lru_add(dentry);
+    }
+}
+
+//Hash child under parent, replacing any stale entry of the same name (e.g. a
+//negative dentry for a file which has since been created).
+static void dcache_insert(dentry_t *child, dentry_t *parent) {
+    dentry_t *old = dcache_find(parent, child->name, child->len, child->hash, NULL);
+    if(old) {
+        dcache_unhash(old);
+    }
+
+    child->parent = parent;
+    __dentry_get(parent);
+
+    write_seqbegin(&dcache_seq);
+    hashtable_add(dentry_key(parent, child->hash), &child->node, dentry_hashtable);
+    write_seqend(&dcache_seq);
+
+    if(!atomic_read(&child->refs)) {
+        dcache_lru_add(child);
+    }
+}
+
+static inline bool memory_pressure() {
+    return pages_avaliable - pages_in_use < pages_avaliable / DCACHE_PRESSURE_RATIO;
+}
+
+static void dcache_trim() {
+    uint32_t target = dcache_max_unused;
+    if(memory_pressure()) {
+        target = dentries_unused - MIN(dentries_unused, DCACHE_SHRINK_BATCH);
+    }
+
+    while(dentries_unused > target) {
+        dentry_t *victim = list_entry(dcache_lru.prev, dentry_t, lru);
+        list_rm(&victim->lru);
+        list_init(&victim->lru);
+
+        //Walks only mark what they hit, so give those a second chance
+        if(victim->referenced) {
+            victim->referenced = false;
+            list_add(&victim->lru, &dcache_lru);
+            continue;
+        }
+
+        dentries_unused--;
+
+        //Killing the victim may release its parent onto the LRU too
+        dcache_kill(victim);
+    }
+}
+
+void dentry_get(dentry_t *dentry) {
+    if(atomic_add_unless(&dentry->refs, 1, 0)) {
+        return;
+    }
+
+    uint32_t flags;
+    spin_lock_irqsave(&dcache_lock, &flags);
+
+    __dentry_get(dentry);
+
+    spin_unlock_irqstore(&dcache_lock, flags);
+}
+
+void dentry_put(dentry_t *dentry) {
+    if(atomic_add_unless(&dentry->refs, -1, 1)) {
+        return;
+    }
+
+    uint32_t flags;
+    spin_lock_irqsave(&dcache_lock, &flags);
+
+    __dentry_put(dentry);
+    dcache_trim();
+
+    spin_unlock_irqstore(&dcache_lock, flags);
+}
+
+void path_get(path_t *path) {
+    dentry_get(path->dentry);
+}
+
+void path_put(path_t *path) {
+    dentry_put(path->dentry);
+}
+
 inode_t * inode_alloc(fs_t *fs, inode_ops_t *ops) {
     inode_t *new = cache_alloc(inode_cache);
     memset(new, 0, sizeof(inode_t));
@@ -69,6 +290,9 @@ inode_t * inode_alloc(fs_t *fs, inode_ops_t *ops) {
 file_t * file_alloc(file_ops_t *ops) {
     file_t *new = gfdt_obtain();
     if(new) {
+        new->path.mount = NULL;
+        new->path.dentry = NULL;
+        new->flags = 0;
         new->offset = 0;
         new->ops = ops;
     }
@@ -96,8 +320,13 @@ void dentry_activate(dentry_t *child, dentry_t *parent) {
     child->parent = parent;
 
     if(parent) {
-        hashtable_add(str_to_key(child->name, strlen(child->name)), &child->node, parent->children_tab);
+        uint32_t flags;
+        spin_lock_irqsave(&dcache_lock, &flags);
+
+        dcache_insert(child, parent);
         list_add(&child->list, &parent->children_list);
+
+        spin_unlock_irqstore(&dcache_lock, flags);
     }
 }
 
@@ -135,21 +364,28 @@ static uint32_t hash_mount(mount_t *mount, dentry_t *mountpoint) {
     return ((uint32_t) mount) * ((uint32_t) mountpoint);
 }
 
+//Mounts are never freed, so the table can be searched without
+//mount_hashtable_lock, retrying if it changed meanwhile.
 static mount_t * get_mount(path_t *mountpoint) {
-    uint32_t flags;
-    spin_lock_irqsave(&mount_hashtable_lock, &flags);
-
     mount_t *mount;
+    uint32_t seq;
+
+get_mount_retry:
+    seq = read_seqbegin(&mount_seq);
+
     HASHTABLE_FOR_EACH_COLLISION(hash_mount(mountpoint->mount, mountpoint->dentry), mount, mount_hashtable, node) {
+        if(read_seqretry(&mount_seq, seq)) {
+            goto get_mount_retry;
+        }
+
         if(mount->parent == mountpoint->mount && mount->mountpoint == mountpoint->dentry) {
-            goto get_mount_out;
+            break;
         }
     }
 
-    mount = NULL;
-
-get_mount_out:
-    spin_unlock_irqstore(&mount_hashtable_lock, flags);
+    if(read_seqretry(&mount_seq, seq)) {
+        goto get_mount_retry;
+    }
 
     return mount;
 }
@@ -207,11 +443,14 @@ bool vfs_mount_add(mount_t *mount, path_t *mountpoint) {
 
     mount->parent = mountpoint->mount;
     mount->mountpoint = mountpoint->dentry;
+    dentry_get(mount->mountpoint);
 
     uint32_t flags;
     spin_lock_irqsave(&mount_hashtable_lock, &flags);
 
+    write_seqbegin(&mount_seq);
     hashtable_add(hash_mount(mount->parent, mount->mountpoint), &mount->node, mount_hashtable);
+    write_seqend(&mount_seq);
 
     spin_unlock_irqstore(&mount_hashtable_lock, flags);
 
@@ -236,10 +475,14 @@ bool vfs_umount(path_t *mountpoint) {
         uint32_t flags;
         spin_lock_irqsave(&mount_hashtable_lock, &flags);
 
+        write_seqbegin(&mount_seq);
         hashtable_rm(&mount->node);
+        write_seqend(&mount_seq);
 
         spin_unlock_irqstore(&mount_hashtable_lock, flags);
 
+        dentry_put(mount->mountpoint);
+
         return true;
     } else {
         //TODO check if this is the dentry for a device somehow
@@ -275,6 +518,7 @@ static int32_t get_path_wd(const path_t *start, const char *orig_pathname, path_
         *wd = path;
     } else {
         *wd = *start;
+        path_get(wd);
     }
 
     *out_last = strdup(last);
@@ -299,170 +543,227 @@ int32_t vfs_create(const path_t *start, const char *pathname, uint32_t mode,
 
     path_t wd;
     char *last;
-    if((ret = get_path_wd(start, pathname, &wd, &last))) {
-        return ret;
-    }
     if(strlen(pathname) == 0) {
         return -ENOENT;
     }
+    if((ret = get_path_wd(start, pathname, &wd, &last))) {
+        return ret;
+    }
 
     path_t f;
     ret = vfs_lookup(&wd, last, &f);
     if(!ret) {
         ret = -EEXIST;
         if(path) *path = f;
+        else path_put(&f);
 
-        //otherwise, do nothing?
+        kfree(last);
     } else if(ret == -ENOENT) {
         dentry_t *new = dentry_alloc(last);
         ret = wd.dentry->inode->ops->create(wd.dentry->inode, new, mode);
         if(ret < 0)  {
-            //FIXME dealloc new
-            goto create_fail;
+            dentry_free(new);
+            goto create_out;
         }
 
         validate_inode(new);
+        //This also replaces the negative dentry left by the lookup above
         dentry_activate(new, wd.dentry);
         if(path) {
+            dentry_get(new);
             path->dentry = new;
             path->mount = wd.mount;
         }
+    } else {
+        kfree(last);
     }
 
-    return ret;
-
-create_fail:
-    kfree(last);
+create_out:
+    path_put(&wd);
     return ret;
 }
 
-int32_t vfs_lookup(const path_t *start, const char *orig_path, path_t *out) {
-    char *path = strdup(orig_path);
-    char *new_path = path;
-
-    path_t cwd;
-
-    if(*path != DIRECTORY_SEPARATOR && start) {
-        cwd = *start;
-    } else {
-        if(*path == DIRECTORY_SEPARATOR) {
-            path++;
-        }
-
-        cwd = MNT_ROOT(root_mount);
+//Walk path from cwd, leaving the result in cwd. With locked set, the caller
+//holds dcache_lock (and flags are its saved interrupt flags), and misses are
+//resolved by asking the fs. Otherwise, the walk only reads the dcache, and
+//gives up with -EAGAIN on a miss or if the table changes under it (the
+//caller must still validate the result against seq). Without the lock, each
+//dentry found is only looked at once the walk has been checked against seq,
+//and nothing is ever written to one.
+static int32_t path_walk(path_t *cwd, const char *path, bool locked,
+    uint32_t *flags, uint32_t seq) {
+    if(*path == DIRECTORY_SEPARATOR) {
+        path++;
     }
 
-    bool finished = false;
-    while(!finished && *path && cwd.dentry) {
-        char *next = path;
-
-        BUG_ON(!cwd.dentry->inode);
+    while(true) {
+        if(!locked && read_seqretry(&dcache_seq, seq)) {
+            return -EAGAIN;
+        }
 
-        if(!(cwd.dentry->inode->flags & INODE_FLAG_DIRECTORY)) {
-            cwd.dentry = NULL;
-            break;
+        //A racing unlink may have left cwd negative
+        inode_t *inode = ACCESS_ONCE(cwd->dentry->inode);
+        if(!inode) {
+            return locked ? -ENOENT : -EAGAIN;
         }
 
-        //If cwd.dentry points to a mountpoint then decend it
-        if(cwd.dentry->inode->flags & INODE_FLAG_MOUNTPOINT) {
-            mount_t *submount = get_mount(&cwd);
+        //If cwd points to a mountpoint then decend it
+        if(inode->flags & INODE_FLAG_MOUNTPOINT) {
+            mount_t *submount = get_mount(cwd);
             BUG_ON(!submount);
-            cwd = MNT_ROOT(submount);
-
-            goto lookup_next;
+            *cwd = MNT_ROOT(submount);
+            continue;
         }
 
-        //determine the name of the next working directory
-        uint32_t len = 0;
-        while(*next != DIRECTORY_SEPARATOR && *next) {
-            next++;
-            len++;
+        //skip any pointless "//" in the path
+        while(*path == DIRECTORY_SEPARATOR) {
+            path++;
         }
 
-        //have we reached the last path segment?
-        if(!*next) {
-            finished = true;
+        if(!*path) {
+            return 0;
         }
 
-        *next++ = '\0';
+        if(!(inode->flags & INODE_FLAG_DIRECTORY)) {
+            return -ENOENT;
+        }
 
-        //was there a pointless "//" in the path? skip it
-        if(!len) {
-            goto lookup_next;
+        //measure and hash the next path segment in place
+        const char *name = path;
+        uint32_t hash = STR_HASH_INIT;
+        while(*path && *path != DIRECTORY_SEPARATOR) {
+            hash = str_hash_step(hash, *path);
+            path++;
         }
+        uint32_t len = path - name;
 
         //if the current path segment == "." skip it
         //if the current path semgent == ".." go up the tree
-        if(path[0] == '.') switch(len) {
-            case 1: {
-                goto lookup_next;
+        if(name[0] == '.') {
+            if(len == 1) {
+                continue;
             }
-            case 2: {
-                if(path[1] == '.') {
-                    while(!cwd.dentry->parent && cwd.mount != root_mount) {
-                        BUG_ON(!cwd.mount->parent);
-                        cwd.dentry = cwd.mount->mountpoint;
-                        cwd.mount = cwd.mount->parent;
-
-                        BUG_ON(!(cwd.dentry->inode->flags & INODE_FLAG_MOUNTPOINT));
-                    }
-
-                    if(cwd.dentry->parent) {
-                        cwd.dentry = cwd.dentry->parent;
-                    } else {
-                        //do nothing if we are at the root
-                    }
-
-                    goto lookup_next;
+
+            if(len == 2 && name[1] == '.') {
+                while(!cwd->dentry->parent && cwd->mount != root_mount) {
+                    BUG_ON(!cwd->mount->parent);
+                    cwd->dentry = cwd->mount->mountpoint;
+                    cwd->mount = cwd->mount->parent;
+
+                    BUG_ON(!(cwd->dentry->inode->flags & INODE_FLAG_MOUNTPOINT));
+                }
+
+                if(cwd->dentry->parent) {
+                    cwd->dentry = cwd->dentry->parent;
+                } else {
+                    //do nothing if we are at the root
                 }
+
+                continue;
             }
         }
 
-        //have we cached this child?
-        dentry_t *child;
-        HASHTABLE_FOR_EACH_COLLISION(str_to_key(path, len), child, cwd.dentry->children_tab, node) {
-            if(!memcmp(child->name, path, len)) {
-                cwd.dentry = child;
-                goto lookup_next;
+        //have we cached this child (or its absence)?
+        dentry_t *child = dcache_find(cwd->dentry, name, len, hash, locked ? NULL : &seq);
+        if(!locked && (!child || read_seqretry(&dcache_seq, seq))) {
+            return -EAGAIN;
+        }
+
+        if(!child) {
+            //request the fs driver resolves the path segment into a new
+            //dentry, holding onto the directory while the lock is dropped
+            dentry_t *dir = cwd->dentry;
+            __dentry_get(dir);
+            spin_unlock_irqstore(&dcache_lock, *flags);
+
+            char *new_name = kmalloc(len + 1);
+            memcpy(new_name, name, len);
+            new_name[len] = '\0';
+
+            //lookup dentries hold no fs reference, so that they can be
+            //reclaimed once unused
+            dentry_t *new = __dentry_alloc(new_name, 0);
+            dir->inode->ops->lookup(dir->inode, new);
+
+            spin_lock_irqsave(&dcache_lock, flags);
+
+            //someone else may have beaten us to it
+            child = dcache_find(dir, name, len, hash, NULL);
+            if(child) {
+                dentry_free(new);
+            } else {
+                child = new;
+                dcache_insert(child, dir);
             }
+
+            __dentry_put(dir);
         }
 
-        //request the fs driver resolves the path segment into a new dentry
-        child = dentry_alloc(strdup(path));
-        cwd.dentry->inode->ops->lookup(cwd.dentry->inode, child);
+        //Only under the lock, as child may already be free otherwise. Lockless
+        //walks mark just the dentry they end up taking a reference on.
+        if(locked && !child->referenced) {
+            child->referenced = true;
+        }
 
         //does the requested path segment resolve?
         if(!child->inode) {
-            dentry_free(child);
-            cwd.dentry = NULL;
-            break;
+            return -ENOENT;
         }
 
-        cwd.dentry = child;
+        cwd->dentry = child;
+    }
+}
 
-lookup_next:
-        path = next;
+int32_t vfs_lookup(const path_t *start, const char *path, path_t *out) {
+    path_t cwd;
+    if(*path != DIRECTORY_SEPARATOR && start) {
+        cwd = *start;
+    } else {
+        cwd = MNT_ROOT(root_mount);
     }
 
-    if(cwd.dentry) {
-        if(cwd.dentry->inode->flags & INODE_FLAG_MOUNTPOINT) {
-            mount_t *submount = get_mount(&cwd);
-            BUG_ON(!submount);
-            cwd = MNT_ROOT(submount);
+    //First try walking the dcache without any locks. This works whenever
+    //every segment is cached and nobody changes the dcache meanwhile.
+    path_t fast = cwd;
+    uint32_t seq = read_seqbegin(&dcache_seq);
+    int32_t ret = path_walk(&fast, path, false, NULL, seq);
+    if(ret == -ENOENT && !read_seqretry(&dcache_seq, seq)) {
+        return ret;
+    } else if(!ret && atomic_add_unless(&fast.dentry->refs, 1, 0)) {
+        if(!read_seqretry(&dcache_seq, seq)) {
+            if(!fast.dentry->referenced) {
+                fast.dentry->referenced = true;
+            }
+
+            *out = fast;
+            return 0;
         }
 
+        dentry_put(fast.dentry);
+    }
+
+    uint32_t flags;
+    spin_lock_irqsave(&dcache_lock, &flags);
+
+    ret = path_walk(&cwd, path, true, &flags, 0);
+    if(!ret) {
+        __dentry_get(cwd.dentry);
         *out = cwd;
     }
 
-    kfree(new_path);
+    dcache_trim();
 
-    return cwd.dentry ? 0 : -ENOENT;
+    spin_unlock_irqstore(&dcache_lock, flags);
+
+    return ret;
 }
 
-file_t * vfs_open_file(path_t *path) {
+file_t * vfs_open_file(path_t *path, uint32_t flags) {
     file_t *file = file_alloc(path->dentry->inode->ops->file_ops);
     if(file) {
+        path_get(path);
         file->path = *path;
+        file->flags = flags;
         file->ops->open(file, path->dentry->inode);
     }
 
@@ -474,19 +775,34 @@ int32_t vfs_close_file(file_t *file) {
     return 0;
 }
 
+int32_t vfs_truncate(path_t *path, uint32_t size) {
+    inode_t *inode = path->dentry->inode;
+    if(inode->flags & INODE_FLAG_DIRECTORY) {
+        return -EISDIR;
+    }
+    if(!inode->ops->truncate) {
+        return -EINVAL;
+    }
+    return inode->ops->truncate(inode, size);
+}
+
 off_t vfs_seek(file_t *file, uint32_t off, int whence) {
     return file->ops->seek(file, off, whence);
 }
 
 ssize_t vfs_read(file_t *file, void *buff, size_t bytes) {
-    if(file->path.dentry->inode->flags & INODE_FLAG_DIRECTORY) {
+    //Pipes and sockets have no path
+    if(file->path.dentry
+        && (file->path.dentry->inode->flags & INODE_FLAG_DIRECTORY)) {
         return -EISDIR;
     }
     return file->ops->read(file, buff, bytes);
 }
 
 ssize_t vfs_write(file_t *file, const void *buff, size_t bytes) {
-    if(file->path.dentry->inode->flags & INODE_FLAG_DIRECTORY) {
+    //Pipes and sockets have no path
+    if(file->path.dentry
+        && (file->path.dentry->inode->flags & INODE_FLAG_DIRECTORY)) {
         return -EISDIR;
     }
     return file->ops->write(file, buff, bytes);
@@ -495,6 +811,10 @@ ssize_t vfs_write(file_t *file, const void *buff, size_t bytes) {
 uint32_t simple_file_iterate(file_t *file, dir_entry_dat_t *buff, uint32_t num) {
     uint32_t curpos = 0;
     uint32_t num_read = 0;
+
+    uint32_t flags;
+    spin_lock_irqsave(&dcache_lock, &flags);
+
     dentry_t *child;
     LIST_FOR_EACH_ENTRY(child, &file->path.dentry->children_list, list) {
         if(num_read >= num) {
@@ -512,6 +832,8 @@ uint32_t simple_file_iterate(file_t *file, dir_entry_dat_t *buff, uint32_t num)
         curpos++;
     }
 
+    spin_unlock_irqstore(&dcache_lock, flags);
+
     file->offset = curpos;
     return num_read;
 }
@@ -584,6 +906,8 @@ static INITCALL vfs_init() {
     fs_cache = cache_create(sizeof(fs_t));
     mount_cache = cache_create(sizeof(mount_t));
 
+    dcache_max_unused = MAX(page_frames / DCACHE_UNUSED_RATIO, DCACHE_UNUSED_MIN);
+
     return 0;
 }
 
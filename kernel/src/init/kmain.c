@@ -17,6 +17,7 @@
 #include "fs/vfs.h"
 #include "fs/exec.h"
 #include "fs/type/devfs.h"
+#include "misc/bench.h"
 #include "driver/console/console.h"
 #include "driver/console/tty.h"
 
@@ -47,6 +48,7 @@ static bool try_load_init(char *path) {
     int32_t ret = vfs_lookup(NULL, path, &out);
     if(!ret) {
         execute_path(&out, argv, ENVP);
+        path_put(&out);
     }
 
     return false;
@@ -58,6 +60,8 @@ static void umain() {
     ktaskd_init();
     kprintf("init - ktaskd created");
 
+    bench_run();
+
     path_t out;
     int32_t ret = devfs_lookup(TTY_NAME, &out);
     if(ret) {
@@ -68,7 +72,8 @@ static void umain() {
         vlog_disable();
     }
 
-    file_t *tty_file = vfs_open_file(&out);
+    file_t *tty_file = vfs_open_file(&out, O_RDWR);
+    path_put(&out);
     ufdt_add(tty_file);
     ufdt_add(tty_file);
     ufdt_add(tty_file);
@@ -0,0 +1,80 @@
+#include "common/types.h"
+#include "lib/string.h"
+#include "lib/lz4.h"
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_RUN_MASK  0xF
+
+//Lengths of 15 or more continue in the following bytes, each adding up to 255.
+static bool read_length(const uint8_t **ip, const uint8_t *iend, uint32_t *len) {
+    if(*len != LZ4_RUN_MASK) {
+        return true;
+    }
+
+    uint8_t b;
+    do {
+        if(*ip >= iend) {
+            return false;
+        }
+
+        b = *(*ip)++;
+        *len += b;
+    } while(b == 0xFF);
+
+    return true;
+}
+
+int32_t lz4_decompress(const void *src, uint32_t src_len, void *dst,
+    uint32_t dst_len) {
+    const uint8_t *ip = src;
+    const uint8_t *iend = ip + src_len;
+    uint8_t *op = dst;
+    uint8_t *oend = op + dst_len;
+
+    while(ip < iend) {
+        uint8_t token = *ip++;
+
+        uint32_t len = token >> 4;
+        if(!read_length(&ip, iend, &len)
+            || len > (uint32_t) (iend - ip) || len > (uint32_t) (oend - op)) {
+            return -1;
+        }
+
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+
+        //The last sequence is literals only
+        if(ip == iend) {
+            break;
+        }
+
+        if(iend - ip < 2) {
+            return -1;
+        }
+
+        uint32_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(!offset || offset > (uint32_t) (op - (uint8_t *) dst)) {
+            return -1;
+        }
+
+        len = token & LZ4_RUN_MASK;
+        if(!read_length(&ip, iend, &len)) {
+            return -1;
+        }
+
+        len += LZ4_MIN_MATCH;
+        if(len > (uint32_t) (oend - op)) {
+            return -1;
+        }
+
+        //Matches may overlap the bytes they produce, so copy forwards bytewise
+        const uint8_t *match = op - offset;
+        while(len--) {
+            *op++ = *match++;
+        }
+    }
+
+    return op - (uint8_t *) dst;
+}
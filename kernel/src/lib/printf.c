@@ -49,6 +49,9 @@
 
 #define is_digit(c) ((c) >= '0' && (c) <= '9')
 
+// Store a character if there is room for it, but count it regardless
+#define PUT(c) do { char __c = (c); if (str < end) *str = __c; str++; } while (0)
+
 static char *digits = "0123456789abcdefghijklmnopqrstuvwxyz";
 static char *upper_digits = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
 
@@ -64,7 +67,7 @@ static int skip_atoi(const char **s) {
   return i;
 }
 
-static char *number(char *str, long num, int base, int size, int precision, int type) {
+static char *number(char *str, char *end, long num, int base, int size, int precision, int type) {
   char c, sign, tmp[66];
   char *dig = digits;
   int i;
@@ -110,27 +113,27 @@ static char *number(char *str, long num, int base, int size, int precision, int
 
   if (i > precision) precision = i;
   size -= precision;
-  if (!(type & (ZEROPAD | LEFT))) while (size-- > 0) *str++ = ' ';
-  if (sign) *str++ = sign;
+  if (!(type & (ZEROPAD | LEFT))) while (size-- > 0) PUT(' ');
+  if (sign) PUT(sign);
 
   if (type & SPECIAL) {
     if (base == 8) {
-      *str++ = '0';
+      PUT('0');
     } else if (base == 16) {
-      *str++ = '0';
-      *str++ = digits[33];
+      PUT('0');
+      PUT(digits[33]);
     }
   }
 
-  if (!(type & LEFT)) while (size-- > 0) *str++ = c;
-  while (i < precision--) *str++ = '0';
-  while (i-- > 0) *str++ = tmp[i];
-  while (size-- > 0) *str++ = ' ';
+  if (!(type & LEFT)) while (size-- > 0) PUT(c);
+  while (i < precision--) PUT('0');
+  while (i-- > 0) PUT(tmp[i]);
+  while (size-- > 0) PUT(' ');
 
   return str;
 }
 
-static char *eaddr(char *str, unsigned char *addr, int size, int type) {
+static char *eaddr(char *str, char *end, unsigned char *addr, int size, int type) {
   char tmp[24];
   char *dig = digits;
   int i, len;
@@ -143,14 +146,14 @@ static char *eaddr(char *str, unsigned char *addr, int size, int type) {
     tmp[len++] = dig[addr[i] & 0x0F];
   }
 
-  if (!(type & LEFT)) while (len < size--) *str++ = ' ';
-  for (i = 0; i < len; ++i) *str++ = tmp[i];
-  while (len < size--) *str++ = ' ';
+  if (!(type & LEFT)) while (len < size--) PUT(' ');
+  for (i = 0; i < len; ++i) PUT(tmp[i]);
+  while (len < size--) PUT(' ');
 
   return str;
 }
 
-static char *iaddr(char *str, unsigned char *addr, int size, int type) {
+static char *iaddr(char *str, char *end, unsigned char *addr, int size, int type) {
   char tmp[24];
   int i, n, len;
 
@@ -176,14 +179,15 @@ static char *iaddr(char *str, unsigned char *addr, int size, int type) {
     }
   }
 
-  if (!(type & LEFT)) while (len < size--) *str++ = ' ';
-  for (i = 0; i < len; ++i) *str++ = tmp[i];
-  while (len < size--) *str++ = ' ';
+  if (!(type & LEFT)) while (len < size--) PUT(' ');
+  for (i = 0; i < len; ++i) PUT(tmp[i]);
+  while (len < size--) PUT(' ');
 
   return str;
 }
 
-int vsprintf(char *buf, const char *fmt, va_list args) {
+int vsnprintf(char *buf, size_t size, const char *fmt, va_list args) {
+  char *end = buf + size;
   int len;
   unsigned long num;
   int i, base;
@@ -198,7 +202,7 @@ int vsprintf(char *buf, const char *fmt, va_list args) {
 
   for (str = buf; *fmt; fmt++) {
     if (*fmt != '%') {
-      *str++ = *fmt;
+      PUT(*fmt);
       continue;
     }
 
@@ -252,18 +256,18 @@ repeat:
 
     switch (*fmt) {
       case 'c':
-        if (!(flags & LEFT)) while (--field_width > 0) *str++ = ' ';
-        *str++ = (unsigned char) va_arg(args, int);
-        while (--field_width > 0) *str++ = ' ';
+        if (!(flags & LEFT)) while (--field_width > 0) PUT(' ');
+        PUT((unsigned char) va_arg(args, int));
+        while (--field_width > 0) PUT(' ');
         continue;
 
       case 's':
         s = va_arg(args, char *);
         if (!s) s = "<NULL>";
         len = strnlen(s, precision);
-        if (!(flags & LEFT)) while (len < field_width--) *str++ = ' ';
-        for (i = 0; i < len; ++i) *str++ = *s++;
-        while (len < field_width--) *str++ = ' ';
+        if (!(flags & LEFT)) while (len < field_width--) PUT(' ');
+        for (i = 0; i < len; ++i) PUT(*s++);
+        while (len < field_width--) PUT(' ');
         continue;
 
       case 'p':
@@ -271,7 +275,7 @@ repeat:
           field_width = 2 * sizeof(void *);
           flags |= ZEROPAD;
         }
-        str = number(str, (unsigned long) va_arg(args, void *), 16, field_width, precision, flags);
+        str = number(str, end, (unsigned long) va_arg(args, void *), 16, field_width, precision, flags);
         continue;
 
       case 'n':
@@ -289,9 +293,9 @@ repeat:
         FALLTHROUGH;
       case 'a':
         if (qualifier == 'l') {
-          str = eaddr(str, va_arg(args, unsigned char *), field_width, flags);
+          str = eaddr(str, end, va_arg(args, unsigned char *), field_width, flags);
         } else {
-          str = iaddr(str, va_arg(args, unsigned char *), field_width, flags);
+          str = iaddr(str, end, va_arg(args, unsigned char *), field_width, flags);
         }
         continue;
 
@@ -316,9 +320,9 @@ repeat:
         break;
 
       default:
-        if (*fmt != '%') *str++ = '%';
+        if (*fmt != '%') PUT('%');
         if (*fmt) {
-          *str++ = *fmt;
+          PUT(*fmt);
         } else {
           --fmt;
         }
@@ -339,13 +343,31 @@ repeat:
       num = va_arg(args, unsigned int);
     }
 
-    str = number(str, num, base, field_width, precision, flags);
+    str = number(str, end, num, base, field_width, precision, flags);
   }
 
-  *str = '\0';
+  if (size) {
+    *(str < end ? str : end - 1) = '\0';
+  }
   return str - buf;
 }
 
+int vsprintf(char *buf, const char *fmt, va_list args) {
+  // Unbounded, as far as the end of the address space
+  return vsnprintf(buf, ((size_t) -1) - (size_t) buf, fmt, args);
+}
+
+int snprintf(char *buf, size_t size, const char *fmt, ...) {
+  va_list args;
+  int n;
+
+  va_start(args, fmt);
+  n = vsnprintf(buf, size, fmt, args);
+  va_end(args);
+
+  return n;
+}
+
 int sprintf(char *buf, const char *fmt, ...) {
   va_list args;
   int n;
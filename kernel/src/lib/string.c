@@ -1,5 +1,8 @@
 #include "lib/string.h"
+#include "common/asm.h"
+#include "init/initcall.h"
 #include "mm/mm.h"
+#include "log/log.h"
 
 int isdigit(int c) {
     return c >= '0' && c <= '9';
@@ -91,46 +94,97 @@ char * strdup(const char *orig) {
     return new;
 }
 
+//Below this size the setup cost of the aligned rep paths isn't worth it.
+#define REP_THRESHOLD 16
+
+//Set at boot if the CPU supports SSE2 (movnti/sfence).
+static bool has_sse2;
+
+static inline void rep_movsb(void **d, const void **s, size_t n) {
+    asm volatile("rep movsb" : "+D"(*d), "+S"(*s), "+c"(n) :: "memory");
+}
+
+static inline void rep_movsl(void **d, const void **s, size_t n) {
+    asm volatile("rep movsl" : "+D"(*d), "+S"(*s), "+c"(n) :: "memory");
+}
+
+static inline void rep_stosb(void **d, uint32_t v, size_t n) {
+    asm volatile("rep stosb" : "+D"(*d), "+c"(n) : "a"(v) : "memory");
+}
+
+static inline void rep_stosl(void **d, uint32_t v, size_t n) {
+    asm volatile("rep stosl" : "+D"(*d), "+c"(n) : "a"(v) : "memory");
+}
+
 void * memset(void *ptr, int c, size_t bytes) {
-    char *p = (char *) ptr;
-    size_t i;
-    for(i = 0; i < bytes; i++) {
-        p[i] = c;
+    void *d = ptr;
+    uint32_t v = ((uint8_t) c) * 0x01010101;
+
+    if(bytes >= REP_THRESHOLD) {
+        size_t head = -((uint32_t) d) & 3;
+        rep_stosb(&d, v, head);
+        bytes -= head;
+
+        rep_stosl(&d, v, bytes / 4);
+        bytes &= 3;
     }
+    rep_stosb(&d, v, bytes);
+
     return ptr;
 }
 
 void * memcpy(void *dest, const void *source, size_t bytes) {
-    char *d = (char *) dest;
-    const char *s = (const void *) source;
-    size_t i;
-    for(i = 0; i < bytes; i++) {
-        d[i] = s[i];
+    void *d = dest;
+    const void *s = source;
+
+    if(bytes >= REP_THRESHOLD) {
+        //Align the destination, misaligned loads are cheaper than stores
+        size_t head = -((uint32_t) d) & 3;
+        rep_movsb(&d, &s, head);
+        bytes -= head;
+
+        rep_movsl(&d, &s, bytes / 4);
+        bytes &= 3;
     }
+    rep_movsb(&d, &s, bytes);
+
     return dest;
 }
 
 void * memmove(void *dest, const void *source, size_t bytes) {
-    char *d = (char *) dest;
-    const char *s = (const void *) source;
-    size_t i;
-    if(d < s) {
-        for(i = 0; i < bytes; i++) {
-             d[i] = s[i];
-        }
-    } else {
-        for(i = bytes; i > 0; i--) {
-             d[i - 1] = s[i - 1];
-        }
+    //A forward copy is safe unless dest overlaps the tail of source
+    if(dest <= source || dest >= source + bytes) {
+        return memcpy(dest, source, bytes);
     }
+
+    //Copy backwards with DF set, tail bytes first and then whole words.
+    //isr_common clears DF, so being interrupted in here is fine.
+    void *d = dest + bytes - 1;
+    const void *s = source + bytes - 1;
+    size_t tail = bytes & 3;
+
+    asm volatile("std");
+    rep_movsb(&d, &s, tail);
+    d -= 3;
+    s -= 3;
+    rep_movsl(&d, &s, bytes / 4);
+    asm volatile("cld");
+
     return dest;
 }
 
 int memcmp(const void *a, const void *b, size_t bytes) {
-    const char *ca = (const char *) a;
-    const char *cb = (const char *) b;
-    size_t i;
-    for(i = 0; i < bytes; i++) {
+    const uint8_t *ca = (const uint8_t *) a;
+    const uint8_t *cb = (const uint8_t *) b;
+
+    //Skip over equal words, the byte loop below finds the difference
+    while(bytes >= 4 && *((const uint32_t *) ca) == *((const uint32_t *) cb)) {
+        ca += 4;
+        cb += 4;
+        bytes -= 4;
+    }
+
+    for(size_t i = 0; i < bytes; i++) {
         if(ca[i] != cb[i]) {
              return ca[i] - cb[i];
         }
@@ -138,6 +192,52 @@ int memcmp(const void *a, const void *b, size_t bytes) {
     return 0;
 }
 
+//Non-temporal stores bypass the cache, so a page copy or clear doesn't
+//evict the working set. movnti only needs SSE2 and uses the general
+//purpose registers, so there's no FPU/XMM state to save.
+static void copy_page_nt(void *dest, const void *source) {
+    uint32_t *d = dest;
+    const uint32_t *s = source;
+    for(uint32_t i = 0; i < PAGE_SIZE / sizeof(uint32_t); i += 4) {
+        uint32_t a = s[i], b = s[i + 1], c = s[i + 2], e = s[i + 3];
+        asm volatile("movnti %1, %0" : "=m"(d[i]) : "r"(a));
+        asm volatile("movnti %1, %0" : "=m"(d[i + 1]) : "r"(b));
+        asm volatile("movnti %1, %0" : "=m"(d[i + 2]) : "r"(c));
+        asm volatile("movnti %1, %0" : "=m"(d[i + 3]) : "r"(e));
+    }
+    asm volatile("sfence" ::: "memory");
+}
+
+static void clear_page_nt(void *page) {
+    uint32_t *d = page;
+    for(uint32_t i = 0; i < PAGE_SIZE / sizeof(uint32_t); i += 4) {
+        asm volatile("movnti %1, %0" : "=m"(d[i]) : "r"(0));
+        asm volatile("movnti %1, %0" : "=m"(d[i + 1]) : "r"(0));
+        asm volatile("movnti %1, %0" : "=m"(d[i + 2]) : "r"(0));
+        asm volatile("movnti %1, %0" : "=m"(d[i + 3]) : "r"(0));
+    }
+    asm volatile("sfence" ::: "memory");
+}
+
+void copy_page(void *dest, const void *source) {
+    if(has_sse2) {
+        copy_page_nt(dest, source);
+    } else {
+        void *d = dest;
+        const void *s = source;
+        rep_movsl(&d, &s, PAGE_SIZE / sizeof(uint32_t));
+    }
+}
+
+void clear_page(void *page) {
+    if(has_sse2) {
+        clear_page_nt(page);
+    } else {
+        void *d = page;
+        rep_stosl(&d, 0, PAGE_SIZE / sizeof(uint32_t));
+    }
+}
+
 void * memchr(void *ptr, int value, size_t bytes) {
     size_t i;
     uint8_t* p = (uint8_t*) ptr;
@@ -179,3 +279,17 @@ char ** copy_strtab(char *const raw[]) {
 
     return copy;
 }
+
+static INITCALL string_init() {
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+
+    //EDX bit 26: SSE2
+    has_sse2 = !!(d & (1 << 26));
+
+    kprintf("string - page ops using %s", has_sse2 ? "movnti" : "rep stos/movs");
+
+    return 0;
+}
+
+early_initcall(string_init);
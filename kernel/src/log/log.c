@@ -1,23 +1,87 @@
 #include "lib/string.h"
 #include "lib/printf.h"
 #include "common/compiler.h"
+#include "common/asm.h"
 #include "bug/panic.h"
+#include "init/initcall.h"
 #include "sync/spinlock.h"
+#include "sync/atomic.h"
 #include "arch/cpu.h"
+#include "arch/proc.h"
+#include "arch/tsc.h"
+#include "mm/mm.h"
+#include "sched/proc.h"
+#include "sched/sched.h"
+#include "sched/ktaskd.h"
 #include "time/clock.h"
+#include "time/timer.h"
+#include "fs/char.h"
 #include "driver/console/console.h"
+#include "log/log.h"
 
-#define LOG_BUFF_SIZE 32768
-#define TIME_BUFF_SIZE 64
-#define LINE_BUFF_SIZE 1024
+//Every CPU appends records to its own ring, with interrupts off and without
+//taking any locks. Readers (klogd and /dev/kmsg) merge the rings by sequence
+//number, and detect records overwritten under them by rechecking seq.
+#define LOG_RING_ENTRIES 128
+#define LOG_ENTRY_TEXT   236
+#define LINE_BUFF_SIZE   1024
+#define TIME_BUFF_SIZE   64
 
-static uint32_t front;
-static char log_buff[LOG_BUFF_SIZE];
-static DEFINE_SPINLOCK(log_lock);
+//How often klogd looks for new records
+#define LOG_DRAIN_INTERVAL 10
 
-static char timestamp_buff[TIME_BUFF_SIZE];
-static char line_buff[LINE_BUFF_SIZE];
-static DEFINE_SPINLOCK(line_buff_lock);
+//How many times a reader rescans for a record which has been numbered but
+//not yet published, before assuming it was overwritten
+#define LOG_INFLIGHT_RETRIES 64
+
+//Shown after the text of a record which didn't fit
+#define LOG_TRUNCATED_MARK " [truncated]"
+
+#define LOG_FLAG_TRUNCATED (1 << 0)
+
+typedef struct log_entry {
+    //Zero while the entry is being written
+    volatile uint32_t seq;
+    uint16_t cpu;
+    uint16_t flags;
+    uint64_t tsc;
+    uint32_t len;
+    char text[LOG_ENTRY_TEXT];
+} log_entry_t;
+
+typedef struct log_ring {
+    struct log_ring *next;
+    uint32_t cpu;
+
+    uint32_t head;
+    //Set while this CPU is writing, so that an NMI can't clobber the record
+    bool writing;
+
+    //Records overwritten before they reached the console, and how many of
+    //those have been owned up to (under console_lock)
+    uint32_t dropped;
+    uint32_t dropped_seen;
+
+    char line[LINE_BUFF_SIZE];
+    log_entry_t entries[LOG_RING_ENTRIES];
+} log_ring_t;
+
+DEFINE_PER_CPU(log_ring_t *, log_ring);
+
+//Used by every CPU until the per-cpu rings are usable
+static log_ring_t early_ring;
+static DEFINE_SPINLOCK(early_lock);
+static log_ring_t bsp_ring;
+
+static log_ring_t *rings = &early_ring;
+static DEFINE_SPINLOCK(rings_lock);
+
+static atomic_t log_seq;
+
+//The next record to go to the console, and who may send it there
+static uint32_t console_seq = 1;
+static DEFINE_SPINLOCK(console_lock);
+static thread_t *klogd_task;
 static bool enabled = true;
 
 void vlog_disable() {
@@ -28,51 +92,307 @@ void vlog_enable() {
     enabled = true;
 }
 
-static void logbuff_append(const char *str, uint32_t len) {
-    uint32_t coppied = 0;
-    while(coppied < len) {
-        uint32_t chunk_len = MIN(len - coppied, LOG_BUFF_SIZE - front);
+void log_percpu_init() {
+    processor_t *proc = get_percpu(this_proc);
+    log_ring_t *ring = proc->num ? kmalloc(sizeof(log_ring_t)) : &bsp_ring;
+    memset(ring, 0, sizeof(log_ring_t));
+    ring->cpu = proc->num;
+
+    uint32_t flags;
+    spin_lock_irqsave(&rings_lock, &flags);
+    ring->next = rings;
+    barrier();
+    ACCESS_ONCE(rings) = ring;
+    spin_unlock_irqstore(&rings_lock, flags);
+
+    get_percpu(log_ring) = ring;
+}
+
+static void ring_commit(log_ring_t *ring, const char *str, uint32_t len) {
+    log_entry_t *e = &ring->entries[ring->head % LOG_RING_ENTRIES];
+
+    uint32_t old = e->seq;
+    if(old && old >= ACCESS_ONCE(console_seq)) {
+        ring->dropped++;
+    }
+
+    e->seq = 0;
+    barrier();
+
+    e->cpu = ring->cpu;
+    e->flags = len > LOG_ENTRY_TEXT ? LOG_FLAG_TRUNCATED : 0;
+    e->tsc = rdtsc();
+    e->len = MIN(len, LOG_ENTRY_TEXT);
+    memcpy(e->text, str, e->len);
+
+    barrier();
+    e->seq = atomic_add_and_return(&log_seq, 1);
+    barrier();
+
+    ring->head++;
+}
 
-        memcpy(log_buff + front, str, chunk_len);
+//Copy out the oldest record numbered at least *seq, and advance *seq past
+//it. Returns false if there is no such record yet.
+static bool log_read(uint32_t *seq, log_entry_t *out) {
+    uint32_t want = MAX(*seq, 1);
+
+    for(uint32_t tries = 0;; tries++) {
+        log_entry_t *best = NULL;
+        uint32_t best_seq = 0;
+
+        for(log_ring_t *r = ACCESS_ONCE(rings); r; r = r->next) {
+            for(uint32_t i = 0; i < LOG_RING_ENTRIES; i++) {
+                uint32_t s = r->entries[i].seq;
+                if(s >= want && (!best || s < best_seq)) {
+                    best = &r->entries[i];
+                    best_seq = s;
+                }
+            }
+        }
+
+        if(!best) {
+            return false;
+        }
+
+        //The record we want may be about to show up
+        if(best_seq != want && tries < LOG_INFLIGHT_RETRIES) {
+            relax();
+            continue;
+        }
+
+        memcpy(out, best, sizeof(log_entry_t));
+        barrier();
+        if(best->seq != best_seq) {
+            continue;
+        }
+
+        out->seq = best_seq;
+        *seq = best_seq + 1;
+        return true;
+    }
+}
+
+static uint32_t format_time(char *buff, log_entry_t *e) {
+    uint64_t micros = tsc_to_micros(e->tsc);
+    return sprintf(buff, "[%5u.%06u] ", (uint32_t) (micros / MICROS_PER_SEC),
+        (uint32_t) (micros % MICROS_PER_SEC));
+}
+
+//Own up to records which were overwritten before they could be sent to the
+//console. Called with console_lock held.
+static void report_dropped() {
+    char buff[TIME_BUFF_SIZE];
+
+    for(log_ring_t *r = ACCESS_ONCE(rings); r; r = r->next) {
+        uint32_t dropped = ACCESS_ONCE(r->dropped);
+        if(dropped == r->dropped_seen) {
+            continue;
+        }
 
         if(con_global && enabled) {
-            vram_write(con_global, str, len);
+            vram_write(con_global, buff, sprintf(buff,
+                "\nlog - %u messages dropped on cpu %u",
+                dropped - r->dropped_seen, r->cpu));
         }
 
-        coppied += chunk_len;
-        front = (front + chunk_len) % LOG_BUFF_SIZE;
+        r->dropped_seen = dropped;
     }
 }
 
-static void log(const char *str, uint32_t len) {
-    uint32_t time = uptime();
+//Send everything new to the console. Whoever already holds console_lock will
+//do it otherwise, so this never waits.
+void log_flush() {
+    log_entry_t e;
+    char timestamp_buff[TIME_BUFF_SIZE];
 
     uint32_t flags;
-    spin_lock_irqsave(&log_lock, &flags);
+    irqsave(&flags);
+
+    while(spin_trylock(&console_lock)) {
+        report_dropped();
+
+        while(log_read(&console_seq, &e)) {
+            if(con_global && enabled) {
+                vram_write(con_global, "\n", 1);
+                vram_write(con_global, timestamp_buff,
+                    format_time(timestamp_buff, &e));
+                vram_write(con_global, e.text, e.len);
+                if(e.flags & LOG_FLAG_TRUNCATED) {
+                    vram_write(con_global, LOG_TRUNCATED_MARK,
+                        strlen(LOG_TRUNCATED_MARK));
+                }
+            }
+        }
+
+        spin_unlock(&console_lock);
+
+        //Go again if a record arrived while someone gave up on the lock
+        if(console_seq > (uint32_t) atomic_read(&log_seq)) {
+            break;
+        }
+    }
+
+    irqstore(flags);
+}
+
+//Returns the ring to write to, with interrupts off, or NULL if this CPU is
+//already in the middle of writing a record (i.e. from an NMI).
+static log_ring_t * log_begin(uint32_t *flags) {
+    irqsave(flags);
+
+    log_ring_t *ring;
+    if(!percpu_up) {
+        spin_lock(&early_lock);
+        ring = &early_ring;
+    } else {
+        ring = get_percpu(log_ring);
+    }
+
+    if(ring->writing) {
+        if(ring == &early_ring) {
+            spin_unlock(&early_lock);
+        }
+        irqstore(*flags);
+        return NULL;
+    }
+
+    ring->writing = true;
+    return ring;
+}
+
+static void log_end(log_ring_t *ring, uint32_t flags) {
+    ring->writing = false;
 
-    uint32_t timestamp_len = sprintf(timestamp_buff, "[%5u.%03u] ", time / MILLIS_PER_SEC, time % MILLIS_PER_SEC);
+    if(ring == &early_ring) {
+        spin_unlock(&early_lock);
+    }
+    irqstore(flags);
 
-    logbuff_append("\n", 1);
-    logbuff_append(timestamp_buff, timestamp_len);
-    logbuff_append(str, len);
+    //Until klogd is around, write through to the console
+    if(!klogd_task) {
+        log_flush();
+    }
+}
 
-    spin_unlock_irqstore(&log_lock, flags);
+static void log_write(const char *str, uint32_t len) {
+    uint32_t flags;
+    log_ring_t *ring = log_begin(&flags);
+    if(ring) {
+        ring_commit(ring, str, len);
+        log_end(ring, flags);
+    }
 }
 
 void kprint(const char *str) {
-    log(str, strlen(str));
+    log_write(str, strlen(str));
 }
 
 void kprintf(const char *fmt, ...) {
     uint32_t flags;
-    spin_lock_irqsave(&line_buff_lock, &flags);
+    log_ring_t *ring = log_begin(&flags);
+    if(ring) {
+        va_list va;
+        va_start(va, fmt);
+        //The full length is passed on, so that an overlong line is marked
+        ring_commit(ring, ring->line,
+            vsnprintf(ring->line, LINE_BUFF_SIZE, fmt, va));
+        va_end(va);
+
+        log_end(ring, flags);
+    }
+}
+
+static void klogd_wake(void *task) {
+    thread_wake(task);
+}
+
+static void klogd_run(void *UNUSED(arg)) {
+    irqenable();
+
+    klogd_task = current;
 
-    va_list va;
-    va_start(va, fmt);
-    uint32_t len = vsprintf(line_buff, fmt, va);
-    va_end(va);
+    while(true) {
+        log_flush();
 
-    log(line_buff, len);
+        irqdisable();
+        thread_sleep_prepare();
+        timer_create(LOG_DRAIN_INTERVAL, klogd_wake, klogd_task);
+        irqenable();
 
-    spin_unlock_irqstore(&line_buff_lock, flags);
+        sched_switch();
+    }
+}
+
+//Each reader of /dev/kmsg keeps the next sequence number it wants as its file
+//position, so readers never hold anything up. Each record is a line of the
+//form "seq,cpu,micros;text".
+static ssize_t kmsg_read_at(char_device_t *device, char *buff, size_t len,
+    uint32_t *pos) {
+    size_t amt = 0;
+    char line[TIME_BUFF_SIZE + LOG_ENTRY_TEXT + sizeof(LOG_TRUNCATED_MARK)];
+
+    while(true) {
+        log_entry_t e;
+        uint32_t seq = *pos;
+        if(!log_read(&seq, &e)) {
+            break;
+        }
+
+        uint32_t line_len = sprintf(line, "%u,%u,%u;", e.seq, e.cpu,
+            (uint32_t) tsc_to_micros(e.tsc));
+        memcpy(line + line_len, e.text, e.len);
+        line_len += e.len;
+        if(e.flags & LOG_FLAG_TRUNCATED) {
+            memcpy(line + line_len, LOG_TRUNCATED_MARK,
+                strlen(LOG_TRUNCATED_MARK));
+            line_len += strlen(LOG_TRUNCATED_MARK);
+        }
+        line[line_len++] = '\n';
+
+        //Records aren't split between reads, unless one is too big to ever fit
+        if(amt + line_len > len) {
+            if(amt) {
+                break;
+            }
+            line_len = len;
+        }
+
+        memcpy(buff + amt, line, line_len);
+        amt += line_len;
+        *pos = seq;
+    }
+
+    return amt;
 }
+
+static ssize_t kmsg_write(char_device_t *device, const char *buff, size_t len) {
+    log_write(buff, len);
+
+    return len;
+}
+
+static ssize_t kmsg_poll(char_device_t *device, fpoll_data_t *fp) {
+    fp->readable = true;
+    fp->writable = true;
+    fp->errored = false;
+    return 0;
+}
+
+static char_device_ops_t kmsg_ops = {
+    .read_at = kmsg_read_at,
+    .write   = kmsg_write,
+    .poll    = kmsg_poll,
+};
+
+static INITCALL log_init() {
+    char_device_t *kmsg = char_device_alloc();
+    kmsg->ops = &kmsg_ops;
+    register_char_device(kmsg, "kmsg");
+
+    ktaskd_request("klogd", klogd_run, NULL);
+
+    return 0;
+}
+
+subsys_initcall(log_init);
@@ -0,0 +1,90 @@
+#include "common/types.h"
+#include "common/compiler.h"
+#include "lib/string.h"
+#include "init/param.h"
+#include "arch/tsc.h"
+#include "mm/mm.h"
+#include "arch/proc.h"
+#include "sched/proc.h"
+#include "sched/sched.h"
+#include "misc/bench.h"
+#include "log/log.h"
+
+extern bench_t bench_start[], bench_end[];
+
+//A comma-separated list of benchmark names, or "all"
+static char *bench_list = NULL;
+
+static bool bench_select(char *list) {
+    bench_list = list;
+
+    return true;
+}
+
+cmdline_param("bench", bench_select);
+
+static bool bench_selected(bench_t *b) {
+    if(!strcmp(bench_list, "all")) {
+        return true;
+    }
+
+    for(char *name = bench_list; name; name = strchr(name, ',')) {
+        if(*name == ',') {
+            name++;
+        }
+
+        uint32_t i = 0;
+        while(b->name[i] && name[i] == b->name[i]) {
+            i++;
+        }
+
+        if(!b->name[i] && (name[i] == ',' || !name[i])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void bench_report(const char *name, uint32_t ops, uint64_t cycles) {
+    //Thousandths of a cycle, then of a nanosecond, to keep three places
+    uint64_t mcycles = (cycles * 1000) / ops;
+    uint64_t ps = tsc_clock.freq ? (mcycles * 1000000000ULL) / tsc_clock.freq : 0;
+
+    kprintf("bench - name=%s ops=%u ns_per_op=%u.%03u cycles_per_op=%u", name,
+        ops, (uint32_t) (ps / 1000), (uint32_t) (ps % 1000),
+        (uint32_t) (mcycles / 1000));
+}
+
+void __noreturn bench_park() {
+    while(true) {
+        irqdisable();
+        thread_sleep_prepare();
+        irqenable();
+
+        sched_switch();
+    }
+}
+
+void bench_run() {
+    if(!bench_list) {
+        return;
+    }
+
+    kprintf("bench - start cpus=%u tsc_hz=%u", num_procs, tsc_clock.freq);
+
+    //Measure with interrupts on, as everything normally runs
+    uint32_t flags;
+    irqsave(&flags);
+    irqenable();
+
+    for(bench_t *b = bench_start; b < bench_end; b++) {
+        if(bench_selected(b)) {
+            b->run();
+        }
+    }
+
+    irqstore(flags);
+
+    kprintf("bench - done");
+}
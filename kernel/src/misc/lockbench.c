@@ -0,0 +1,166 @@
+#include "common/types.h"
+#include "common/compiler.h"
+#include "arch/tsc.h"
+#include "sync/atomic.h"
+#include "sync/spinlock.h"
+#include "mm/mm.h"
+#include "sched/proc.h"
+#include "sched/sched.h"
+#include "sched/task.h"
+#include "misc/bench.h"
+#include "log/log.h"
+
+//Acquires per thread, and handoffs each way
+#define LOCK_ROUNDS     (1 << 16)
+#define PINGPONG_ROUNDS (1 << 14)
+
+#ifdef CONFIG_SPINLOCK_MCS
+    #define LOCK_KIND "mcs"
+#else
+    #define LOCK_KIND "ticket"
+#endif
+
+static DEFINE_SPINLOCK(bench_lock);
+static volatile uint32_t bench_counter;
+
+static DEFINE_SPINLOCK(pingpong_lock);
+static volatile uint32_t pingpong_turn;
+
+static uint32_t bench_threads;
+static atomic_t bench_ready;
+static atomic_t bench_done;
+static uint64_t *bench_cycles;
+
+static void threads_wait(atomic_t *a) {
+    while((uint32_t) atomic_read(a) < bench_threads) {
+        relax();
+    }
+}
+
+static void threads_begin(uint32_t threads) {
+    bench_threads = threads;
+    atomic_set(&bench_ready, 0);
+    atomic_set(&bench_done, 0);
+}
+
+static inline void lock_bump() {
+    uint32_t flags;
+    spin_lock_irqsave(&bench_lock, &flags);
+    bench_counter++;
+    spin_unlock_irqstore(&bench_lock, flags);
+}
+
+//Every thread hammers the same lock, holding it only long enough to bump a
+//counter, so nearly all the time measured is spent handing the lock around.
+//Build with and without CONFIG_SPINLOCK_MCS to compare the two.
+static uint64_t contend() {
+    //Start together, so that every thread contends with every other
+    atomic_inc(&bench_ready);
+    threads_wait(&bench_ready);
+
+    uint64_t then = rdtsc();
+    for(uint32_t i = 0; i < LOCK_ROUNDS; i++) {
+        lock_bump();
+    }
+    return rdtsc() - then;
+}
+
+static void contend_helper(void *arg) {
+    irqenable();
+
+    bench_cycles[(uint32_t) arg] = contend();
+    atomic_inc(&bench_done);
+
+    bench_park();
+}
+
+//Two threads take turns, each waiting for the other to flip the turn before
+//flipping it back, so every acquire pulls the lock's line from the other CPU.
+static void pingpong(uint32_t me) {
+    for(uint32_t i = 0; i < PINGPONG_ROUNDS; i++) {
+        while(true) {
+            uint32_t flags;
+            spin_lock_irqsave(&pingpong_lock, &flags);
+            bool mine = pingpong_turn == me;
+            if(mine) {
+                pingpong_turn = !me;
+            }
+            spin_unlock_irqstore(&pingpong_lock, flags);
+
+            if(mine) {
+                break;
+            }
+
+            relax();
+        }
+    }
+}
+
+static void pingpong_helper(void *UNUSED(arg)) {
+    irqenable();
+
+    atomic_inc(&bench_ready);
+    threads_wait(&bench_ready);
+
+    pingpong(1);
+    atomic_inc(&bench_done);
+
+    bench_park();
+}
+
+static void spinlock_bench() {
+    BENCH_LOOP("spin_lock_" LOCK_KIND, LOCK_ROUNDS, lock_bump());
+
+    //With a single CPU this just measures the uncontended cost again
+    threads_begin(num_procs);
+    bench_counter = 0;
+    bench_cycles = kmalloc(bench_threads * sizeof(uint64_t));
+
+    for(uint32_t i = 1; i < bench_threads; i++) {
+        spawn_kernel_task("bench-lock", contend_helper, (void *) i);
+    }
+
+    bench_cycles[0] = contend();
+    atomic_inc(&bench_done);
+    threads_wait(&bench_done);
+
+    uint64_t total = 0;
+    for(uint32_t i = 0; i < bench_threads; i++) {
+        total += bench_cycles[i];
+    }
+    kfree(bench_cycles);
+
+    if(bench_counter != bench_threads * LOCK_ROUNDS) {
+        kprintf("bench - spinlock counter is %u, expected %u", bench_counter,
+            bench_threads * LOCK_ROUNDS);
+    }
+
+    //The average time each thread took per acquire
+    bench_report("spin_lock_" LOCK_KIND "_contended", LOCK_ROUNDS,
+        total / bench_threads);
+
+    if(num_procs < 2) {
+        kprintf("bench - skipping spin_pingpong with one cpu");
+        return;
+    }
+
+    threads_begin(2);
+    pingpong_turn = 0;
+
+    spawn_kernel_task("bench-pingpong", pingpong_helper, NULL);
+
+    atomic_inc(&bench_ready);
+    threads_wait(&bench_ready);
+
+    uint64_t then = rdtsc();
+    pingpong(0);
+    uint64_t cycles = rdtsc() - then;
+
+    atomic_inc(&bench_done);
+    threads_wait(&bench_done);
+
+    //Each round is two handoffs, one each way
+    bench_report("spin_pingpong", 2 * PINGPONG_ROUNDS, cycles);
+}
+
+bench_initcall("spinlock", spinlock_bench);
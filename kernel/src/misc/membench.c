@@ -0,0 +1,115 @@
+#include "common/types.h"
+#include "common/compiler.h"
+#include "common/math.h"
+#include "lib/string.h"
+#include "arch/tsc.h"
+#include "mm/mm.h"
+#include "mm/cache.h"
+#include "misc/bench.h"
+
+#define CACHE_OBJS   1024
+#define CACHE_SIZE   64
+#define PAGE_BATCH   256
+#define COPY_ROUNDS  64
+
+//The old byte-at-a-time loops, kept as a baseline to compare against
+static void __noinline byte_memcpy(void *dest, const void *source, size_t bytes) {
+    volatile char *d = dest;
+    const char *s = source;
+    for(size_t i = 0; i < bytes; i++) {
+        d[i] = s[i];
+    }
+}
+
+static void __noinline byte_memset(void *ptr, int c, size_t bytes) {
+    volatile char *p = ptr;
+    for(size_t i = 0; i < bytes; i++) {
+        p[i] = c;
+    }
+}
+
+//Allocates a batch then frees it, so that each round walks the cache's pages
+//much as a burst of allocations would.
+static void cache_bench() {
+    cache_t *cache = cache_create(CACHE_SIZE);
+    void **objs = kmalloc(CACHE_OBJS * sizeof(void *));
+
+    uint64_t best_alloc = ~0ULL, best_free = ~0ULL;
+    for(uint32_t round = 0; round < BENCH_ROUNDS; round++) {
+        uint64_t then = rdtsc();
+        for(uint32_t i = 0; i < CACHE_OBJS; i++) {
+            objs[i] = cache_alloc(cache);
+        }
+        uint64_t mid = rdtsc();
+        for(uint32_t i = 0; i < CACHE_OBJS; i++) {
+            cache_free(cache, objs[i]);
+        }
+        uint64_t now = rdtsc();
+
+        best_alloc = MIN(best_alloc, mid - then);
+        best_free = MIN(best_free, now - mid);
+    }
+
+    bench_report("cache_alloc", CACHE_OBJS, best_alloc);
+    bench_report("cache_free", CACHE_OBJS, best_free);
+
+    //There's no cache_destroy(), but its pages are all free again by now
+    kfree(objs);
+}
+
+static void page_bench() {
+    page_t **pages = kmalloc(PAGE_BATCH * sizeof(page_t *));
+
+    uint64_t best_alloc = ~0ULL, best_free = ~0ULL;
+    for(uint32_t round = 0; round < BENCH_ROUNDS; round++) {
+        uint64_t then = rdtsc();
+        for(uint32_t i = 0; i < PAGE_BATCH; i++) {
+            pages[i] = alloc_page(0);
+        }
+        uint64_t mid = rdtsc();
+        for(uint32_t i = 0; i < PAGE_BATCH; i++) {
+            free_page(pages[i]);
+        }
+        uint64_t now = rdtsc();
+
+        best_alloc = MIN(best_alloc, mid - then);
+        best_free = MIN(best_free, now - mid);
+    }
+
+    bench_report("alloc_page", PAGE_BATCH, best_alloc);
+    bench_report("free_page", PAGE_BATCH, best_free);
+
+    //A single page, freed straight away, is what the per-CPU cache is for
+    BENCH_LOOP("alloc_page+free_page", PAGE_BATCH, free_page(alloc_page(0)));
+
+    kfree(pages);
+}
+
+static void memcpy_bench() {
+    page_t *a = alloc_page(0);
+    page_t *b = alloc_page(0);
+    void *src = page_to_virt(a);
+    void *dst = page_to_virt(b);
+
+    BENCH_LOOP("memcpy_64", COPY_ROUNDS, memcpy(dst, src, 64));
+    BENCH_LOOP("memcpy_512", COPY_ROUNDS, memcpy(dst, src, 512));
+    BENCH_LOOP("memcpy_4096", COPY_ROUNDS, memcpy(dst, src, PAGE_SIZE));
+    BENCH_LOOP("memcpy_4096_unaligned", COPY_ROUNDS,
+        memcpy(dst + 1, src + 3, PAGE_SIZE - 4));
+    BENCH_LOOP("memmove_4096", COPY_ROUNDS, memmove(dst, src, PAGE_SIZE));
+    BENCH_LOOP("byte_memcpy_4096", COPY_ROUNDS,
+        byte_memcpy(dst, src, PAGE_SIZE));
+    BENCH_LOOP("copy_page", COPY_ROUNDS, copy_page(dst, src));
+
+    BENCH_LOOP("memset_4096", COPY_ROUNDS, memset(dst, 0, PAGE_SIZE));
+    BENCH_LOOP("byte_memset_4096", COPY_ROUNDS,
+        byte_memset(dst, 0, PAGE_SIZE));
+    BENCH_LOOP("clear_page", COPY_ROUNDS, clear_page(dst));
+
+    free_page(a);
+    free_page(b);
+}
+
+bench_initcall("cache", cache_bench);
+bench_initcall("page", page_bench);
+bench_initcall("memcpy", memcpy_bench);
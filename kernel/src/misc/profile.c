@@ -0,0 +1,391 @@
+#include "common/types.h"
+#include "common/compiler.h"
+#include "common/math.h"
+#include "lib/string.h"
+#include "lib/printf.h"
+#include "init/initcall.h"
+#include "init/param.h"
+#include "bug/debug.h"
+#include "arch/apic.h"
+#include "arch/pl.h"
+#include "arch/proc.h"
+#include "mm/mm.h"
+#include "sync/semaphore.h"
+#include "sched/proc.h"
+#include "sched/sched.h"
+#include "fs/char.h"
+#include "misc/profile.h"
+#include "log/log.h"
+
+//Samples are counted as they are taken, in a table per CPU keyed by the whole
+//sample, so a profile can run for as long as it likes. Only the number of
+//distinct samples is limited.
+#define PROFILE_HZ      1000
+#define PROFILE_DEPTH   6
+#define PROFILE_NAME    12
+#define PROFILE_SYMBOL  32
+#define PROFILE_ENTRIES 1024
+#define PROFILE_MERGED  4096
+#define PROFILE_PROBES  8
+
+#define PROFILE_LINE_LEN ((PROFILE_DEPTH + 1) * 48)
+
+//Kernel samples keep a short stack (innermost first), found by following
+//frame pointers when built with CONFIG_FRAME_POINTER and otherwise just the
+//interrupted address. User samples keep who was running, and in which function if
+//its binary's symbols were loaded (usersyms=y).
+typedef struct profile_sample {
+    uint32_t frames[PROFILE_DEPTH];
+    uint8_t depth;
+    bool user;
+    char name[PROFILE_NAME];
+    char symbol[PROFILE_SYMBOL];
+} profile_sample_t;
+
+typedef struct profile_entry {
+    profile_sample_t sample;
+    uint32_t count;
+} profile_entry_t;
+
+typedef struct profile_table {
+    profile_entry_t entries[PROFILE_ENTRIES];
+    //Samples which found the table full
+    uint32_t dropped;
+} profile_table_t;
+
+static DEFINE_PER_CPU(profile_table_t *, profile_table);
+static volatile bool profiling = false;
+
+static bool profile_at_boot = false;
+
+static bool profile_enable(char *yes) {
+    if(yes[0] == 'y' || yes[0] == 'Y') {
+        profile_at_boot = true;
+    }
+
+    return true;
+}
+
+cmdline_param("profile", profile_enable);
+
+//The last report rendered, which reads carry on from
+static DEFINE_SEMAPHORE(report_mutex, 1);
+static char *report;
+static uint32_t report_len;
+
+static uint32_t hash_sample(profile_sample_t *s) {
+    uint32_t h = s->user;
+    for(uint32_t i = 0; i < s->depth; i++) {
+        h = (h * 31) ^ s->frames[i];
+    }
+    for(uint32_t i = 0; i < PROFILE_NAME && s->name[i]; i++) {
+        h = (h * 31) ^ s->name[i];
+    }
+    for(uint32_t i = 0; i < PROFILE_SYMBOL && s->symbol[i]; i++) {
+        h = (h * 31) ^ s->symbol[i];
+    }
+
+    return (h ^ (h >> 16)) * 2654435761u;
+}
+
+//Returns the entry for s in table (of size entries), claiming a free one if
+//need be, or NULL if there is no room left
+static profile_entry_t * find_entry(profile_entry_t *table, uint32_t entries,
+    profile_sample_t *s) {
+    uint32_t idx = hash_sample(s) % entries;
+    for(uint32_t i = 0; i < PROFILE_PROBES; i++) {
+        profile_entry_t *e = &table[(idx + i) % entries];
+        if(!e->count) {
+            memcpy(&e->sample, s, sizeof(profile_sample_t));
+            return e;
+        }
+
+        if(!memcmp(&e->sample, s, sizeof(profile_sample_t))) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+#ifdef CONFIG_FRAME_POINTER
+//Follow saved frame pointers up the current kernel stack, stopping at anything
+//which doesn't look like a frame (assembly stubs, or a corrupt stack)
+static void walk_stack(profile_sample_t *s, uint32_t ebp) {
+    thread_t *me = current;
+    if(!me) {
+        return;
+    }
+
+    uint32_t top = (uint32_t) me->kernel_stack_top;
+    uint32_t bot = (uint32_t) me->kernel_stack_bottom;
+    while(s->depth < PROFILE_DEPTH && ebp >= top && ebp + 8 <= bot) {
+        uint32_t *frame = (uint32_t *) ebp;
+        if(!frame[1]) {
+            break;
+        }
+
+        s->frames[s->depth++] = frame[1];
+
+        if(frame[0] <= ebp) {
+            break;
+        }
+        ebp = frame[0];
+    }
+}
+#endif
+
+//A sibling thread's exec can swap node's argv and symbols (and put the old
+//symbols) at any time, so both are only looked at under node->lock. This is
+//only called for samples taken in userspace, so the interrupted code can't be
+//holding that lock itself.
+static void sample_task(profile_sample_t *s, task_node_t *node, uint32_t eip) {
+    spin_lock(&node->lock);
+
+    if(node->argv && node->argv[0]) {
+        const char *name = node->argv[0];
+        memcpy(s->name, name, MIN(strlen(name), PROFILE_NAME - 1));
+    }
+
+    if(node->symbols) {
+        const char *name = symbol_index_name(node->symbols,
+            symbol_index_lookup(node->symbols, eip));
+        if(name) {
+            memcpy(s->symbol, name, MIN(strlen(name), PROFILE_SYMBOL - 1));
+        }
+    }
+
+    spin_unlock(&node->lock);
+}
+
+void profile_tick(interrupt_t *interrupt) {
+    if(!profiling) {
+        return;
+    }
+
+    profile_table_t *table = get_percpu(profile_table);
+    if(!table) {
+        return;
+    }
+
+    profile_sample_t s;
+    memset(&s, 0, sizeof(profile_sample_t));
+
+    s.frames[0] = interrupt->cpu.exec.eip;
+    s.depth = 1;
+
+    if(pl_is_usermode(&interrupt->cpu)) {
+        s.user = true;
+        s.frames[0] = 0;
+
+        thread_t *me = current;
+        if(me) {
+            sample_task(&s, me->node, interrupt->cpu.exec.eip);
+        }
+    } else {
+#ifdef CONFIG_FRAME_POINTER
+        walk_stack(&s, interrupt->cpu.reg.ebp);
+#endif
+    }
+
+    profile_entry_t *e = find_entry(table->entries, PROFILE_ENTRIES, &s);
+    if(e) {
+        e->count++;
+    } else {
+        table->dropped++;
+    }
+}
+
+//The tables are allocated the first time profiling starts, and kept
+static void profile_start() {
+    for(uint32_t i = 0; i < num_procs; i++) {
+        profile_table_t **table = &get_percpu_raw(get_proc(i)->percpu_data,
+            profile_table);
+        if(!*table) {
+            profile_table_t *new = kmalloc(sizeof(profile_table_t));
+            memset(new, 0, sizeof(profile_table_t));
+            barrier();
+            *table = new;
+        }
+    }
+
+    barrier();
+    profiling = true;
+    apic_set_timer_hz(PROFILE_HZ);
+
+    kprintf("profile - sampling at %uHz", PROFILE_HZ);
+}
+
+static void profile_stop() {
+    profiling = false;
+    apic_set_timer_hz(APIC_TIMER_HZ);
+}
+
+//Only safe while stopped, or the odd sample will be lost or survive
+static void profile_reset() {
+    for(uint32_t i = 0; i < num_procs; i++) {
+        profile_table_t *table = get_percpu_raw(get_proc(i)->percpu_data,
+            profile_table);
+        if(table) {
+            memset(table, 0, sizeof(profile_table_t));
+        }
+    }
+}
+
+static uint32_t render_frame(char *buff, uint32_t addr) {
+    const elf_symbol_t *symbol = debug_lookup_symbol(addr);
+    if(symbol) {
+        return sprintf(buff, "%s", debug_symbol_name(symbol));
+    } else {
+        return sprintf(buff, "0x%X", addr);
+    }
+}
+
+//Lines are in the folded format flame graph tools take: the stack from the
+//outermost frame in, separated by semicolons, then the number of samples. The
+//first frame says whether the CPU was in the kernel or in userspace.
+static uint32_t render_entry(char *buff, profile_entry_t *e) {
+    profile_sample_t *s = &e->sample;
+    uint32_t len;
+
+    if(s->user) {
+        len = sprintf(buff, "user;%s", s->name[0] ? s->name : "?");
+        if(s->symbol[0]) {
+            len += sprintf(buff + len, ";%s", s->symbol);
+        }
+    } else {
+        len = sprintf(buff, "kernel");
+        for(uint32_t i = s->depth; i > 0; i--) {
+            buff[len++] = ';';
+            //Return addresses point just past the call
+            len += render_frame(buff + len, s->frames[i - 1] - (i > 1));
+        }
+    }
+
+    return len + sprintf(buff + len, " %u\n", e->count);
+}
+
+//report_mutex must be held
+static void render_report() {
+    profile_entry_t *merged = kmalloc(PROFILE_MERGED * sizeof(profile_entry_t));
+    memset(merged, 0, PROFILE_MERGED * sizeof(profile_entry_t));
+
+    uint32_t unique = 0, dropped = 0;
+    for(uint32_t i = 0; i < num_procs; i++) {
+        profile_table_t *table = get_percpu_raw(get_proc(i)->percpu_data,
+            profile_table);
+        if(!table) {
+            continue;
+        }
+
+        dropped += table->dropped;
+        for(uint32_t j = 0; j < PROFILE_ENTRIES; j++) {
+            profile_entry_t *src = &table->entries[j];
+            uint32_t count = src->count;
+            if(!count) {
+                continue;
+            }
+
+            profile_entry_t *dst = find_entry(merged, PROFILE_MERGED,
+                &src->sample);
+            if(!dst) {
+                dropped += count;
+                continue;
+            }
+
+            if(!dst->count) {
+                unique++;
+            }
+            dst->count += count;
+        }
+    }
+
+    kfree(report);
+    report = kmalloc((unique + 1) * PROFILE_LINE_LEN);
+    report_len = 0;
+
+    for(uint32_t i = 0; i < PROFILE_MERGED; i++) {
+        if(merged[i].count) {
+            report_len += render_entry(report + report_len, &merged[i]);
+        }
+    }
+
+    //Anything which didn't fit still shows up, so the totals are right
+    if(dropped) {
+        report_len += sprintf(report + report_len, "dropped %u\n", dropped);
+    }
+
+    kfree(merged);
+}
+
+//Reading from the start renders a fresh report, later reads carry on from it
+static ssize_t profile_read_at(char_device_t *device, char *buff, size_t len,
+    uint32_t *pos) {
+    semaphore_down(&report_mutex);
+
+    if(!*pos || !report) {
+        render_report();
+    }
+
+    uint32_t amt = 0;
+    if(*pos < report_len) {
+        amt = MIN(len, report_len - *pos);
+        memcpy(buff, report + *pos, amt);
+        *pos += amt;
+    }
+
+    semaphore_up(&report_mutex);
+
+    return amt;
+}
+
+//Write '1' to start sampling, '0' to stop, and 'r' to throw away the samples
+//taken so far (which also stops sampling)
+static ssize_t profile_write(char_device_t *device, const char *buff, size_t len) {
+    for(size_t i = 0; i < len; i++) {
+        switch(buff[i]) {
+            case '1': {
+                profile_start();
+                break;
+            }
+            case '0': {
+                profile_stop();
+                break;
+            }
+            case 'r': {
+                profile_stop();
+                profile_reset();
+                break;
+            }
+        }
+    }
+
+    return len;
+}
+
+static ssize_t profile_poll(char_device_t *device, fpoll_data_t *fp) {
+    fp->readable = true;
+    fp->writable = true;
+    fp->errored = false;
+    return 0;
+}
+
+static char_device_ops_t profile_ops = {
+    .read_at = profile_read_at,
+    .write   = profile_write,
+    .poll    = profile_poll,
+};
+
+static INITCALL profile_init() {
+    char_device_t *profile = char_device_alloc();
+    profile->ops = &profile_ops;
+    register_char_device(profile, "profile");
+
+    if(profile_at_boot) {
+        profile_start();
+    }
+
+    return 0;
+}
+
+device_initcall(profile_init);
@@ -0,0 +1,70 @@
+#include "common/types.h"
+#include "common/compiler.h"
+#include "common/math.h"
+#include "arch/tsc.h"
+#include "sync/atomic.h"
+#include "sync/semaphore.h"
+#include "time/timer.h"
+#include "mm/mm.h"
+#include "sched/proc.h"
+#include "sched/sched.h"
+#include "sched/task.h"
+#include "misc/bench.h"
+
+#define CTXSW_OPS  1024
+#define TIMER_OPS  1024
+#define TIMER_WAIT 10
+
+static DEFINE_SEMAPHORE(ping, 0);
+static DEFINE_SEMAPHORE(pong, 0);
+
+static atomic_t timers_fired;
+
+static void ctxsw_helper(void *UNUSED(arg)) {
+    irqenable();
+
+    for(uint32_t i = 0; i < BENCH_ROUNDS * CTXSW_OPS; i++) {
+        semaphore_down(&ping);
+        semaphore_up(&pong);
+    }
+
+    bench_park();
+}
+
+//Each op wakes the other thread and sleeps until it answers, which costs two
+//switches. With more than one CPU the helper may be picked up elsewhere, in
+//which case this is the latency of a cross-CPU wakeup instead.
+static void ctxsw_bench() {
+    spawn_kernel_task("bench-ctxsw", ctxsw_helper, NULL);
+
+    uint64_t best = ~0ULL;
+    for(uint32_t round = 0; round < BENCH_ROUNDS; round++) {
+        uint64_t then = rdtsc();
+        for(uint32_t i = 0; i < CTXSW_OPS; i++) {
+            semaphore_up(&ping);
+            semaphore_down(&pong);
+        }
+        best = MIN(best, rdtsc() - then);
+    }
+
+    bench_report("ctxsw", 2 * CTXSW_OPS, best);
+}
+
+static void timer_fired(void *UNUSED(data)) {
+    atomic_inc(&timers_fired);
+}
+
+//There's no way to cancel a timer, so each one is left to fire
+static void timer_bench() {
+    atomic_set(&timers_fired, 0);
+
+    BENCH_LOOP("timer_create", TIMER_OPS,
+        timer_create(TIMER_WAIT, timer_fired, NULL));
+
+    while(atomic_read(&timers_fired) < BENCH_ROUNDS * TIMER_OPS) {
+        relax();
+    }
+}
+
+bench_initcall("ctxsw", ctxsw_bench);
+bench_initcall("timer", timer_bench);
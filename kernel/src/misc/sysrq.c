@@ -4,6 +4,7 @@
 #include "log/log.h"
 #include "misc/stats.h"
 #include "misc/sysrq.h"
+#include "sync/lockstat.h"
 #include "driver/console/console.h"
 
 static char fake_idt;
@@ -22,9 +23,16 @@ void sysrq_handle(uint16_t code) {
         case S_KEY: {
             kprintf("stats:");
             kprintf("%u tasks", thread_count);
-            kprintf("%u file descriptors in use", gfdt_entries_in_use);
+            kprintf("%u file descriptors in use", atomic_read(&gfdt_entries_in_use));
             kprintf("%u/%u pages allocated/avaliable", pages_in_use, pages_avaliable);
+            kprintf("%u unused dentries cached", dentries_unused);
             break;
         }
+#ifdef CONFIG_LOCK_STAT
+        case L_KEY: {
+            lockstat_dump();
+            break;
+        }
+#endif
     }
 }
@@ -0,0 +1,212 @@
+#ifdef CONFIG_TRACE
+
+#include "common/types.h"
+#include "common/compiler.h"
+#include "common/math.h"
+#include "lib/string.h"
+#include "init/initcall.h"
+#include "init/param.h"
+#include "mm/mm.h"
+#include "arch/proc.h"
+#include "arch/tsc.h"
+#include "sync/semaphore.h"
+#include "sched/proc.h"
+#include "sched/sched.h"
+#include "fs/char.h"
+#include "misc/trace.h"
+#include "log/log.h"
+
+//Each CPU records into a ring of its own, overwriting the oldest records once
+//it is full, so what is dumped is the most recent stretch of time.
+#define TRACE_RING_RECORDS 8192
+
+typedef struct trace_ring {
+    //Number of records ever written, so the next goes at head % records
+    uint32_t head;
+    trace_record_t records[TRACE_RING_RECORDS];
+} trace_ring_t;
+
+volatile uint32_t trace_mask = 0;
+
+static DEFINE_PER_CPU(trace_ring_t *, trace_ring);
+
+static bool trace_at_boot = false;
+
+static bool trace_enable(char *yes) {
+    if(yes[0] == 'y' || yes[0] == 'Y') {
+        trace_at_boot = true;
+    }
+
+    return true;
+}
+
+cmdline_param("trace", trace_enable);
+
+//The last dump taken, which reads carry on from
+static DEFINE_SEMAPHORE(dump_mutex, 1);
+static char *dump;
+static uint32_t dump_len;
+
+void trace_emit(uint8_t event, uint8_t phase, uint32_t arg0, uint32_t arg1) {
+    if(!percpu_up) {
+        return;
+    }
+
+    uint32_t flags;
+    irqsave(&flags);
+
+    trace_ring_t *ring = get_percpu(trace_ring);
+    if(ring) {
+        thread_t *me = current;
+
+        trace_record_t *r = &ring->records[ring->head % TRACE_RING_RECORDS];
+        r->tsc = rdtsc();
+        r->event = event;
+        r->phase = phase;
+        r->cpu = get_percpu(this_proc)->num;
+        r->pid = me ? me->node->pid : 0;
+        r->arg0 = arg0;
+        r->arg1 = arg1;
+
+        ring->head++;
+    }
+
+    irqstore(flags);
+}
+
+//Switch on the events in mask, starting afresh if nothing was being traced.
+//The rings are allocated the first time, and kept.
+static void trace_start(uint32_t mask) {
+    if(trace_mask) {
+        trace_mask |= mask;
+        return;
+    }
+
+    for(uint32_t i = 0; i < num_procs; i++) {
+        trace_ring_t **ring = &get_percpu_raw(get_proc(i)->percpu_data,
+            trace_ring);
+        if(!*ring) {
+            trace_ring_t *new = kmalloc(sizeof(trace_ring_t));
+            new->head = 0;
+            barrier();
+            *ring = new;
+        } else {
+            (*ring)->head = 0;
+        }
+    }
+
+    barrier();
+    trace_mask = mask;
+}
+
+static void trace_stop() {
+    trace_mask = 0;
+}
+
+//dump_mutex must be held. Tracing is paused while the rings are copied, so
+//that nothing is overwritten halfway through.
+static void take_dump() {
+    uint32_t mask = trace_mask;
+    trace_mask = 0;
+
+    kfree(dump);
+    dump = kmalloc(sizeof(trace_header_t) + num_procs
+        * (sizeof(uint32_t) + TRACE_RING_RECORDS * sizeof(trace_record_t)));
+
+    trace_header_t *hdr = (trace_header_t *) dump;
+    memcpy(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic));
+    hdr->version = TRACE_VERSION;
+    hdr->num_cpus = num_procs;
+    hdr->tsc_freq = tsc_clock.freq;
+    hdr->record_size = sizeof(trace_record_t);
+    dump_len = sizeof(trace_header_t);
+
+    for(uint32_t i = 0; i < num_procs; i++) {
+        trace_ring_t *ring = get_percpu_raw(get_proc(i)->percpu_data,
+            trace_ring);
+        uint32_t head = ring ? ring->head : 0;
+        uint32_t count = MIN(head, TRACE_RING_RECORDS);
+
+        memcpy(dump + dump_len, &count, sizeof(uint32_t));
+        dump_len += sizeof(uint32_t);
+
+        //Oldest first, which may mean unwrapping the ring
+        for(uint32_t j = head - count; j != head; j++) {
+            memcpy(dump + dump_len, &ring->records[j % TRACE_RING_RECORDS],
+                sizeof(trace_record_t));
+            dump_len += sizeof(trace_record_t);
+        }
+    }
+
+    trace_mask = mask;
+}
+
+//Reading from the start takes a fresh dump, later reads carry on from it
+static ssize_t trace_read_at(char_device_t *device, char *buff, size_t len,
+    uint32_t *pos) {
+    semaphore_down(&dump_mutex);
+
+    if(!*pos || !dump) {
+        take_dump();
+    }
+
+    uint32_t amt = 0;
+    if(*pos < dump_len) {
+        amt = MIN(len, dump_len - *pos);
+        memcpy(buff, dump + *pos, amt);
+        *pos += amt;
+    }
+
+    semaphore_up(&dump_mutex);
+
+    return amt;
+}
+
+//Write '1' to trace everything and '0' to stop, or letters to trace events
+//one by one: s(witch), w(ake), c (syscalls), i(rq), a(lloc) and p(acket).
+static ssize_t trace_write(char_device_t *device, const char *buff, size_t len) {
+    for(size_t i = 0; i < len; i++) {
+        switch(buff[i]) {
+            case '1': { trace_start((1 << TRACE_NUM_EVENTS) - 1); break; }
+            case '0': { trace_stop(); break; }
+            case 's': { trace_start(1 << TRACE_SWITCH); break; }
+            case 'w': { trace_start(1 << TRACE_WAKE); break; }
+            case 'c': { trace_start(1 << TRACE_SYSCALL); break; }
+            case 'i': { trace_start(1 << TRACE_IRQ); break; }
+            case 'a': { trace_start(1 << TRACE_ALLOC); break; }
+            case 'p': { trace_start(1 << TRACE_PACKET); break; }
+        }
+    }
+
+    return len;
+}
+
+static ssize_t trace_poll(char_device_t *device, fpoll_data_t *fp) {
+    fp->readable = true;
+    fp->writable = true;
+    fp->errored = false;
+    return 0;
+}
+
+static char_device_ops_t trace_ops = {
+    .read_at = trace_read_at,
+    .write   = trace_write,
+    .poll    = trace_poll,
+};
+
+static INITCALL trace_init() {
+    char_device_t *trace = char_device_alloc();
+    trace->ops = &trace_ops;
+    register_char_device(trace, "trace");
+
+    if(trace_at_boot) {
+        trace_start((1 << TRACE_NUM_EVENTS) - 1);
+        kprintf("trace - tracing all events");
+    }
+
+    return 0;
+}
+
+device_initcall(trace_init);
+
+#endif
@@ -0,0 +1,38 @@
+#include "common/types.h"
+#include "common/compiler.h"
+#include "fs/vfs.h"
+#include "misc/bench.h"
+#include "log/log.h"
+
+#define LOOKUP_OPS 1024
+
+//Both paths are only ever looked up with the dcache already warm, so this
+//measures the lockless walk rather than any filesystem's lookup().
+#define LOOKUP_HIT  "/dev/tty"
+#define LOOKUP_MISS "/dev/bench-missing"
+
+static int32_t lookup_put(path_t *start, const char *path) {
+    path_t out;
+    int32_t ret = vfs_lookup(start, path, &out);
+    if(!ret) {
+        path_put(&out);
+    }
+    return ret;
+}
+
+static void vfs_bench() {
+    path_t root = MNT_ROOT(root_mount);
+
+    int32_t ret = lookup_put(&root, LOOKUP_HIT);
+    if(ret) {
+        kprintf("bench - skipping vfs_lookup, \"" LOOKUP_HIT "\": %d", ret);
+        return;
+    }
+    lookup_put(&root, LOOKUP_MISS);
+
+    BENCH_LOOP("vfs_lookup", LOOKUP_OPS, lookup_put(&root, LOOKUP_HIT));
+    BENCH_LOOP("vfs_lookup_negative", LOOKUP_OPS,
+        lookup_put(&root, LOOKUP_MISS));
+}
+
+bench_initcall("vfs", vfs_bench);
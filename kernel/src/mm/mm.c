@@ -11,16 +11,25 @@
 #include "mm/mm.h"
 #include "mm/cache.h"
 #include "mm/module.h"
+#include "sched/proc.h"
 #include "sched/task.h"
 #include "log/log.h"
 #include "misc/stats.h"
+#include "misc/trace.h"
 
 #define MMAP_BUFF_SIZE 256
 
 #define MAX_ORDER 10
-#define ADDRESS_SPACE_SIZE 4294967295ULL
 
-#define MALLOC_SIZE (MALLOC_NUM_PAGES * PAGE_SIZE)
+//Single pages are refilled from/drained to the buddy lists this many at a
+//time, and a CPU keeps at most PCP_HIGH of them cached.
+#define PCP_BATCH 16
+#define PCP_HIGH  64
+
+#define ZERO_POOL_MAX 256
+//Don't refill the zero pool if fewer than this many pages would remain free
+#define ZERO_POOL_RESERVE 1024
+#define ADDRESS_SPACE_SIZE 4294967295ULL
 
 #define PAGE_TABLE_EXTENT (PAGE_SIZE * NUM_ENTRIES)
 
@@ -34,6 +43,8 @@
 //TODO asynchronously free the boot stack, etc. (as a task after all CPUs have come up)
 
 page_t *pages;
+//Number of entries in pages, enough to cover all of (direct mapped) RAM
+uint32_t page_frames;
 
 __initdata uint32_t lowmem;
 
@@ -47,6 +58,7 @@ static phys_addr_t kernel_start;
 static phys_addr_t kernel_end;
 static phys_addr_t malloc_start;
 static phys_addr_t malloc_end;
+static uint32_t malloc_num_pages;
 
 static list_head_t free_page_list[MAX_ORDER + 1];
 static __initdata multiboot_memory_map_t mmap[MMAP_BUFF_SIZE];
@@ -54,6 +66,49 @@ static __initdata uint32_t mmap_length;
 
 static DEFINE_SPINLOCK(alloc_lock);
 
+//Free pages which the idle loop has already zeroed, used to serve
+//single page ALLOC_ZERO requests. Protected by alloc_lock. Pages in the pool
+//are marked used, but are not counted in pages_in_use.
+static DEFINE_LIST(zero_page_list);
+static uint32_t zero_pages;
+
+//Per-CPU cache of free order 0 pages. Cached pages are marked used and, as far
+//as the buddy allocator is concerned, in use. Normally only the owning CPU
+//touches its cache, with interrupts disabled, so the lock is uncontended. It
+//is there so that an allocation about to fail can drain every CPU's cache.
+//alloc_lock is taken first when both are held, never the other way around.
+typedef struct cpu_pages {
+    spinlock_t lock;
+    list_head_t list;
+    uint32_t count;
+} cpu_pages_t;
+
+static DEFINE_PER_CPU(cpu_pages_t, cpu_pages);
+
+static inline uint32_t free_page_count() {
+    return pages_avaliable - pages_in_use - zero_pages;
+}
+
+void mm_get_info(mm_info_t *info) {
+    uint32_t flags;
+    spin_lock_irqsave(&alloc_lock, &flags);
+
+    info->total = pages_avaliable;
+    info->free = free_page_count();
+    info->zeroed = zero_pages;
+
+    spin_unlock_irqstore(&alloc_lock, flags);
+
+    //Only their owners touch these, so the counts may be a little stale
+    info->cpu_cached = 0;
+    if(percpu_up) {
+        for(uint32_t i = 0; i < num_procs; i++) {
+            info->cpu_cached += get_percpu_raw(get_proc(i)->percpu_data,
+                cpu_pages).count;
+        }
+    }
+}
+
 static inline uint32_t get_order_idx(uint32_t idx, uint32_t order) {
     return DIV_DOWN(idx, 1ULL << order);
 }
@@ -210,6 +265,39 @@ static inline void ripple_join(page_t *page) {
     add_to_freelists(block);
 }
 
+static void do_free_page(page_t *page);
+
+static void drain_zero_pool() {
+    while(!list_empty(&zero_page_list)) {
+        page_t *page = list_first(&zero_page_list, page_t, list);
+        list_rm(&page->list);
+        zero_pages--;
+        do_free_page(page);
+    }
+}
+
+//Called with alloc_lock held. Returns whether any pages were freed.
+static bool drain_cpu_pages() {
+    bool freed = false;
+    for(uint32_t i = 0; i < num_procs; i++) {
+        cpu_pages_t *cp = &get_percpu_raw(get_proc(i)->percpu_data, cpu_pages);
+
+        spin_lock(&cp->lock);
+        while(!list_empty(&cp->list)) {
+            page_t *page = list_first(&cp->list, page_t, list);
+            list_rm(&page->list);
+            cp->count--;
+
+            pages_in_use--;
+            do_free_page(page);
+            freed = true;
+        }
+        spin_unlock(&cp->lock);
+    }
+
+    return freed;
+}
+
 static page_t * do_alloc_pages(uint32_t number) {
     uint32_t target_order = log2(number);
     if(number ^ (1 << target_order)) {
@@ -234,18 +322,139 @@ static page_t * do_alloc_pages(uint32_t number) {
         }
     }
 
+    //Give the background-zeroed pages and every CPU's cached pages back
+    //before giving up
+    if(!list_empty(&zero_page_list)) {
+        drain_zero_pool();
+        return do_alloc_pages(number);
+    }
+
+    if(percpu_up && drain_cpu_pages()) {
+        return do_alloc_pages(number);
+    }
+
     panicf("OOM! wanted %X (%X/%X)", number, pages_in_use, pages_avaliable);
 }
 
-static page_t * _alloc_pages(uint32_t num, uint32_t flags) {
-    uint32_t f;
-    spin_lock_irqsave(&alloc_lock, &f);
+//Pull a batch of single pages from the buddy lists into this CPU's cache.
+//The batch is gathered first, so that cp->lock isn't held under alloc_lock.
+static void cpu_pages_refill(cpu_pages_t *cp) {
+    list_head_t batch;
+    list_init(&batch);
+    uint32_t num = 0;
 
-    page_t *pages = do_alloc_pages(num);
-    void *first = map_pages(page_to_phys(pages), num);
-    for(uint32_t i = 0; i < num; i++) {
-        pages[i].addr = ((uint32_t) first) + (PAGE_SIZE * i);
+    spin_lock(&alloc_lock);
+
+    for(uint32_t i = 0; i < PCP_BATCH; i++) {
+        //Only the first page is mandatory, don't run the system dry for the
+        //rest of the batch.
+        if(i && !free_page_count()) {
+            break;
+        }
 
+        page_t *page = do_alloc_pages(1);
+        list_add(&page->list, &batch);
+        num++;
+    }
+
+    spin_unlock(&alloc_lock);
+
+    spin_lock(&cp->lock);
+    while(!list_empty(&batch)) {
+        list_move(batch.next, &cp->list);
+    }
+    cp->count += num;
+    spin_unlock(&cp->lock);
+}
+
+//Return the coldest PCP_BATCH pages in this CPU's cache to the buddy lists.
+static void cpu_pages_drain(cpu_pages_t *cp) {
+    list_head_t batch;
+    list_init(&batch);
+
+    spin_lock(&cp->lock);
+    for(uint32_t i = 0; i < PCP_BATCH && cp->count; i++) {
+        list_move(cp->list.prev, &batch);
+        cp->count--;
+    }
+    spin_unlock(&cp->lock);
+
+    spin_lock(&alloc_lock);
+
+    while(!list_empty(&batch)) {
+        page_t *page = list_first(&batch, page_t, list);
+        list_rm(&page->list);
+
+        pages_in_use--;
+        do_free_page(page);
+    }
+
+    spin_unlock(&alloc_lock);
+}
+
+static page_t * cpu_pages_alloc() {
+    check_irqs_disabled();
+
+    cpu_pages_t *cp = &get_percpu(cpu_pages);
+
+    spin_lock(&cp->lock);
+    //Another CPU may drain the cache again before the refilled pages are taken
+    while(!cp->count) {
+        spin_unlock(&cp->lock);
+        cpu_pages_refill(cp);
+        spin_lock(&cp->lock);
+    }
+
+    page_t *page = list_first(&cp->list, page_t, list);
+    list_rm(&page->list);
+    cp->count--;
+
+    spin_unlock(&cp->lock);
+
+    return page;
+}
+
+static void cpu_pages_free(page_t *page) {
+    check_irqs_disabled();
+
+    BUG_ON(page->flags & PAGE_FLAG_PERM);
+    BUG_ON(!(page->flags & PAGE_FLAG_USED));
+    page->flags = PAGE_FLAG_USED;
+
+    cpu_pages_t *cp = &get_percpu(cpu_pages);
+
+    spin_lock(&cp->lock);
+    list_add(&page->list, &cp->list);
+    bool full = ++cp->count > PCP_HIGH;
+    spin_unlock(&cp->lock);
+
+    if(full) {
+        cpu_pages_drain(cp);
+    }
+}
+
+void mm_percpu_init() {
+    cpu_pages_t *cp = &get_percpu_unsafe(cpu_pages);
+    spinlock_init(&cp->lock);
+    list_init(&cp->list);
+    cp->count = 0;
+}
+
+static page_t * take_zero_page() {
+    if(list_empty(&zero_page_list)) {
+        return NULL;
+    }
+
+    page_t *page = list_first(&zero_page_list, page_t, list);
+    list_rm(&page->list);
+    zero_pages--;
+    pages_in_use++;
+
+    return page;
+}
+
+static void prepare_pages(page_t *pages, uint32_t num, uint32_t flags) {
+    for(uint32_t i = 0; i < num; i++) {
         BUG_ON(!(pages[i].flags & PAGE_FLAG_USED));
         BUG_ON(pages[i].flags & PAGE_FLAG_PERM);
         check_not_in_freelists(&pages[i]);
@@ -260,9 +469,42 @@ static page_t * _alloc_pages(uint32_t num, uint32_t flags) {
     }
 
     if(flags & ALLOC_ZERO) {
-        memset(first, 0, num * PAGE_SIZE);
+        for(uint32_t i = 0; i < num; i++) {
+            clear_page(page_to_virt(&pages[i]));
+        }
+    }
+}
+
+static page_t * _alloc_pages(uint32_t num, uint32_t flags) {
+    uint32_t f;
+
+    trace(TRACE_ALLOC, TRACE_INSTANT, num, flags);
+
+    //Single pages come from this CPU's cache without touching alloc_lock,
+    //unless there is a pre-zeroed page going spare.
+    if(num == 1 && percpu_up && !((flags & ALLOC_ZERO) && zero_pages)) {
+        irqsave(&f);
+
+        page_t *page = cpu_pages_alloc();
+        prepare_pages(page, 1, flags);
+
+        irqstore(f);
+
+        return page;
     }
 
+    spin_lock_irqsave(&alloc_lock, &f);
+
+    page_t *pages;
+    if(num == 1 && (flags & ALLOC_ZERO) && (pages = take_zero_page())) {
+        //Already zeroed by the idle loop
+        flags &= ~ALLOC_ZERO;
+    } else {
+        pages = do_alloc_pages(num);
+    }
+
+    prepare_pages(pages, num, flags);
+
     spin_unlock_irqstore(&alloc_lock, f);
 
     return pages;
@@ -276,14 +518,9 @@ page_t * alloc_pages(uint32_t num, uint32_t flags) {
     return _alloc_pages(num, flags);
 }
 
-void free_page(page_t *page) {
-    uint32_t f;
-    spin_lock_irqsave(&alloc_lock, &f);
-
+static void do_free_page(page_t *page) {
     uint32_t page_size =  1 << page->order;
 
-    pages_in_use -= page_size;
-
     for(uint32_t i = 0; i < page_size; i++) {
         BUG_ON(page[i].flags & PAGE_FLAG_PERM);
         BUG_ON(!(page[i].flags & PAGE_FLAG_USED));
@@ -292,6 +529,23 @@ void free_page(page_t *page) {
     }
 
     ripple_join(page);
+}
+
+void free_page(page_t *page) {
+    uint32_t f;
+
+    if(!page->order && percpu_up) {
+        irqsave(&f);
+        cpu_pages_free(page);
+        irqstore(f);
+
+        return;
+    }
+
+    spin_lock_irqsave(&alloc_lock, &f);
+
+    pages_in_use -= 1 << page->order;
+    do_free_page(page);
 
     spin_unlock_irqstore(&alloc_lock, f);
 }
@@ -309,6 +563,32 @@ void free_pages(page_t *pages, uint32_t num) {
     }
 }
 
+bool zero_pool_refill() {
+    uint32_t f;
+    spin_lock_irqsave(&alloc_lock, &f);
+
+    if(zero_pages >= ZERO_POOL_MAX || free_page_count() < ZERO_POOL_RESERVE) {
+        spin_unlock_irqstore(&alloc_lock, f);
+        return false;
+    }
+
+    page_t *page = do_alloc_pages(1);
+    pages_in_use--;
+    //Reserve the slot now so concurrent idlers can't overfill the pool
+    zero_pages++;
+
+    spin_unlock_irqstore(&alloc_lock, f);
+
+    //Zero with interrupts on, so that the idle task stays preemptible
+    clear_page(page_to_virt(page));
+
+    spin_lock_irqsave(&alloc_lock, &f);
+    list_add(&page->list, &zero_page_list);
+    spin_unlock_irqstore(&alloc_lock, f);
+
+    return true;
+}
+
 static void claim_page(uint32_t idx) {
     pages[idx].flags &= ~PAGE_FLAG_PERM;
     free_page(&pages[idx]);
@@ -321,6 +601,23 @@ void claim_pages(uint32_t idx, uint32_t num) {
     }
 }
 
+void adopt_pages(uint32_t idx, uint32_t num) {
+    uint32_t f;
+    spin_lock_irqsave(&alloc_lock, &f);
+
+    for(uint32_t i = 0; i < num; i++) {
+        BUG_ON(!(pages[idx + i].flags & PAGE_FLAG_PERM));
+
+        pages[idx + i].flags = PAGE_FLAG_USED;
+        pages[idx + i].order = 0;
+    }
+
+    pages_avaliable += num;
+    pages_in_use += num;
+
+    spin_unlock_irqstore(&alloc_lock, f);
+}
+
 static inline bool page_is_between_addr(uint32_t idx, uint32_t start,
     uint32_t end) {
     uint32_t start_idx = DIV_DOWN(start, PAGE_SIZE);
@@ -336,7 +633,8 @@ static inline bool is_malloc_page(uint32_t idx) {
     return page_is_between_addr(idx, malloc_start, malloc_end);
 }
 
-static phys_addr_t find_region(uint32_t num_pages) {
+//Find num_pages of free physical memory starting on a multiple of align pages.
+static phys_addr_t find_region(uint32_t num_pages, uint32_t align) {
     for(uint32_t i = 0; i < mmap_length; i++) {
         if(mmap[i].type == MULTIBOOT_MEMORY_AVAILABLE) {
             if(mmap[i].addr >= ADDRESS_SPACE_SIZE) {
@@ -346,11 +644,11 @@ static phys_addr_t find_region(uint32_t num_pages) {
             uint32_t start = DIV_UP(mmap[i].addr, PAGE_SIZE);
             uint64_t end = DIV_UP(mmap[i].addr + mmap[i].len, PAGE_SIZE);
 
-            if(end > ADDRESS_SPACE_SIZE / PAGE_SIZE) {
-                end = ADDRESS_SPACE_SIZE / PAGE_SIZE;
+            if(end > page_frames) {
+                end = page_frames;
             }
 
-            if(end - start < num_pages) {
+            if(end <= start || end - start < num_pages) {
                 continue;
             }
 
@@ -358,6 +656,11 @@ static phys_addr_t find_region(uint32_t num_pages) {
             uint32_t reg_start = 0;
             while(start < end) {
                 if(!reg_len) {
+                    if(start % align) {
+                        start++;
+                        continue;
+                    }
+
                     reg_start = start;
                 }
 
@@ -379,6 +682,25 @@ static phys_addr_t find_region(uint32_t num_pages) {
     return 0;
 }
 
+//Returns one past the highest usable page frame, clamped to the direct map.
+static uint32_t __init find_page_frames() {
+    uint64_t top = DIV_UP(kernel_end, PAGE_SIZE);
+    for(uint32_t i = 0; i < mmap_length; i++) {
+        if(mmap[i].type == MULTIBOOT_MEMORY_AVAILABLE) {
+            uint64_t end = (mmap[i].addr + mmap[i].len) / PAGE_SIZE;
+            top = MAX(top, end);
+        }
+    }
+
+    if(top > DIRECT_MAP_TABLES * NUM_ENTRIES) {
+        kprintf("mm - ignoring %u MB of RAM above the direct map",
+            (uint32_t) ((top - DIRECT_MAP_TABLES * NUM_ENTRIES) / (1024 * 1024 / PAGE_SIZE)));
+        top = DIRECT_MAP_TABLES * NUM_ENTRIES;
+    }
+
+    return top;
+}
+
 static void find_free_pages() {
     for(uint32_t i = 0; i < mmap_length; i++) {
         if (mmap[i].type == MULTIBOOT_MEMORY_AVAILABLE) {
@@ -389,8 +711,8 @@ static void find_free_pages() {
             uint32_t start = DIV_UP(mmap[i].addr, PAGE_SIZE);
             uint64_t end = DIV_UP(mmap[i].addr + mmap[i].len, PAGE_SIZE);
 
-            if(end > ADDRESS_SPACE_SIZE / PAGE_SIZE) {
-                end = ADDRESS_SPACE_SIZE / PAGE_SIZE;
+            if(end > page_frames) {
+                end = page_frames;
             }
 
             for(uint32_t j = start; j < end; j++) {
@@ -425,15 +747,21 @@ void __init mm_init() {
     }
     memcpy(mmap, mbi->mmap, mmap_length * sizeof(multiboot_memory_map_t));
 
+    //Only allocate page descriptors for the RAM which is actually there, and
+    //which fits in the direct map.
+    page_frames = find_page_frames();
+    malloc_num_pages = DIV_UP(sizeof(page_t) * page_frames, PAGE_SIZE);
+
     //Find where to put the page array.
-    malloc_start = find_region(MALLOC_NUM_PAGES);
+    malloc_start = find_region(malloc_num_pages, 1);
     if(!malloc_start) {
         panic("could not find a sufficiently large contiguous memory region!");
     }
-    malloc_end = malloc_start + MALLOC_SIZE;
+    malloc_end = malloc_start + (malloc_num_pages * PAGE_SIZE);
 
-    //Replace the boot page table with the init one, and map in the page array.
-    pages = mmu_init(kernel_end, malloc_start);
+    //Replace the boot page table with the init one, which maps all of RAM.
+    mmu_init(page_frames * PAGE_SIZE);
+    pages = phys_to_virt(malloc_start);
 
     kprintf("mm - pages @ %X-%X -> %X", malloc_start, malloc_end, pages);
 
@@ -444,8 +772,7 @@ void __init mm_init() {
 
     //In particular, this loop will probably (this caused bugs in the past)
     //drill holes in multiboot data so we can't ever use mbi again.
-    for (uint32_t page = 0; page < NUM_ENTRIES * NUM_ENTRIES; page++) {
-        pages[page].addr = 0;
+    for (uint32_t page = 0; page < page_frames; page++) {
         pages[page].flags = PAGE_FLAG_PERM | PAGE_FLAG_USED;
         pages[page].order = 0;
         pages[page].compound_num = 0;
@@ -456,8 +783,8 @@ void __init mm_init() {
 
     pages_in_use = 0;
 
-    kprintf("mm - malloc: %u MB, avaliable: %u MB",
-            DIV_DOWN(MALLOC_SIZE, 1024 * 1024),
+    kprintf("mm - malloc: %u KB, avaliable: %u MB",
+            DIV_DOWN(malloc_num_pages * PAGE_SIZE, 1024),
             DIV_DOWN(pages_avaliable * PAGE_SIZE, 1024 * 1024));
 }
 
@@ -11,6 +11,9 @@ typedef struct module {
     uint32_t start;
     uint32_t end;
     uint32_t cmdline;
+
+    //Set if the module's pages still hold live data after loading
+    bool keep;
 } module_t;
 
 static __initdata uint32_t module_count;
@@ -51,18 +54,27 @@ __init void module_load() {
         kprintf("module - #%u loaded", i + 1);
         uint32_t num_pages = DIV_UP(modules[i].end - modules[i].start, PAGE_SIZE);
         void *virt = map_pages(modules[i].start, num_pages);
-        rootramfs_load(virt, modules[i].end - modules[i].start);
+        modules[i].keep = rootramfs_load(virt, modules[i].end - modules[i].start);
         //TODO unmap pages
     }
 
-    uint32_t freed_pages = 0;
+    uint32_t freed_pages = 0, kept_pages = 0;
 
     for(uint32_t i = 0; i < module_count; i++) {
+        if(modules[i].keep) {
+            //These now belong to whoever loaded the module
+            uint32_t first_page = DIV_DOWN(modules[i].start, PAGE_SIZE);
+            uint32_t last_page = DIV_UP(modules[i].end, PAGE_SIZE);
+            adopt_pages(first_page, last_page - first_page);
+            kept_pages += last_page - first_page;
+            continue;
+        }
+
         uint32_t first_page = DIV_UP(modules[i].start, PAGE_SIZE);
         uint32_t last_page = DIV_DOWN(modules[i].end, PAGE_SIZE);
         claim_pages(first_page, last_page - first_page);
         freed_pages += last_page - first_page;
     }
 
-    kprintf("module - %u pages reclaimed", freed_pages);
+    kprintf("module - %u pages reclaimed, %u kept", freed_pages, kept_pages);
 }
@@ -4,6 +4,7 @@
 #include "mm/mm.h"
 #include "net/packet.h"
 #include "net/interface.h"
+#include "misc/trace.h"
 #include "log/log.h"
 
 packet_t * packet_create(net_interface_t *interface, packet_callback_t callback, void *data, void *payload, uint16_t len) {
@@ -38,6 +39,9 @@ void packet_send(packet_t *packet) {
     } else {
         if(packet->result == PRESULT_SUCCESS) {
             packet->interface->link_layer.build_hdr(packet);
+            trace(TRACE_PACKET, TRACE_INSTANT, packet->payload.size,
+                packet->link.size + packet->net.size + packet->tran.size
+                + packet->payload.size);
             packet->interface->send(packet);
         } else {
             packet_destroy(packet);
@@ -201,8 +201,18 @@ static void sock_close_fd(file_t *file) {
     sock_close(file->private);
 }
 
+static ssize_t sock_read_fd(file_t *file, char *buff, size_t bytes) {
+    return sock_recv(file->private, buff, bytes, 0);
+}
+
+static ssize_t sock_write_fd(file_t *file, const char *buff, size_t bytes) {
+    return sock_send(file->private, (void *) buff, bytes, 0);
+}
+
 static file_ops_t sock_ops = {
     .close = sock_close_fd,
+    .read  = sock_read_fd,
+    .write = sock_write_fd,
 };
 
 file_t * sock_create_fd(sock_t *sock) {
@@ -0,0 +1,83 @@
+#include "common/types.h"
+#include "arch/tsc.h"
+#include "arch/proc.h"
+#include "mm/mm.h"
+#include "sched/proc.h"
+#include "sched/task.h"
+#include "sched/acct.h"
+
+static DEFINE_PER_CPU(cpu_acct_t, cpu_acct);
+//When this CPU last charged anyone for its time
+static DEFINE_PER_CPU(uint64_t, acct_stamp);
+
+void acct_percpu_init() {
+    get_percpu_unsafe(acct_stamp) = rdtsc();
+}
+
+//Charge the time since the last accounting event on this CPU to t
+static void charge(thread_t *t) {
+    if(!percpu_up) {
+        return;
+    }
+
+    uint64_t now = rdtsc();
+    uint64_t last = get_percpu(acct_stamp);
+    get_percpu(acct_stamp) = now;
+
+    if(!t) {
+        return;
+    }
+
+    uint64_t delta = now - last;
+    cpu_acct_t *cpu = &get_percpu(cpu_acct);
+    if(t->state == THREAD_IDLE) {
+        cpu->idle += delta;
+    } else if(t->acct.user) {
+        t->acct.utime += delta;
+        cpu->user += delta;
+    } else {
+        t->acct.stime += delta;
+        cpu->system += delta;
+    }
+}
+
+void acct_enter_kernel() {
+    thread_t *me = current;
+    charge(me);
+    me->acct.user = false;
+}
+
+void acct_enter_user() {
+    thread_t *me = current;
+    charge(me);
+    me->acct.user = true;
+}
+
+void acct_exit(thread_t *t) {
+    charge(t);
+    t->acct.nvcsw++;
+}
+
+void acct_switch(thread_t *old, thread_t *next) {
+    charge(old);
+
+    if(old != next) {
+        //An exited thread's last switch was counted by acct_exit()
+        if(old->state == THREAD_SLEEPING) {
+            old->acct.nvcsw++;
+        } else if(old->state != THREAD_EXITED) {
+            old->acct.nivcsw++;
+        }
+
+        get_percpu(cpu_acct).switches++;
+    }
+}
+
+void acct_cpu_get(uint32_t cpu, cpu_acct_t *out) {
+    *out = get_percpu_raw(get_proc(cpu)->percpu_data, cpu_acct);
+}
+
+uint32_t acct_to_ticks(uint64_t cycles) {
+    uint32_t per_tick = tsc_clock.freq / ACCT_TICKS_PER_SEC;
+    return per_tick ? cycles / per_tick : 0;
+}
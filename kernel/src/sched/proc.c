@@ -7,25 +7,44 @@
 #include "mm/cache.h"
 #include "sched/proc.h"
 #include "sched/sched.h"
+#include "sched/acct.h"
 #include "log/log.h"
 
 processor_t *bsp;
+uint32_t num_procs;
 static DEFINE_LIST(procs);
 DEFINE_PER_CPU(processor_t *, this_proc);
 
 processor_t * register_proc(uint32_t num) {
     processor_t *proc = kmalloc(sizeof(processor_t));
     proc->num = num;
-    proc->percpu_data = num ? map_page(page_to_phys(alloc_pages(DIV_UP(((uint32_t) &percpu_data_end) - ((uint32_t) &percpu_data_start), PAGE_SIZE), 0))) : &percpu_data_start;
+    //Zeroed, as the BSP's copy (the section itself) is
+    proc->percpu_data = num ? page_to_virt(alloc_pages(DIV_UP(((uint32_t) &percpu_data_end) - ((uint32_t) &percpu_data_start), PAGE_SIZE), ALLOC_ZERO)) : &percpu_data_start;
     list_add(&proc->list, &procs);
+    num_procs++;
 
     arch_setup_proc(proc);
 
     get_percpu(this_proc) = proc;
+    mm_percpu_init();
+    log_percpu_init();
+    acct_percpu_init();
 
     return proc;
 }
 
+//Processors are only ever added, one at a time during boot
+processor_t * get_proc(uint32_t num) {
+    processor_t *proc;
+    LIST_FOR_EACH_ENTRY(proc, &procs, list) {
+        if(proc->num == num) {
+            return proc;
+        }
+    }
+
+    return NULL;
+}
+
 static void management_interrupt(interrupt_t *interrupt, void *data) {
     check_irqs_disabled();
 
@@ -5,6 +5,7 @@
 #include "common/list.h"
 #include "init/initcall.h"
 #include "common/asm.h"
+#include "common/math.h"
 #include "bug/debug.h"
 #include "bug/panic.h"
 #include "sync/spinlock.h"
@@ -19,13 +20,11 @@
 #include "sched/task.h"
 #include "log/log.h"
 #include "misc/stats.h"
+#include "misc/trace.h"
 
 #define QUANTUM 100
 
-#define SWITCH_INT 0x81
-
-#define UFD_INVALID ((ufd_idx_t) -1)
-#define MAX_NUM_FDS MIN(((ufd_idx_t) (PAGE_SIZE / sizeof(ufd_t))), UFD_INVALID)
+#define UFDT_WORD_BITS 32
 
 static pid_t pid = 0;
 
@@ -67,7 +66,7 @@ typedef struct sig_descriptor {
 static struct sigaction default_sigactions[NSIG];
 static sig_descriptor_t signals[NSIG];
 
-static bool __ufdt_is_present(ufd_context_t *ufds, ufd_idx_t ufd);
+static bool __ufdt_is_present(ufd_table_t *table, ufd_idx_t ufd);
 
 void sched_switch() {
     uint32_t flags;
@@ -98,48 +97,75 @@ static inline bool task_node_ensure_not_exiting(task_node_t *node) {
     return true;
 }
 
+static inline uint32_t ufd_table_words(uint32_t size) {
+    return DIV_UP(size, UFDT_WORD_BITS);
+}
+
+static ufd_table_t * ufd_table_alloc(uint32_t size) {
+    uint32_t slots_len = size * sizeof(ufd_t);
+    uint32_t open_len = ufd_table_words(size) * sizeof(uint32_t);
+
+    ufd_table_t *table = kmalloc(sizeof(ufd_table_t) + slots_len + open_len);
+    table->size = size;
+    table->slots = (void *) (table + 1);
+    table->open = ((void *) table->slots) + slots_len;
+    table->prev = NULL;
+
+    memset(table->slots, 0, slots_len);
+    memset(table->open, 0, open_len);
+
+    return table;
+}
+
+static void ufd_table_free(ufd_table_t *table) {
+    while(table) {
+        ufd_table_t *prev = table->prev;
+        kfree(table);
+        table = prev;
+    }
+}
+
 static inline ufd_context_t * ufd_context_build() {
     ufd_context_t *ufd = kmalloc(sizeof(ufd_context_t));
     ufd->refs = 1;
-    ufd->table = kmalloc(UFDT_PAGES * PAGE_SIZE);
+    ufd->table = ufd_table_alloc(UFDT_MIN_FDS);
+    ufd->next_free = 0;
     spinlock_init(&ufd->lock);
 
-    for(ufd_idx_t i = 0; i < MAX_NUM_FDS - 1; i++) {
-        ufd->table[i].gfd = NULL;
-        ufd->table[i].flags = 0;
-    }
-
     return ufd;
 }
 
 static inline void ufd_context_destroy(ufd_context_t *ufd) {
-    for(uint32_t i = 0; i < MAX_NUM_FDS; i++) {
-        if(__ufdt_is_present(ufd, i)) {
-            gfdt_put(ufd->table[i].gfd);
+    for(uint32_t i = 0; i < ufd->table->size; i++) {
+        if(__ufdt_is_present(ufd->table, i)) {
+            gfdt_put(ufd->table->slots[i].gfd);
         }
     }
 
-    kfree(ufd->table);
+    ufd_table_free(ufd->table);
     kfree(ufd);
 }
 
 static inline ufd_context_t * ufd_context_dup(ufd_context_t *src) {
     ufd_context_t *dst = kmalloc(sizeof(ufd_context_t));
     dst->refs = 1;
-    dst->table = kmalloc(UFDT_PAGES * PAGE_SIZE);
     spinlock_init(&dst->lock);
 
     uint32_t flags;
     spin_lock_irqsave(&src->lock, &flags);
 
-    for(ufd_idx_t i = 0; i < MAX_NUM_FDS - 1; i++) {
-        if(__ufdt_is_present(src, i)) {
-            gfdt_get(src->table[i].gfd);
+    ufd_table_t *from = src->table;
+    ufd_table_t *to = dst->table = ufd_table_alloc(from->size);
+    dst->next_free = src->next_free;
+
+    for(ufd_idx_t i = 0; i < from->size; i++) {
+        if(__ufdt_is_present(from, i)) {
+            gfdt_get(from->slots[i].gfd);
         }
 
-        dst->table[i].gfd = src->table[i].gfd;
-        dst->table[i].flags = src->table[i].flags;
+        to->slots[i] = from->slots[i];
     }
+    memcpy(to->open, from->open, ufd_table_words(from->size) * sizeof(uint32_t));
 
     spin_unlock_irqstore(&src->lock, flags);
 
@@ -151,6 +177,8 @@ static inline fs_context_t * fs_context_build() {
     fs->refs = 1;
     fs->root = MNT_ROOT(root_mount);
     fs->pwd = MNT_ROOT(root_mount);
+    path_get(&fs->root);
+    path_get(&fs->pwd);
     spinlock_init(&fs->lock);
 
     return fs;
@@ -166,6 +194,8 @@ static inline fs_context_t * fs_context_dup(fs_context_t *src) {
 
     dst->root = src->root;
     dst->pwd = src->pwd;
+    path_get(&dst->root);
+    path_get(&dst->pwd);
 
     spin_unlock_irqstore(&src->lock, flags);
 
@@ -173,6 +203,8 @@ static inline fs_context_t * fs_context_dup(fs_context_t *src) {
 }
 
 static inline void fs_context_destroy(fs_context_t *fs) {
+    path_put(&fs->root);
+    path_put(&fs->pwd);
     kfree(fs);
 }
 
@@ -211,7 +243,10 @@ task_node_t * task_node_find(pid_t pid) {
         if(found) break;
     }
 
-    task_node_get(t);
+    //Otherwise t is just the list head
+    if(found) {
+        task_node_get(t);
+    }
 
     spin_unlock_irqstore(&sched_lock, flags);
 
@@ -222,6 +257,96 @@ task_node_t * task_node_find(pid_t pid) {
     return t;
 }
 
+uint32_t task_list_pids(pid_t *pids, uint32_t max) {
+    uint32_t flags;
+    spin_lock_irqsave(&sched_lock, &flags);
+
+    uint32_t num = 0;
+    task_node_t *t;
+    LIST_FOR_EACH_ENTRY(t, &tasks, list) {
+        if(num < max) {
+            pids[num] = t->pid;
+        }
+        num++;
+    }
+
+    spin_unlock_irqstore(&sched_lock, flags);
+
+    return num;
+}
+
+static char task_state(task_node_t *node) {
+    if(atomic_read(&node->exit_state) != TASK_RUNNING) {
+        return 'Z';
+    }
+
+    char state = 'S';
+    thread_t *t;
+    LIST_FOR_EACH_ENTRY(t, &node->threads, thread_list) {
+        if(t->state == THREAD_AWAKE) {
+            return 'R';
+        } else if(t->state == THREAD_IDLE) {
+            state = 'I';
+        }
+    }
+
+    return state;
+}
+
+bool task_get_stat(pid_t pid, task_stat_t *stat) {
+    uint32_t flags;
+    spin_lock_irqsave(&sched_lock, &flags);
+
+    bool found = false;
+    task_node_t *t;
+    LIST_FOR_EACH_ENTRY(t, &tasks, list) {
+        if(t->pid == pid) {
+            found = true;
+            break;
+        }
+    }
+
+    if(found) {
+        spin_lock(&t->lock);
+
+        memset(stat, 0, sizeof(task_stat_t));
+        stat->pid = t->pid;
+        stat->ppid = t->parent ? t->parent->pid : 0;
+        stat->pgrp = t->pgroup ? t->pgroup->leader->pid : 0;
+        stat->session = t->session ? t->session->leader->pid : 0;
+        stat->state = task_state(t);
+        stat->start = t->start;
+
+        if(t->argv && t->argv[0]) {
+            const char *name = t->argv[0];
+            memcpy(stat->comm, name, MIN(strlen(name), TASK_COMM_LEN - 1));
+        }
+
+        //The threads which have exited, then those still around
+        thread_acct_t acct = t->acct;
+        thread_t *thread;
+        LIST_FOR_EACH_ENTRY(thread, &t->threads, thread_list) {
+            acct_add(&acct, &thread->acct);
+            stat->num_threads++;
+
+            if(!stat->rss) {
+                stat->rss = user_count_pages(thread);
+            }
+        }
+
+        stat->utime = acct.utime;
+        stat->stime = acct.stime;
+        stat->nvcsw = acct.nvcsw;
+        stat->nivcsw = acct.nivcsw;
+
+        spin_unlock(&t->lock);
+    }
+
+    spin_unlock_irqstore(&sched_lock, flags);
+
+    return found;
+}
+
 void session_create(task_node_t *t) {
     psession_t *session = kmalloc(sizeof(psession_t));
     session->leader = t;
@@ -345,6 +470,12 @@ static inline task_node_t * task_node_build(task_node_t *parent, char **argv,
     node->pid = pid++;
     node->argv = (argv || !parent) ? argv : parent->argv;
     node->envp = (envp || !parent) ? envp : parent->envp;
+    node->start = uptime();
+    memset(&node->acct, 0, sizeof(thread_acct_t));
+    node->symbols = parent ? parent->symbols : NULL;
+    if(node->symbols) {
+        symbol_index_get(node->symbols);
+    }
     node->parent = parent;
     atomic_set(&node->exit_state, TASK_RUNNING);
     spinlock_init(&node->lock);
@@ -418,6 +549,13 @@ static inline void task_node_zombify(task_node_t *node) {
 
     atomic_set(&node->exit_state, TASK_EXITED);
 
+    //No thread is left to run the binary, so its symbols can go
+    symbol_index_t *symbols = node->symbols;
+    node->symbols = NULL;
+    if(symbols) {
+        symbol_index_put(symbols);
+    }
+
     if(node->pid == 1) {
         panic("init exited");
     }
@@ -514,6 +652,7 @@ static inline thread_t * thread_build(task_node_t *node, ufd_context_t *ufd,
     thread->state = THREAD_BUILDING;
     thread->should_die = false;
     sigemptyset(&thread->sig_pending);
+    memset(&thread->acct, 0, sizeof(thread_acct_t));
 
     thread->node = node;
     thread->ufd = ufd;
@@ -574,7 +713,11 @@ void __init root_task_init(void *umain) {
 static void idle_loop(void *UNUSED(arg)) {
     irqenable();
 
-    while(true) hlt();
+    while(true) {
+        if(!zero_pool_refill()) {
+            hlt();
+        }
+    }
 }
 
 thread_t * create_idle_task() {
@@ -584,26 +727,84 @@ thread_t * create_idle_task() {
     return idler;
 }
 
-//FIXME XXX we need to be getting and putting the underlying file in all of the
-//ufdt_*() functions below.
+//Files are only ever put after ufds->lock is dropped, since the last put
+//closes the file.
+//
+//Only changes to a table need ufds->lock. Readers look fds up locklessly,
+//which is safe because outgrown tables are never freed early, and file_t
+//memory is never handed back by its cache (so a file which is closed under a
+//reader still has a refcount to check, which is zero).
 
-static bool __ufdt_is_present(ufd_context_t *ufds, ufd_idx_t ufd) {
-    return ufd < MAX_NUM_FDS && ufds->table[ufd].gfd;
+static bool __ufdt_is_present(ufd_table_t *table, ufd_idx_t ufd) {
+    return ufd < table->size && table->slots[ufd].gfd;
 }
 
+//Returns the lowest free fd, which may be past the end of the table (in
+//which case it must grow), or UFD_INVALID if there are too many open.
 static ufd_idx_t __ufdt_find_next(ufd_context_t *ufds) {
-    for(uint32_t idx = 0; idx < MAX_NUM_FDS; idx++) {
-        if(!__ufdt_is_present(ufds, idx)) {
-            return idx;
+    ufd_table_t *table = ufds->table;
+
+    for(uint32_t w = ufds->next_free / UFDT_WORD_BITS; w < ufd_table_words(table->size); w++) {
+        if(~table->open[w]) {
+            ufd_idx_t idx = (w * UFDT_WORD_BITS) + __builtin_ctz(~table->open[w]);
+            if(idx < table->size) {
+                return idx;
+            }
         }
     }
-    return UFD_INVALID;
+
+    return table->size < UFDT_MAX_FDS ? table->size : UFD_INVALID;
+}
+
+//Double the table until it covers idx
+static int32_t __ufdt_grow(ufd_context_t *ufds, ufd_idx_t idx) {
+    ufd_table_t *old = ufds->table;
+
+    uint32_t size = old->size;
+    while(size <= idx) {
+        size *= 2;
+    }
+
+    if(size > UFDT_MAX_FDS) {
+        return -EMFILE;
+    }
+
+    ufd_table_t *new = ufd_table_alloc(size);
+    memcpy(new->slots, old->slots, old->size * sizeof(ufd_t));
+    memcpy(new->open, old->open, ufd_table_words(old->size) * sizeof(uint32_t));
+    new->prev = old;
+
+    //Publish the table only once it is filled in
+    barrier();
+    ACCESS_ONCE(ufds->table) = new;
+
+    return 0;
 }
 
 static int32_t __ufdt_install(ufd_context_t *ufds, ufd_idx_t idx, file_t *gfd) {
+    if(idx >= UFDT_MAX_FDS) {
+        return -EBADF;
+    }
+
+    if(idx >= ufds->table->size) {
+        int32_t ret = __ufdt_grow(ufds, idx);
+        if(ret) {
+            return ret;
+        }
+    }
+
+    ufd_table_t *table = ufds->table;
+
     gfdt_get(gfd);
-    ufds->table[idx].gfd = gfd;
-    ufds->table[idx].flags = 0;
+    table->slots[idx].flags = 0;
+    table->open[idx / UFDT_WORD_BITS] |= 1 << (idx % UFDT_WORD_BITS);
+
+    barrier();
+    ACCESS_ONCE(table->slots[idx].gfd) = gfd;
+
+    if(idx == ufds->next_free) {
+        ufds->next_free++;
+    }
 
     return 0;
 }
@@ -615,8 +816,8 @@ ufd_idx_t ufdt_add(file_t *gfd) {
     spin_lock_irqsave(&ufds->lock, &f);
 
     ufd_idx_t added = __ufdt_find_next(ufds);
-    if(added != UFD_INVALID) {
-        __ufdt_install(ufds, added, gfd);
+    if(added != UFD_INVALID && __ufdt_install(ufds, added, gfd)) {
+        added = UFD_INVALID;
     }
 
     spin_unlock_irqstore(&ufds->lock, f);
@@ -624,102 +825,103 @@ ufd_idx_t ufdt_add(file_t *gfd) {
     return added;
 }
 
-static int32_t __ufdt_close(ufd_context_t *ufds, ufd_idx_t ufd) {
-    gfdt_put(ufds->table[ufd].gfd);
-    ufds->table[ufd].gfd = NULL;
-    ufds->table[ufd].flags = 0;
+//Returns the file which was installed, whose reference the caller must put
+static file_t * __ufdt_close(ufd_context_t *ufds, ufd_idx_t ufd) {
+    ufd_table_t *table = ufds->table;
 
-    return 0;
+    file_t *old = table->slots[ufd].gfd;
+    ACCESS_ONCE(table->slots[ufd].gfd) = NULL;
+    table->slots[ufd].flags = 0;
+    table->open[ufd / UFDT_WORD_BITS] &= ~(1 << (ufd % UFDT_WORD_BITS));
+
+    if(ufd < ufds->next_free) {
+        ufds->next_free = ufd;
+    }
+
+    return old;
 }
 
 int32_t ufdt_close(ufd_idx_t ufd) {
-    int32_t ret = 0;
     ufd_context_t *ufds = obtain_ufds(current);
+    file_t *old = NULL;
 
     uint32_t flags;
     spin_lock_irqsave(&ufds->lock, &flags);
 
-    if(!__ufdt_is_present(ufds, ufd)) {
-        ret = -EBADF;
-        goto out;
+    if(__ufdt_is_present(ufds->table, ufd)) {
+        old = __ufdt_close(ufds, ufd);
     }
-    ret = __ufdt_close(ufds, ufd);
 
-out:
     spin_unlock_irqstore(&ufds->lock, flags);
-    return ret;
+
+    if(!old) {
+        return -EBADF;
+    }
+
+    gfdt_put(old);
+    return 0;
 }
 
 //close if open, then install
 int32_t ufdt_replace(ufd_idx_t ufd, file_t *fd) {
-    int32_t ret;
     ufd_context_t *ufds = obtain_ufds(current);
+    file_t *old = NULL;
 
     uint32_t f;
     spin_lock_irqsave(&ufds->lock, &f);
 
-    if(__ufdt_is_present(ufds, ufd)) {
-        ret = __ufdt_close(ufds, ufd);
-        if(ret) {
-            goto out;
-        }
+    if(__ufdt_is_present(ufds->table, ufd)) {
+        old = __ufdt_close(ufds, ufd);
     }
 
-    ret = __ufdt_install(ufds, ufd, fd);
+    int32_t ret = __ufdt_install(ufds, ufd, fd);
 
-out:
     spin_unlock_irqstore(&ufds->lock, f);
+
+    if(old) {
+        gfdt_put(old);
+    }
+
     return ret;
 }
 
 //FIXME this function _is_ a race!!
 bool ufdt_valid(ufd_idx_t ufd) {
-    if(ufd >= MAX_NUM_FDS) {
-        return false;
-    }
-
-    ufd_context_t *ufds = obtain_ufds(current);
-
-    bool response;
-
-    uint32_t flags;
-    spin_lock_irqsave(&ufds->lock, &flags);
-
-    response = !!ufds->table[ufd].gfd;
-
-    spin_unlock_irqstore(&ufds->lock, flags);
-
-    return response;
+    ufd_table_t *table = ACCESS_ONCE(obtain_ufds(current)->table);
+    return ufd < table->size && ACCESS_ONCE(table->slots[ufd].gfd);
 }
 
 file_t * ufdt_get(ufd_idx_t ufd) {
     ufd_context_t *ufds = obtain_ufds(current);
 
-    file_t *gfd = NULL;
-
-    uint32_t flags;
-    spin_lock_irqsave(&ufds->lock, &flags);
+    while(true) {
+        ufd_table_t *table = ACCESS_ONCE(ufds->table);
+        if(ufd >= table->size) {
+            return NULL;
+        }
 
-    if(__ufdt_is_present(ufds, ufd)) {
-        gfd = ufds->table[ufd].gfd;
+        file_t *gfd = ACCESS_ONCE(table->slots[ufd].gfd);
+        if(!gfd) {
+            return NULL;
+        }
 
-        //inc gfd refcnt
-    }
+        //A file with no references is on its way out, and the slot must
+        //already have changed
+        if(!atomic_add_unless(&gfd->refs, 1, 0)) {
+            continue;
+        }
 
-    spin_unlock_irqstore(&ufds->lock, flags);
+        //Make sure the file wasn't closed (and maybe reused) meanwhile
+        if(ACCESS_ONCE(ACCESS_ONCE(ufds->table)->slots[ufd].gfd) == gfd) {
+            return gfd;
+        }
 
-    return gfd;
+        gfdt_put(gfd);
+    }
 }
 
-void ufdt_put(ufd_idx_t ufd) {
-    ufd_context_t *ufds = obtain_ufds(current);
-
-    uint32_t flags;
-    spin_lock_irqsave(&ufds->lock, &flags);
-
-    //FIXME dec the count of the underlying file
-
-    spin_unlock_irqstore(&ufds->lock, flags);
+void ufdt_put(file_t *gfd) {
+    gfdt_put(gfd);
 }
 
 void thread_sleep_prepare() {
@@ -748,6 +950,7 @@ static void do_wake(thread_t *t) {
         // case. Exited threads are cleaned up in the core queued_threads loop.
         if(t->state == THREAD_SLEEPING) {
             t->state = THREAD_AWAKE;
+            trace(TRACE_WAKE, TRACE_INSTANT, t->node->pid, 0);
         }
 
         if(!t->active) {
@@ -1083,6 +1286,11 @@ static void deactivate_thread(thread_t *t) {
         case THREAD_EXITED: {
             //FIXME this is garbage
 
+            //The switch away hasn't happened yet, so charge for it now, while
+            //the task still takes this thread's times
+            acct_exit(t);
+            acct_add(&t->node->acct, &t->acct);
+
             list_rm(&t->list);
             list_rm(&t->thread_list);
 
@@ -1147,8 +1355,11 @@ static inline thread_t * lock_next_current(thread_t *old) {
 static void finish_sched_switch(thread_t *old, thread_t *next) {
     check_irqs_disabled();
 
+    acct_switch(old, next);
     current = next;
 
+    trace(TRACE_SWITCH, TRACE_INSTANT, old->node->pid, next->node->pid);
+
     BUG_ON(old != next && next->active);
     check_on_correct_stack();
 
@@ -1196,8 +1407,10 @@ void __noreturn sched_loop() {
 
     kprintf("sched - proc #%u is READY", get_percpu(this_proc)->num);
 
+#ifdef CONFIG_DEBUG_LOCKS
     get_percpu(locks_held) = 0;
     list_init(&get_percpu(lock_list));
+#endif
     get_percpu(switch_time) = 0;
 
     thread_t *idle = create_idle_task();
@@ -16,6 +16,7 @@
 #include "net/socket.h"
 #include "fs/vfs.h"
 #include "fs/exec.h"
+#include "fs/pipe.h"
 #include "driver/console/tty.h"
 #include "log/log.h"
 #include "user/select.h"
@@ -99,14 +100,24 @@ DEFINE_SYSCALL(open, const char *pathname, uint32_t flags, uint32_t mode) {
         ret = vfs_lookup(pwd, pathname, &path);
     }
 
+    if(ret) {
+        return ret;
+    }
+
+    if((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY
+        && S_ISREG(path.dentry->inode->mode)) {
+        ret = vfs_truncate(&path, 0);
+    }
+
     if(!ret) {
-        file_t *file = vfs_open_file(&path);
+        file_t *file = vfs_open_file(&path, flags);
         if(!file) {
             BUG();
         }
-        return ufdt_add(file);
+        ret = ufdt_add(file);
     }
 
+    path_put(&path);
     return ret;
 }
 
@@ -116,7 +127,7 @@ DEFINE_SYSCALL(close, ufd_idx_t ufd) {
     file_t *file = ufdt_get(ufd);
     if(file) {
         ufdt_close(ufd);
-        ufdt_put(ufd);
+        ufdt_put(file);
 
         return 0;
     }
@@ -124,6 +135,59 @@ DEFINE_SYSCALL(close, ufd_idx_t ufd) {
     return -EINVAL;
 }
 
+DEFINE_SYSCALL(pipe, int *fds, uint32_t flags) {
+    //TODO sanitize fds ptr
+
+    if(flags & ~O_NONBLOCK) {
+        return -EINVAL;
+    }
+
+    file_t *read, *write;
+    pipe_create(&read, &write);
+    read->flags |= flags;
+    write->flags |= flags;
+
+    //Hold our own references, so that whichever end isn't installed is freed
+    gfdt_get(read);
+    gfdt_get(write);
+
+    int32_t ret = -EMFILE;
+    ufd_idx_t rfd = ufdt_add(read);
+    if(rfd != UFD_INVALID) {
+        ufd_idx_t wfd = ufdt_add(write);
+        if(wfd != UFD_INVALID) {
+            fds[0] = rfd;
+            fds[1] = wfd;
+            ret = 0;
+        } else {
+            ufdt_close(rfd);
+        }
+    }
+
+    gfdt_put(read);
+    gfdt_put(write);
+
+    return ret;
+}
+
+DEFINE_SYSCALL(splice, ufd_idx_t in, ufd_idx_t out, uint32_t len, uint32_t flags) {
+    int32_t ret = -EBADF;
+
+    file_t *fin = ufdt_get(in);
+    if(fin) {
+        file_t *fout = ufdt_get(out);
+        if(fout) {
+            ret = vfs_splice(fin, fout, len, flags);
+
+            ufdt_put(fout);
+        }
+
+        ufdt_put(fin);
+    }
+
+    return ret;
+}
+
 static void read_in_fdset(fd_set *kern, fd_set *user) {
     if(user) {
         *kern = *((fd_set *) user);
@@ -175,6 +239,8 @@ DEFINE_SYSCALL(select, int nfds, void *rfds, void *wfds, void *efds, struct time
                 FD_ISSET(i, &efds_out);
                 num++;
             }
+
+            ufdt_put(fd);
         }
 
         if(!num) {
@@ -220,9 +286,9 @@ DEFINE_SYSCALL(listen, ufd_idx_t ufd, uint32_t backlog) {
     file_t *fd = ufdt_get(ufd);
     if(fd) {
         ret = sock_listen(gfd_to_sock(fd), backlog) ? 0 : -1;
-    }
 
-    ufdt_put(ufd);
+        ufdt_put(fd);
+    }
 
     return ret;
 }
@@ -248,6 +314,8 @@ DEFINE_SYSCALL(accept, ufd_idx_t ufd, struct sockaddr *user_addr, socklen_t *len
                 *len = child->family->addr_len;
             }
         }
+
+        ufdt_put(fd);
     }
 
     return ret;
@@ -277,7 +345,7 @@ DEFINE_SYSCALL(bind, ufd_idx_t ufd, const struct sockaddr *user_addr, socklen_t
             ret = sock_bind(sock, &addr) ? 0 : -1;
         }
 
-        ufdt_put(ufd);
+        ufdt_put(fd);
     }
 
     return ret;
@@ -314,7 +382,7 @@ DEFINE_SYSCALL(connect, ufd_idx_t ufd, const struct sockaddr *user_addr, socklen
             }
         }
 
-        ufdt_put(ufd);
+        ufdt_put(fd);
     }
 
     return ret;
@@ -327,7 +395,7 @@ DEFINE_SYSCALL(shutdown, ufd_idx_t ufd, int how) {
     if(fd) {
         ret = sock_shutdown(gfd_to_sock(fd), how);
 
-        ufdt_put(ufd);
+        ufdt_put(fd);
     }
 
     return ret;
@@ -346,7 +414,7 @@ DEFINE_SYSCALL(send, ufd_idx_t ufd, const void *user_buff, uint32_t buffsize, ui
 
         ret = sock_send(gfd_to_sock(fd), buff, buffsize, flags);
 
-        ufdt_put(ufd);
+        ufdt_put(fd);
     }
 
     return ret;
@@ -361,7 +429,7 @@ DEFINE_SYSCALL(recv, ufd_idx_t ufd, void *user_buff, uint32_t buffsize, uint32_t
 
         ret = sock_recv(gfd_to_sock(fd), user_buff, buffsize, flags);
 
-        ufdt_put(ufd);
+        ufdt_put(fd);
     }
 
     return ret;
@@ -404,7 +472,7 @@ DEFINE_SYSCALL(getdents, ufd_idx_t ufd, struct dirent *user_buff, uint32_t buffs
         }
         kfree(buff);
 
-        ufdt_put(ufd);
+        ufdt_put(fd);
 
         return num * sizeof(struct dirent);
     }
@@ -421,6 +489,7 @@ DEFINE_SYSCALL(stat, const char *pathname, void *buff) {
     int32_t ret = vfs_lookup(&obtain_fs_context(current)->pwd, pathname, &path);
     if(!ret) {
         vfs_getattr(path.dentry, buff);
+        path_put(&path);
     }
 
     return ret;
@@ -433,6 +502,7 @@ DEFINE_SYSCALL(lstat, const char *pathname, void *buff)  {
     int32_t ret = vfs_lookup(&obtain_fs_context(current)->pwd, pathname, &path);
     if(!ret) {
         vfs_getattr(path.dentry, buff);
+        path_put(&path);
     }
 
     return ret;
@@ -445,10 +515,15 @@ DEFINE_SYSCALL(fstat, ufd_idx_t ufd, void *buff) {
     if(fd) {
         //TODO sanitize stat ptr
 
-        vfs_getattr(fd->path.dentry, buff);
-        ret = 0;
+        //FIXME sockets have no inode to describe
+        if(fd->path.dentry) {
+            vfs_getattr(fd->path.dentry, buff);
+            ret = 0;
+        } else {
+            ret = pipe_getattr(fd, buff);
+        }
 
-        ufdt_put(ufd);
+        ufdt_put(fd);
     }
 
     return ret;
@@ -463,7 +538,7 @@ DEFINE_SYSCALL(read, ufd_idx_t ufd, void *user_buff, uint32_t len) {
 
         ret = vfs_read(fd, user_buff, len);
 
-        ufdt_put(ufd);
+        ufdt_put(fd);
     }
 
     return ret;
@@ -478,7 +553,7 @@ DEFINE_SYSCALL(write, ufd_idx_t ufd, const void *buff, uint32_t len) {
 
         ret = vfs_write(fd, buff, len);
 
-        ufdt_put(ufd);
+        ufdt_put(fd);
     }
 
     return ret;
@@ -506,7 +581,9 @@ DEFINE_SYSCALL(execve, const char *pathname, char *const user_argv[], char *cons
         return ret;
     }
 
-    return do_execve(&path, user_argv, user_envp);
+    ret = do_execve(&path, user_argv, user_envp);
+    path_put(&path);
+    return ret;
 }
 
 DEFINE_SYSCALL(fexecve, ufd_idx_t ufd, char *const user_argv[], char *const user_envp[]) {
@@ -515,7 +592,7 @@ DEFINE_SYSCALL(fexecve, ufd_idx_t ufd, char *const user_argv[], char *const user
     file_t *fd = ufdt_get(ufd);
     if(fd) {
         ret = do_execve(&fd->path, user_argv, user_envp);
-        ufdt_put(ufd);
+        ufdt_put(fd);
     }
 
     return ret;
@@ -657,7 +734,11 @@ static int32_t do_chdir(path_t *path) {
     }
 
     //FIXME this desperately needs to be locked
-    obtain_fs_context(current)->pwd = *path;
+    fs_context_t *fs = obtain_fs_context(current);
+    path_t old = fs->pwd;
+    path_get(path);
+    fs->pwd = *path;
+    path_put(&old);
     return 0;
 }
 
@@ -672,7 +753,9 @@ DEFINE_SYSCALL(chdir, const char *pathname) {
         return ret;
     }
 
-    return do_chdir(&path);
+    ret = do_chdir(&path);
+    path_put(&path);
+    return ret;
 }
 
 DEFINE_SYSCALL(fchdir, ufd_idx_t ufd) {
@@ -681,7 +764,9 @@ DEFINE_SYSCALL(fchdir, ufd_idx_t ufd) {
         return -EBADF;
     }
 
-    return do_chdir(&fd->path);
+    int32_t ret = do_chdir(&fd->path);
+    ufdt_put(fd);
+    return ret;
 }
 
 static int32_t do_chown(path_t *path, uid_t owner, gid_t group) {
@@ -705,7 +790,9 @@ DEFINE_SYSCALL(chown, const char *pathname, uid_t owner, gid_t group) {
         return ret;
     }
 
-    return do_chown(&path, owner, group);
+    ret = do_chown(&path, owner, group);
+    path_put(&path);
+    return ret;
 }
 
 DEFINE_SYSCALL(fchown, ufd_idx_t ufd, uid_t owner, gid_t group) {
@@ -714,7 +801,21 @@ DEFINE_SYSCALL(fchown, ufd_idx_t ufd, uid_t owner, gid_t group) {
         return -EBADF;
     }
 
-    return do_chown(&fd->path, owner, group);
+    int32_t ret = do_chown(&fd->path, owner, group);
+    ufdt_put(fd);
+    return ret;
+}
+
+DEFINE_SYSCALL(mkfifo, const char *pathname, uint32_t mode) {
+    if(!pathname) {
+        return -EFAULT;
+    }
+
+    //FIXME actually mask this properly
+    mode &= 0777;
+
+    return vfs_create(&obtain_fs_context(current)->pwd, pathname,
+        S_IFIFO | mode, NULL);
 }
 
 DEFINE_SYSCALL(seek, ufd_idx_t ufd, off_t off, int whence) {
@@ -730,7 +831,7 @@ DEFINE_SYSCALL(seek, ufd_idx_t ufd, off_t off, int whence) {
 
         ret = vfs_seek(fd, off, whence);
 
-        ufdt_put(ufd);
+        ufdt_put(fd);
     }
 
     return ret;
@@ -869,7 +970,9 @@ DEFINE_SYSCALL(tcgetpgrp, ufd_idx_t ufd) {
         return -EBADF;
     }
 
-    return tty_get_pgroup(fd)->leader->pid;
+    pid_t pid = tty_get_pgroup(fd)->leader->pid;
+    ufdt_put(fd);
+    return pid;
 }
 
 DEFINE_SYSCALL(tcsetpgrp, ufd_idx_t ufd, pid_t pgid) {
@@ -880,14 +983,17 @@ DEFINE_SYSCALL(tcsetpgrp, ufd_idx_t ufd, pid_t pgid) {
         return -EBADF;
     }
 
+    int32_t ret = 0;
+
     pgroup_t *pg = pgroup_find(pgid);
-    if(!pg) {
-        return -EPERM;
+    if(pg) {
+        tty_set_pgroup(fd, pg);
+    } else {
+        ret = -EPERM;
     }
 
-    tty_set_pgroup(fd, pg);
-
-    return 0;
+    ufdt_put(fd);
+    return ret;
 }
 
 DEFINE_SYSCALL(dup, ufd_idx_t ufd) {
@@ -896,7 +1002,9 @@ DEFINE_SYSCALL(dup, ufd_idx_t ufd) {
         return -EBADF;
     }
 
-    return ufdt_add(fd);
+    int32_t ret = ufdt_add(fd);
+    ufdt_put(fd);
+    return ret;
 }
 
 DEFINE_SYSCALL(dup2, ufd_idx_t ufd, ufd_idx_t ufd2) {
@@ -909,6 +1017,7 @@ DEFINE_SYSCALL(dup2, ufd_idx_t ufd, ufd_idx_t ufd2) {
         ufdt_replace(ufd2, fd);
     }
 
+    ufdt_put(fd);
     return ufd2;
 }
 
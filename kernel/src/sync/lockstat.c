@@ -0,0 +1,319 @@
+#ifdef CONFIG_LOCK_STAT
+
+#include "common/types.h"
+#include "common/compiler.h"
+#include "common/math.h"
+#include "lib/string.h"
+#include "lib/printf.h"
+#include "init/initcall.h"
+#include "bug/debug.h"
+#include "arch/proc.h"
+#include "arch/tsc.h"
+#include "mm/mm.h"
+#include "sync/spinlock.h"
+#include "sync/lockstat.h"
+#include "sched/proc.h"
+#include "fs/char.h"
+#include "log/log.h"
+
+//Each CPU records into its own table, without taking any locks (it would be
+//recording itself). Readers merge the tables, and put up with the odd torn
+//value from a CPU which is still writing.
+#define LOCKSTAT_ENTRIES 128
+#define LOCKSTAT_PROBES  8
+#define LOCKSTAT_TOP     16
+
+//Waits go in buckets each four times wider than the last, starting at 64
+//cycles, with everything from 256K up in the last
+#define LOCKSTAT_BUCKETS     8
+#define LOCKSTAT_FIRST_SHIFT 6
+
+#define LOCKSTAT_LINE_LEN 192
+
+typedef struct lockstat_entry {
+    volatile spinlock_t *lock;
+    void *callsite;
+
+    uint32_t acquired;
+    uint32_t contended;
+    uint64_t wait_total;
+    uint64_t wait_max;
+    uint64_t hold_total;
+    uint64_t hold_max;
+
+    uint32_t wait_hist[LOCKSTAT_BUCKETS];
+} lockstat_entry_t;
+
+typedef struct lockstat_table {
+    lockstat_entry_t entries[LOCKSTAT_ENTRIES];
+    //Acquisitions which found the table full
+    uint32_t dropped;
+} lockstat_table_t;
+
+static DEFINE_PER_CPU(lockstat_table_t, lockstat_table);
+
+//Where the per-CPU tables are merged for a report
+static lockstat_entry_t merged[LOCKSTAT_ENTRIES];
+static DEFINE_SPINLOCK(merged_lock);
+
+static inline uint32_t hash_key(volatile spinlock_t *lock, void *callsite) {
+    uint32_t h = ((uint32_t) lock) ^ (((uint32_t) callsite) * 2654435761u);
+    return (h ^ (h >> 16)) % LOCKSTAT_ENTRIES;
+}
+
+//Returns the entry for lock and callsite in table, claiming a free one if need
+//be, or NULL if there is no room left
+static lockstat_entry_t * find_entry(lockstat_entry_t *table,
+    volatile spinlock_t *lock, void *callsite) {
+    uint32_t idx = hash_key(lock, callsite);
+    for(uint32_t i = 0; i < LOCKSTAT_PROBES; i++) {
+        lockstat_entry_t *e = &table[(idx + i) % LOCKSTAT_ENTRIES];
+        if(e->lock == lock && e->callsite == callsite) {
+            return e;
+        }
+
+        if(!e->lock) {
+            e->callsite = callsite;
+            e->lock = lock;
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+static uint32_t wait_bucket(uint64_t cycles) {
+    if(cycles < (1 << LOCKSTAT_FIRST_SHIFT)) {
+        return 0;
+    }
+    if(cycles >> 32) {
+        return LOCKSTAT_BUCKETS - 1;
+    }
+
+    uint32_t log2 = 31 - __builtin_clz((uint32_t) cycles);
+    return MIN(LOCKSTAT_BUCKETS - 1, ((log2 - LOCKSTAT_FIRST_SHIFT) / 2) + 1);
+}
+
+void lockstat_acquired(volatile spinlock_t *lock, void *callsite, bool contended,
+    uint64_t start) {
+    spinlock_t *l = (spinlock_t *) lock;
+    l->stat_entry = NULL;
+
+    if(!percpu_up) {
+        return;
+    }
+
+    lockstat_table_t *table = &get_percpu(lockstat_table);
+    lockstat_entry_t *e = find_entry(table->entries, lock, callsite);
+    if(!e) {
+        table->dropped++;
+        return;
+    }
+
+    uint64_t now = rdtsc();
+    uint64_t wait = contended ? now - start : 0;
+
+    e->acquired++;
+    e->wait_hist[wait_bucket(wait)]++;
+    if(contended) {
+        e->contended++;
+        e->wait_total += wait;
+        e->wait_max = MAX(e->wait_max, wait);
+    }
+
+    l->stat_since = now;
+    l->stat_entry = e;
+}
+
+//The entry is in the table of the CPU which took the lock, which is the one
+//releasing it now
+void lockstat_released(volatile spinlock_t *lock) {
+    spinlock_t *l = (spinlock_t *) lock;
+    lockstat_entry_t *e = l->stat_entry;
+    if(!e) {
+        return;
+    }
+
+    uint64_t held = rdtsc() - l->stat_since;
+    e->hold_total += held;
+    e->hold_max = MAX(e->hold_max, held);
+}
+
+//merged_lock must be held. Returns the number of acquisitions dropped.
+static uint32_t merge_tables() {
+    memset(merged, 0, sizeof(merged));
+
+    uint32_t dropped = 0;
+    for(uint32_t cpu = 0; cpu < num_procs; cpu++) {
+        lockstat_table_t *table = &get_percpu_raw(get_proc(cpu)->percpu_data,
+            lockstat_table);
+        dropped += table->dropped;
+
+        for(uint32_t i = 0; i < LOCKSTAT_ENTRIES; i++) {
+            lockstat_entry_t *src = &table->entries[i];
+            if(!src->lock) {
+                continue;
+            }
+
+            lockstat_entry_t *dst = find_entry(merged, src->lock, src->callsite);
+            if(!dst) {
+                dropped += src->acquired;
+                continue;
+            }
+
+            dst->acquired += src->acquired;
+            dst->contended += src->contended;
+            dst->wait_total += src->wait_total;
+            dst->wait_max = MAX(dst->wait_max, src->wait_max);
+            dst->hold_total += src->hold_total;
+            dst->hold_max = MAX(dst->hold_max, src->hold_max);
+            for(uint32_t b = 0; b < LOCKSTAT_BUCKETS; b++) {
+                dst->wait_hist[b] += src->wait_hist[b];
+            }
+        }
+    }
+
+    return dropped;
+}
+
+//merged_lock must be held. Fills top with the entries which have spent the
+//most time waiting, worst first, and returns how many there are.
+static uint32_t find_top(lockstat_entry_t **top) {
+    uint32_t num = 0;
+    for(uint32_t i = 0; i < LOCKSTAT_ENTRIES; i++) {
+        lockstat_entry_t *e = &merged[i];
+        if(!e->lock) {
+            continue;
+        }
+
+        //Insertion sort, keeping only the worst LOCKSTAT_TOP
+        uint32_t pos = num;
+        while(pos && top[pos - 1]->wait_total < e->wait_total) {
+            if(pos < LOCKSTAT_TOP) {
+                top[pos] = top[pos - 1];
+            }
+            pos--;
+        }
+
+        if(pos < LOCKSTAT_TOP) {
+            top[pos] = e;
+            num = MIN(num + 1, LOCKSTAT_TOP);
+        }
+    }
+
+    return num;
+}
+
+static uint32_t render_header(char *buff) {
+    return sprintf(buff, "%-32s %8s %10s %10s %10s %10s %10s %10s"
+        "    <64   <256    <1K    <4K   <16K   <64K  <256K   more",
+        "callsite", "lock", "acquired", "contended", "wait-kcyc", "wait-max",
+        "hold-kcyc", "hold-max");
+}
+
+//Totals are in units of 1024 cycles, maxima in cycles
+static uint32_t render_entry(char *buff, lockstat_entry_t *e) {
+    char where[LOCKSTAT_LINE_LEN];
+    const elf_symbol_t *sym = debug_lookup_symbol((uint32_t) e->callsite);
+    if(sym) {
+        sprintf(where, "%s+%X", debug_symbol_name(sym),
+            ((uint32_t) e->callsite) - sym->value);
+    } else {
+        sprintf(where, "%08X", (uint32_t) e->callsite);
+    }
+
+    uint32_t len = sprintf(buff, "%-32.32s %08X %10u %10u %10u %10u %10u %10u",
+        where, (uint32_t) e->lock, e->acquired, e->contended,
+        (uint32_t) (e->wait_total >> 10), (uint32_t) MIN(e->wait_max, ~0u),
+        (uint32_t) (e->hold_total >> 10), (uint32_t) MIN(e->hold_max, ~0u));
+    for(uint32_t b = 0; b < LOCKSTAT_BUCKETS; b++) {
+        len += sprintf(buff + len, " %6u", e->wait_hist[b]);
+    }
+
+    return len;
+}
+
+void lockstat_dump() {
+    char line[LOCKSTAT_LINE_LEN];
+    lockstat_entry_t *top[LOCKSTAT_TOP];
+
+    uint32_t flags;
+    spin_lock_irqsave(&merged_lock, &flags);
+
+    uint32_t dropped = merge_tables();
+    uint32_t num = find_top(top);
+
+    kprintf("lockstat - top %u of %u lock callsites (%u acquisitions dropped):",
+        num, LOCKSTAT_ENTRIES, dropped);
+    render_header(line);
+    kprint(line);
+    for(uint32_t i = 0; i < num; i++) {
+        render_entry(line, top[i]);
+        kprint(line);
+    }
+
+    spin_unlock_irqstore(&merged_lock, flags);
+}
+
+static ssize_t lockstat_read_at(char_device_t *device, char *buff, size_t len,
+    uint32_t *pos) {
+    char *text = kmalloc((LOCKSTAT_TOP + 1) * LOCKSTAT_LINE_LEN);
+    uint32_t text_len = 0;
+    lockstat_entry_t *top[LOCKSTAT_TOP];
+
+    uint32_t flags;
+    spin_lock_irqsave(&merged_lock, &flags);
+
+    merge_tables();
+    uint32_t num = find_top(top);
+
+    text_len += render_header(text + text_len);
+    text[text_len++] = '\n';
+    for(uint32_t i = 0; i < num; i++) {
+        text_len += render_entry(text + text_len, top[i]);
+        text[text_len++] = '\n';
+    }
+
+    spin_unlock_irqstore(&merged_lock, flags);
+
+    uint32_t amt = 0;
+    if(*pos < text_len) {
+        amt = MIN(len, text_len - *pos);
+        memcpy(buff, text + *pos, amt);
+        *pos += amt;
+    }
+
+    kfree(text);
+
+    return amt;
+}
+
+static ssize_t lockstat_write(char_device_t *device, const char *buff,
+    size_t len) {
+    return -EINVAL;
+}
+
+static ssize_t lockstat_poll(char_device_t *device, fpoll_data_t *fp) {
+    fp->readable = true;
+    fp->writable = false;
+    fp->errored = false;
+    return 0;
+}
+
+static char_device_ops_t lockstat_ops = {
+    .read_at = lockstat_read_at,
+    .write   = lockstat_write,
+    .poll    = lockstat_poll,
+};
+
+static INITCALL lockstat_init() {
+    char_device_t *lockstat = char_device_alloc();
+    lockstat->ops = &lockstat_ops;
+    register_char_device(lockstat, "lockstat");
+
+    return 0;
+}
+
+device_initcall(lockstat_init);
+
+#endif
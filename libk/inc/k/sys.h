@@ -11,4 +11,9 @@ extern void *_data_end;
 
 void _msleep(uint32_t millis);
 
+#define SPLICE_F_NONBLOCK 0x02
+
+int pipe2(int fildes[2], int flags);
+ssize_t splice(int fd_in, int fd_out, size_t len, unsigned int flags);
+
 #endif
@@ -2,7 +2,7 @@
 #include <k/sys.h>
 
 int	mkfifo(const char *path, mode_t mode) {
-    return MAKE_SYSCALL(unimplemented, "mkfifo", true);
+    return MAKE_SYSCALL(mkfifo, path, mode);
 }
 
 mode_t umask(mode_t cmask) {
@@ -162,7 +162,15 @@ unsigned int alarm(unsigned seconds) {
 }
 
 int pipe(int fildes[2]) {
-    return MAKE_SYSCALL(unimplemented, "pipe", true);
+    return MAKE_SYSCALL(pipe, fildes, 0);
+}
+
+int pipe2(int fildes[2], int flags) {
+    return MAKE_SYSCALL(pipe, fildes, flags);
+}
+
+ssize_t splice(int fd_in, int fd_out, size_t len, unsigned int flags) {
+    return MAKE_SYSCALL(splice, fd_in, fd_out, len, flags);
 }
 
 int dup(int fd) {
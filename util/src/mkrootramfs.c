@@ -10,6 +10,7 @@
 #include <time.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 //#define VERBOSE
 
@@ -19,35 +20,53 @@
 #define logf(...) do { } while(0)
 #endif
 
-// 100MB
-#define BUFF_SIZE (100 * (1 << 20))
-
 #define NUM_FDS 256
 
-#define MAGIC "KRFS"
+#define MAGIC "KRF2"
 
-#define ENTRY_TYPE_DIR      1
-#define ENTRY_TYPE_FRECORD  2
+#define BLOCK_SIZE 4096
 
-#define PACKED __attribute__((packed))
+#define ENTRY_FLAG_DIR (1 << 0)
+#define ENTRY_FLAG_LZ4 (1 << 1)
+#define ENTRY_FLAG_SHARED (1 << 2)
 
-typedef struct frecord {
-    uint32_t len;
-} PACKED frecord_t;
+//How far the workers may run ahead of the writer, in files per thread
+#define JOBS_PER_THREAD 8
 
-typedef struct entry {
-    uint8_t type;
-    uint32_t name_len;
-} PACKED entry_t;
+#define FNV64_INIT  0xcbf29ce484222325ULL
+#define FNV64_PRIME 0x100000001b3ULL
+
+#define PACKED __attribute__((packed))
 
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define DIV_UP(a, b) (((a) + (b) - 1) / (b))
+#define ALIGN_UP(a, b) (DIV_UP(a, b) * (b))
+
+//See kernel/src/fs/rootramfs.c for the layout of the image.
 typedef struct rootramfs_header {
     char magic[4];
+    uint32_t num_entries;
+    uint32_t names_off;
+    uint32_t names_len;
 } PACKED rootramfs_header_t;
 
+typedef struct entry {
+    uint32_t parent;
+    uint32_t name_off;
+    uint32_t name_len;
+    uint32_t flags;
+    uint32_t mode;
+    uint32_t size;
+    uint32_t data_off;
+    uint32_t data_len;
+} PACKED entry_t;
+
 static void print_usage() {
     fprintf(stderr, "usage: mkrootramfs [options] in-dir\n");
     fprintf(stderr, "options:\n");
     fprintf(stderr, "    -o outfile\t\tSpecifies the path of the output file.\n \t\t\tDefaults to \"rootramfs\".\n");
+    fprintf(stderr, "    -z\t\t\tCompress file data with LZ4.\n");
+    fprintf(stderr, "    -j threads\t\tNumber of files to read and compress at once.\n \t\t\tDefaults to the number of CPUs.\n");
 }
 
 static bool is_dir(const char *path) {
@@ -57,90 +76,327 @@ static bool is_dir(const char *path) {
    return S_ISDIR(statbuf.st_mode);
 }
 
-#define DIRECTORY_SEPARATOR '/'
+static void * xrealloc(void *ptr, size_t size) {
+    ptr = realloc(ptr, size);
+    if(!ptr) {
+        fprintf(stderr, "error: out of memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+//LZ4 block compression, greedy with a single hash table probe per position.
 
-static void *buff;
-static uint32_t off;
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_RUN_MASK  0xF
+#define LZ4_MAX_OFF   0xFFFF
+//A match may not start in the last 12 bytes, nor cover the last 5
+#define LZ4_MF_LIMIT  12
+#define LZ4_LAST_LITS 5
 
-static void header_alloc() {
-    rootramfs_header_t *h = buff + off;
-    memcpy(h->magic, MAGIC, strlen(MAGIC));
-    off += sizeof(rootramfs_header_t);
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
 }
 
-static void entry_alloc(const char *filepath, uint8_t type) {
-    logf("entry_alloc: %s, %x\n", filepath, type);
-
-    entry_t *e = buff + off;
-    off += sizeof(entry_t);
+static uint8_t * lz4_put_length(uint8_t *op, uint32_t len) {
+    while(len >= 0xFF) {
+        *op++ = 0xFF;
+        len -= 0xFF;
+    }
+    *op++ = len;
+    return op;
+}
 
-    e->type = type;
-    e->name_len = strlen(filepath);
-    memcpy(buff + off, filepath, e->name_len);
-    off += e->name_len;
+//Worst case output for a sequence with the given lengths.
+static uint32_t lz4_sequence_bound(uint32_t lits, uint32_t mlen) {
+    return 1 + (lits / 0xFF + 1) + lits + 2 + (mlen / 0xFF + 1);
 }
 
-static void frecord_alloc(const char *real_filepath) {
-    logf("frecord_alloc: %s (%d/%d)\n", real_filepath, off, BUFF_SIZE);
+static uint8_t * lz4_put_sequence(uint8_t *op, const uint8_t *lits,
+    uint32_t num_lits, uint32_t off, uint32_t mlen, bool last) {
+    uint8_t *token = op++;
+    *token = MIN(num_lits, LZ4_RUN_MASK) << 4;
+    if(num_lits >= LZ4_RUN_MASK) {
+        op = lz4_put_length(op, num_lits - LZ4_RUN_MASK);
+    }
+    memcpy(op, lits, num_lits);
+    op += num_lits;
 
-    frecord_t *f = buff + off;
-    off += sizeof(frecord_t);
+    if(last) {
+        return op;
+    }
 
-    FILE *inf = fopen(real_filepath, "rb");
-    struct stat buf;
-    fstat(fileno(inf), &buf);
-    int32_t b = 0;
-    do {
-        int32_t ret = fread(buff + off + b, sizeof(uint8_t), buf.st_size, inf);
-        if(ret == 0) {
-          perror(NULL);
+    *op++ = off & 0xFF;
+    *op++ = off >> 8;
+
+    mlen -= LZ4_MIN_MATCH;
+    *token |= MIN(mlen, LZ4_RUN_MASK);
+    if(mlen >= LZ4_RUN_MASK) {
+        op = lz4_put_length(op, mlen - LZ4_RUN_MASK);
+    }
+    return op;
+}
+
+//Returns the compressed length, or 0 if the output would exceed cap.
+static uint32_t lz4_compress(const uint8_t *src, uint32_t len, uint8_t *dst,
+    uint32_t cap) {
+    //Positions are stored plus one, so that zero means empty
+    uint32_t table[1 << LZ4_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    const uint8_t *ip = src, *anchor = src, *end = src + len;
+    uint8_t *op = dst, *oend = dst + cap;
+
+    if(len > LZ4_MF_LIMIT) {
+        const uint8_t *mflimit = end - LZ4_MF_LIMIT;
+        const uint8_t *mlimit = end - LZ4_LAST_LITS;
+
+        while(ip < mflimit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = (seq * 2654435761U) >> (32 - LZ4_HASH_BITS);
+            uint32_t cand = table[h];
+            table[h] = ip - src + 1;
+
+            const uint8_t *ref = src + cand - 1;
+            if(!cand || ip - ref > LZ4_MAX_OFF || read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+
+            const uint8_t *mend = ip + LZ4_MIN_MATCH;
+            ref += LZ4_MIN_MATCH;
+            while(mend < mlimit && *mend == *ref) {
+                mend++;
+                ref++;
+            }
+
+            uint32_t lits = ip - anchor, mlen = mend - ip;
+            if(lz4_sequence_bound(lits, mlen) > (uint32_t) (oend - op)) {
+                return 0;
+            }
+
+            op = lz4_put_sequence(op, anchor, lits, ip - (ref - mlen), mlen,
+                false);
+            ip = anchor = mend;
         }
-        if(ret == -1) {
-          printf("could not read file \"%s\"! (%d/%ld) skipping...\n", real_filepath, b, buf.st_size);
-          off -= sizeof(frecord_t);
-          goto out;
+    }
+
+    uint32_t lits = end - anchor;
+    if(lz4_sequence_bound(lits, 0) > (uint32_t) (oend - op)) {
+        return 0;
+    }
+    op = lz4_put_sequence(op, anchor, lits, 0, 0, true);
+
+    return op - dst;
+}
+
+//Every file and directory found, in index order.
+typedef struct node {
+    entry_t e;
+    char *name;
+    char *real_path;
+
+    //Filled in by a worker, once done is set
+    uint64_t hash;
+    uint8_t *data;
+    uint8_t *packed;
+    uint32_t packed_len;
+    bool done;
+} node_t;
+
+static node_t *nodes;
+static uint32_t num_nodes;
+
+//The index of the directory currently being walked at each depth
+static uint32_t *dir_stack;
+static uint32_t dir_stack_len;
+
+static bool compress;
+
+//Indices of the nodes with data to write, in image order. Workers take the
+//next job, while the writer consumes finished ones strictly in order.
+static uint32_t *jobs;
+static uint32_t num_jobs;
+static uint32_t next_job;
+static uint32_t jobs_written;
+static uint32_t jobs_window;
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_room = PTHREAD_COND_INITIALIZER;
+
+//Open addressed, holding node index + 1 of the first file with given contents
+static uint32_t *dedup_table;
+static uint32_t dedup_mask;
+
+static int build_entry(const char *filepath, const struct stat *info, const int typeflag, struct FTW *pathinfo) {
+    if(typeflag != FTW_F && typeflag != FTW_D) {
+        return 0;
+    }
+
+    nodes = xrealloc(nodes, (num_nodes + 1) * sizeof(node_t));
+    node_t *n = &nodes[num_nodes];
+    memset(n, 0, sizeof(node_t));
+
+    n->name = strdup(filepath + pathinfo->base);
+    n->real_path = strdup(filepath);
+    n->e.parent = pathinfo->level ? dir_stack[pathinfo->level - 1] : 0;
+    n->e.name_len = strlen(n->name);
+    n->e.mode = info->st_mode & 07777;
+
+    if(typeflag == FTW_D) {
+        n->e.flags = ENTRY_FLAG_DIR;
+
+        if((uint32_t) pathinfo->level >= dir_stack_len) {
+            dir_stack_len = pathinfo->level + 1;
+            dir_stack = xrealloc(dir_stack, dir_stack_len * sizeof(uint32_t));
         }
-        logf("read: %d/%ld (%d)\n", b, buf.st_size, ret);
-        b += ret;
-    } while(b < buf.st_size);
-    off += buf.st_size;
-    f->len = buf.st_size;
+        dir_stack[pathinfo->level] = num_nodes;
+    } else {
+        n->e.size = info->st_size;
+    }
 
-out:
+    logf("build_entry: %s, %u\n", filepath, n->e.parent);
+
+    num_nodes++;
+    return 0;
+}
+
+static uint8_t * read_file(node_t *n) {
+    uint8_t *data = xrealloc(NULL, ALIGN_UP(n->e.size, BLOCK_SIZE));
+    memset(data + n->e.size, 0, ALIGN_UP(n->e.size, BLOCK_SIZE) - n->e.size);
+
+    FILE *inf = fopen(n->real_path, "rb");
+    if(!inf || fread(data, 1, n->e.size, inf) != n->e.size) {
+        fprintf(stderr, "error: could not read file \"%s\"\n", n->real_path);
+        exit(1);
+    }
     fclose(inf);
+
+    return data;
 }
 
-static int build_entry(const char *orig_filepath, const struct stat *info, const int typeflag, struct FTW *pathinfo) {
-    const char *filepath = orig_filepath;
-    while(*filepath) {
-        if(*filepath == DIRECTORY_SEPARATOR) {
-            filepath++;
-            break;
+//Compress data block by block, behind a table of block offsets. Returns the
+//length of the result, or 0 if compression didn't pay off.
+static uint32_t compress_file(node_t *n, const uint8_t *data, uint8_t **out) {
+    uint32_t blocks = DIV_UP(n->e.size, BLOCK_SIZE);
+    uint32_t table_len = (blocks + 1) * sizeof(uint32_t);
+
+    uint8_t *buff = xrealloc(NULL, table_len + n->e.size);
+    uint32_t *offs = (uint32_t *) buff;
+    uint32_t off = table_len;
+
+    for(uint32_t i = 0; i < blocks; i++) {
+        uint32_t want = MIN(BLOCK_SIZE, n->e.size - (i * BLOCK_SIZE));
+
+        offs[i] = off;
+        uint32_t len = lz4_compress(data + (i * BLOCK_SIZE), want, buff + off,
+            want - 1);
+        if(!len) {
+            memcpy(buff + off, data + (i * BLOCK_SIZE), want);
+            len = want;
         }
+        off += len;
 
-        filepath++;
+        //Plain blocks would take up less room than this
+        if(off >= ALIGN_UP(n->e.size, BLOCK_SIZE)) {
+            free(buff);
+            return 0;
+        }
     }
+    offs[blocks] = off;
 
-    if(!*filepath) return 0;
+    *out = buff;
+    return off;
+}
 
-    if(typeflag == FTW_F) {
-        entry_alloc(filepath, ENTRY_TYPE_FRECORD);
-        frecord_alloc(orig_filepath);
-    } else if(typeflag == FTW_D || typeflag == FTW_DP) {
-        entry_alloc(filepath, ENTRY_TYPE_DIR);
+static uint64_t hash_data(const uint8_t *data, uint32_t len) {
+    uint64_t hash = FNV64_INIT;
+    for(uint32_t i = 0; i < len; i++) {
+        hash = (hash ^ data[i]) * FNV64_PRIME;
     }
+    return hash;
+}
 
-    return 0;
+static void process_file(node_t *n) {
+    n->data = read_file(n);
+    n->hash = hash_data(n->data, n->e.size);
+    if(compress) {
+        n->packed_len = compress_file(n, n->data, &n->packed);
+    }
+}
+
+static void * worker(void *arg) {
+    pthread_mutex_lock(&job_lock);
+    while(next_job < num_jobs) {
+        if(next_job >= jobs_written + jobs_window) {
+            pthread_cond_wait(&job_room, &job_lock);
+            continue;
+        }
+
+        node_t *n = &nodes[jobs[next_job++]];
+        pthread_mutex_unlock(&job_lock);
+
+        process_file(n);
+
+        pthread_mutex_lock(&job_lock);
+        n->done = true;
+        pthread_cond_broadcast(&job_done);
+    }
+    pthread_mutex_unlock(&job_lock);
+
+    return NULL;
+}
+
+//Returns an earlier node with the same contents as n, or NULL (in which case
+//n is remembered for later files).
+static node_t * dedup_find(node_t *n) {
+    uint32_t slot = n->hash & dedup_mask;
+    for(; dedup_table[slot]; slot = (slot + 1) & dedup_mask) {
+        node_t *other = &nodes[dedup_table[slot] - 1];
+        if(other->hash != n->hash || other->e.size != n->e.size) {
+            continue;
+        }
+
+        //The earlier data is long gone, so compare against its file
+        uint8_t *data = read_file(other);
+        bool same = !memcmp(data, n->data, n->e.size);
+        free(data);
+
+        if(same) {
+            return other;
+        }
+    }
+
+    dedup_table[slot] = (n - nodes) + 1;
+    return NULL;
+}
+
+static void write_at(FILE *outf, uint32_t off, const void *buff, uint32_t len) {
+    if(fseek(outf, off, SEEK_SET) || fwrite(buff, 1, len, outf) != len) {
+        perror("error: could not write image");
+        exit(1);
+    }
 }
 
 int main(int argc, char *argv[]) {
     char *outpath = "rootramfs", *indir;
 
-    char c;
-    while((c = getopt (argc, argv, "o:")) != -1) switch (c) {
+    int c;
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    while((c = getopt (argc, argv, "o:zj:")) != -1) switch (c) {
         case 'o':
             outpath = optarg;
             break;
+        case 'j':
+            num_threads = atol(optarg);
+            break;
+        case 'z':
+            compress = true;
+            break;
         case 'h':
         case '?':
         default:
@@ -162,13 +418,123 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    buff = malloc(BUFF_SIZE);
-    header_alloc();
+    if(nftw(indir, build_entry, NUM_FDS, FTW_PHYS)) {
+        perror("error: could not walk input directory");
+        return 1;
+    }
+
+    //The root directory itself has no name
+    nodes[0].e.name_len = 0;
 
-    nftw(indir, build_entry, NUM_FDS, FTW_PHYS);
+    uint32_t names_off = sizeof(rootramfs_header_t) + num_nodes * sizeof(entry_t);
+    uint32_t names_len = 0;
+    for(uint32_t i = 0; i < num_nodes; i++) {
+        nodes[i].e.name_off = names_len;
+        names_len += nodes[i].e.name_len;
+    }
 
     FILE *outf = fopen(outpath, "wb");
-    fwrite(buff, sizeof(uint8_t), off, outf);
+    if(!outf) {
+        perror("error: could not open output file");
+        return 1;
+    }
+
+    jobs = xrealloc(NULL, num_nodes * sizeof(uint32_t));
+    for(uint32_t i = 0; i < num_nodes; i++) {
+        if(!(nodes[i].e.flags & ENTRY_FLAG_DIR) && nodes[i].e.size) {
+            jobs[num_jobs++] = i;
+        }
+    }
+
+    uint32_t table_size = 1;
+    while(table_size < num_jobs * 2) {
+        table_size <<= 1;
+    }
+    dedup_table = calloc(table_size, sizeof(uint32_t));
+    dedup_mask = table_size - 1;
+
+    num_threads = num_threads < 1 ? 1 : num_threads;
+    jobs_window = num_threads * JOBS_PER_THREAD;
+
+    pthread_t *threads = xrealloc(NULL, num_threads * sizeof(pthread_t));
+    for(long i = 0; i < num_threads; i++) {
+        if(pthread_create(&threads[i], NULL, worker, NULL)) {
+            fprintf(stderr, "error: could not start worker thread\n");
+            return 1;
+        }
+    }
+
+    //File data is streamed out first, the index goes in front once known
+    uint32_t off = ALIGN_UP(names_off + names_len, BLOCK_SIZE);
+    uint32_t num_shared = 0;
+    for(uint32_t i = 0; i < num_jobs; i++) {
+        node_t *n = &nodes[jobs[i]];
+
+        pthread_mutex_lock(&job_lock);
+        while(!n->done) {
+            pthread_cond_wait(&job_done, &job_lock);
+        }
+        pthread_mutex_unlock(&job_lock);
+
+        node_t *orig = dedup_find(n);
+        if(orig) {
+            logf("dedup: %s -> %s\n", n->real_path, orig->real_path);
+
+            orig->e.flags |= ENTRY_FLAG_SHARED;
+            n->e.flags |= orig->e.flags;
+            n->e.data_off = orig->e.data_off;
+            n->e.data_len = orig->e.data_len;
+            num_shared++;
+        } else if(n->packed_len) {
+            n->e.flags |= ENTRY_FLAG_LZ4;
+            n->e.data_off = off;
+            n->e.data_len = n->packed_len;
+            write_at(outf, off, n->packed, n->packed_len);
+        } else {
+            n->e.data_off = off;
+            n->e.data_len = ALIGN_UP(n->e.size, BLOCK_SIZE);
+            write_at(outf, off, n->data, n->e.data_len);
+        }
+        if(!orig) {
+            off = ALIGN_UP(off + n->e.data_len, BLOCK_SIZE);
+        }
+
+        free(n->packed);
+        free(n->data);
+        n->packed = n->data = NULL;
+
+        pthread_mutex_lock(&job_lock);
+        jobs_written++;
+        pthread_cond_broadcast(&job_room);
+        pthread_mutex_unlock(&job_lock);
+    }
+
+    for(long i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    logf("%u files, %u deduplicated, %u bytes\n", num_jobs, num_shared, off);
+
+    //Pad the image out to a whole page
+    if(off > ftell(outf)) {
+        uint8_t zero = 0;
+        write_at(outf, off - 1, &zero, 1);
+    }
+
+    rootramfs_header_t hdr;
+    memcpy(hdr.magic, MAGIC, strlen(MAGIC));
+    hdr.num_entries = num_nodes;
+    hdr.names_off = names_off;
+    hdr.names_len = names_len;
+    write_at(outf, 0, &hdr, sizeof(hdr));
+
+    for(uint32_t i = 0; i < num_nodes; i++) {
+        write_at(outf, sizeof(hdr) + i * sizeof(entry_t), &nodes[i].e,
+            sizeof(entry_t));
+        write_at(outf, names_off + nodes[i].e.name_off, nodes[i].name,
+            nodes[i].e.name_len);
+    }
+
     fclose(outf);
 
     return 0;
@@ -0,0 +1,276 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+
+#define MAGIC "KTRC"
+#define VERSION 1
+
+#define PACKED __attribute__((packed))
+
+//See kernel/inc/misc/trace.h for the layout of a dump of /dev/trace.
+#define TRACE_SWITCH  0
+#define TRACE_WAKE    1
+#define TRACE_SYSCALL 2
+#define TRACE_IRQ     3
+#define TRACE_ALLOC   4
+#define TRACE_PACKET  5
+
+#define TRACE_INSTANT 'i'
+#define TRACE_BEGIN   'B'
+#define TRACE_END     'E'
+
+typedef struct trace_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t num_cpus;
+    uint32_t tsc_freq;
+    uint32_t record_size;
+} PACKED trace_header_t;
+
+typedef struct trace_record {
+    uint64_t tsc;
+    uint8_t event;
+    uint8_t phase;
+    uint16_t cpu;
+    uint32_t pid;
+    uint32_t arg0;
+    uint32_t arg1;
+} PACKED trace_record_t;
+
+//Timelines are grouped into two "processes": one thread per CPU, showing
+//which task ran when and the IRQs it took, and one thread per task, showing
+//its syscalls and wakeups.
+#define CPUS_PID  0
+#define TASKS_PID 1
+
+typedef struct record {
+    trace_record_t r;
+    uint32_t order;
+} record_t;
+
+static FILE *out;
+static bool first_event = true;
+static uint64_t base_tsc;
+static double tsc_per_micro;
+
+static void print_usage() {
+    fprintf(stderr, "usage: trace2json [options] dump-file\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "    -o outfile\t\tSpecifies the path of the output file.\n \t\t\tDefaults to standard output.\n");
+}
+
+//Records from different CPUs are interleaved by time. TSCs are assumed to be
+//in sync across CPUs, which the kernel assumes too.
+static int compare_records(const void *a, const void *b) {
+    const record_t *ra = a, *rb = b;
+    if(ra->r.tsc != rb->r.tsc) {
+        return ra->r.tsc < rb->r.tsc ? -1 : 1;
+    }
+    return ra->order < rb->order ? -1 : ra->order > rb->order;
+}
+
+static void begin_event(const char *ph, uint32_t pid, uint32_t tid,
+    uint64_t tsc) {
+    fprintf(out, "%s\n{\"ph\":\"%s\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f",
+        first_event ? "" : ",", ph, pid, tid,
+        (tsc - base_tsc) / tsc_per_micro);
+    first_event = false;
+}
+
+static void name_thread(uint32_t pid, uint32_t tid, const char *fmt,
+    uint32_t arg) {
+    fprintf(out, "%s\n{\"ph\":\"M\",\"pid\":%u,\"tid\":%u,"
+        "\"name\":\"thread_name\",\"args\":{\"name\":\"",
+        first_event ? "" : ",", pid, tid);
+    fprintf(out, fmt, arg);
+    fprintf(out, "\"}}");
+    first_event = false;
+}
+
+static void emit_record(trace_record_t *r, int32_t *running) {
+    switch(r->event) {
+        case TRACE_SWITCH: {
+            //Each CPU shows one slice per stretch a task ran for
+            if(running[r->cpu] >= 0) {
+                begin_event("E", CPUS_PID, r->cpu, r->tsc);
+                fprintf(out, "}");
+            }
+            begin_event("B", CPUS_PID, r->cpu, r->tsc);
+            fprintf(out, ",\"name\":\"pid %u\",\"args\":{\"from\":%u}}",
+                r->arg1, r->arg0);
+            running[r->cpu] = r->arg1;
+            break;
+        }
+        case TRACE_WAKE: {
+            begin_event("i", TASKS_PID, r->arg0, r->tsc);
+            fprintf(out, ",\"s\":\"t\",\"name\":\"wake\","
+                "\"args\":{\"by\":%u,\"cpu\":%u}}", r->pid, r->cpu);
+            break;
+        }
+        case TRACE_SYSCALL: {
+            bool end = r->phase == TRACE_END;
+            begin_event(end ? "E" : "B", TASKS_PID, r->pid, r->tsc);
+            if(end) {
+                fprintf(out, ",\"args\":{\"ret\":%d}}", (int32_t) r->arg1);
+            } else {
+                fprintf(out, ",\"name\":\"syscall %u\",\"args\":{\"cpu\":%u}}",
+                    r->arg0, r->cpu);
+            }
+            break;
+        }
+        case TRACE_IRQ: {
+            bool end = r->phase == TRACE_END;
+            begin_event(end ? "E" : "B", CPUS_PID, r->cpu, r->tsc);
+            if(end) {
+                fprintf(out, "}");
+            } else {
+                fprintf(out, ",\"name\":\"irq 0x%02X\"}", r->arg0);
+            }
+            break;
+        }
+        case TRACE_ALLOC: {
+            begin_event("i", CPUS_PID, r->cpu, r->tsc);
+            fprintf(out, ",\"s\":\"t\",\"name\":\"alloc_pages\","
+                "\"args\":{\"pid\":%u,\"pages\":%u,\"flags\":%u}}",
+                r->pid, r->arg0, r->arg1);
+            break;
+        }
+        case TRACE_PACKET: {
+            begin_event("i", CPUS_PID, r->cpu, r->tsc);
+            fprintf(out, ",\"s\":\"t\",\"name\":\"packet_send\","
+                "\"args\":{\"pid\":%u,\"payload\":%u,\"frame\":%u}}",
+                r->pid, r->arg0, r->arg1);
+            break;
+        }
+        default: {
+            fprintf(stderr, "warning: skipping unknown event %u\n", r->event);
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    char *outpath = NULL, *inpath;
+
+    int c;
+    while((c = getopt (argc, argv, "o:")) != -1) switch (c) {
+        case 'o':
+            outpath = optarg;
+            break;
+        case 'h':
+        case '?':
+        default:
+            print_usage();
+            return 1;
+    }
+
+    if(optind == argc) {
+        fprintf(stderr, "error: you must supply a dump of /dev/trace\n");
+        print_usage();
+        return 1;
+    }
+
+    inpath = argv[optind];
+
+    FILE *in = fopen(inpath, "rb");
+    if(!in) {
+        perror("error: could not open input file");
+        return 1;
+    }
+
+    trace_header_t hdr;
+    if(fread(&hdr, sizeof(hdr), 1, in) != 1 || memcmp(hdr.magic, MAGIC, 4)) {
+        fprintf(stderr, "error: \"%s\" is not a trace dump\n", inpath);
+        return 1;
+    }
+    if(hdr.version != VERSION || hdr.record_size != sizeof(trace_record_t)) {
+        fprintf(stderr, "error: unsupported trace version %u (record size %u)\n",
+            hdr.version, hdr.record_size);
+        return 1;
+    }
+    if(!hdr.tsc_freq) {
+        fprintf(stderr, "error: the TSC frequency is unknown\n");
+        return 1;
+    }
+
+    record_t *records = NULL;
+    uint32_t num_records = 0;
+    for(uint32_t cpu = 0; cpu < hdr.num_cpus; cpu++) {
+        uint32_t count;
+        if(fread(&count, sizeof(count), 1, in) != 1) {
+            fprintf(stderr, "error: truncated trace dump\n");
+            return 1;
+        }
+
+        records = realloc(records, (num_records + count) * sizeof(record_t));
+        if(!records) {
+            perror("error: could not allocate records");
+            return 1;
+        }
+
+        for(uint32_t i = 0; i < count; i++) {
+            record_t *rec = &records[num_records];
+            if(fread(&rec->r, sizeof(trace_record_t), 1, in) != 1) {
+                fprintf(stderr, "error: truncated trace dump\n");
+                return 1;
+            }
+            rec->order = num_records++;
+        }
+    }
+
+    fclose(in);
+
+    qsort(records, num_records, sizeof(record_t), compare_records);
+
+    out = outpath ? fopen(outpath, "w") : stdout;
+    if(!out) {
+        perror("error: could not open output file");
+        return 1;
+    }
+
+    base_tsc = num_records ? records[0].r.tsc : 0;
+    tsc_per_micro = hdr.tsc_freq / 1000000.0;
+
+    int32_t *running = malloc(hdr.num_cpus * sizeof(int32_t));
+    for(uint32_t cpu = 0; cpu < hdr.num_cpus; cpu++) {
+        running[cpu] = -1;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    fprintf(out, "\n{\"ph\":\"M\",\"pid\":%u,\"name\":\"process_name\","
+        "\"args\":{\"name\":\"CPUs\"}},", CPUS_PID);
+    fprintf(out, "\n{\"ph\":\"M\",\"pid\":%u,\"name\":\"process_name\","
+        "\"args\":{\"name\":\"tasks\"}}", TASKS_PID);
+    first_event = false;
+
+    for(uint32_t cpu = 0; cpu < hdr.num_cpus; cpu++) {
+        name_thread(CPUS_PID, cpu, "CPU %u", cpu);
+    }
+
+    for(uint32_t i = 0; i < num_records; i++) {
+        trace_record_t *r = &records[i].r;
+        if(r->cpu >= hdr.num_cpus) {
+            fprintf(stderr, "warning: skipping record from CPU %u\n", r->cpu);
+            continue;
+        }
+
+        emit_record(r, running);
+    }
+
+    fprintf(out, "\n]}\n");
+
+    if(out != stdout) {
+        fclose(out);
+    }
+
+    fprintf(stderr, "%u records from %u CPUs\n", num_records, hdr.num_cpus);
+
+    free(running);
+    free(records);
+
+    return 0;
+}